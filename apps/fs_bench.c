@@ -0,0 +1,632 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define fs_bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Output formats */
+enum {
+	OUTPUT_HUMAN,
+	OUTPUT_CSV,
+	OUTPUT_JSON,
+};
+
+/* Benchmark options */
+static struct {
+	const char *diskname;
+	const char *formatter;
+	size_t data_blocks;
+	size_t block_size;
+	size_t file_size;
+	size_t random_ops;
+	uint64_t seed;
+	int output;
+	int mount_flags;
+} opts = {
+	.formatter = "./fs_make.x",
+	.data_blocks = 8192,
+	.file_size = 8 << 20,
+	.random_ops = 2000,
+	.seed = 150,
+	.output = OUTPUT_HUMAN,
+};
+
+/* File system under test */
+static fs_t *fs;
+
+/* One workload and its measurements */
+struct bench {
+	const char *name;
+	void (*func)(struct bench *b);
+	size_t req_size;
+
+	/* Per-operation latencies (in nanoseconds) */
+	uint64_t *lat;
+	size_t nops;
+	size_t cap;
+
+	/* Bytes transferred, elapsed time and block I/O of the measured part */
+	size_t bytes;
+	uint64_t start_ns;
+	uint64_t total_ns;
+	struct block_stats io;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Reproducible pseudo-random generator (xorshift64*) */
+static uint64_t rng_state;
+
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static void fill_pattern(char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = 'a' + (rng_next() % 26);
+}
+
+/* Format a fresh image with the formatter program */
+static void format_disk(void)
+{
+	char count[32], block_size[32];
+	pid_t pid;
+	int status;
+
+	snprintf(count, sizeof(count), "%zu", opts.data_blocks);
+	snprintf(block_size, sizeof(block_size), "%zu", opts.block_size);
+	unlink(opts.diskname);
+
+	pid = fork();
+	if (pid < 0)
+		die_perror("fork");
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+
+		if (null >= 0)
+			dup2(null, STDOUT_FILENO);
+		/* The block size is left to the formatter unless one is given */
+		if (opts.block_size)
+			execl(opts.formatter, opts.formatter, "-b", block_size,
+			      opts.diskname, count, (char *)NULL);
+		else
+			execl(opts.formatter, opts.formatter, opts.diskname,
+			      count, (char *)NULL);
+		die_perror("execl");
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		die_perror("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		die("Cannot format '%s' with '%s'", opts.diskname,
+		    opts.formatter);
+}
+
+/* Start measuring: everything done before is setup */
+static void bench_begin(struct bench *b)
+{
+	block_stats_reset();
+	b->start_ns = now_ns();
+}
+
+static void bench_end(struct bench *b)
+{
+	b->total_ns = now_ns() - b->start_ns;
+	block_stats_get(&b->io);
+}
+
+static void bench_op(struct bench *b, uint64_t op_start, size_t bytes)
+{
+	if (b->nops == b->cap) {
+		b->cap = b->cap ? b->cap * 2 : 1024;
+		b->lat = realloc(b->lat, b->cap * sizeof(*b->lat));
+		if (!b->lat)
+			die_perror("realloc");
+	}
+	b->lat[b->nops++] = now_ns() - op_start;
+	b->bytes += bytes;
+}
+
+static int open_new(const char *filename)
+{
+	int fs_fd;
+
+	if (fs_create_ctx(fs, filename))
+		die("Cannot create file '%s'", filename);
+	fs_fd = fs_open_ctx(fs, filename);
+	if (fs_fd < 0)
+		die("Cannot open file '%s'", filename);
+	return fs_fd;
+}
+
+/* Write a whole file of opts.file_size bytes, in requests of @req_size */
+static void write_file(struct bench *b, int fs_fd, size_t req_size)
+{
+	char *buf = malloc(req_size);
+	size_t done;
+
+	if (!buf)
+		die_perror("malloc");
+	fill_pattern(buf, req_size);
+
+	for (done = 0; done < opts.file_size; done += req_size) {
+		uint64_t start = now_ns();
+
+		if (fs_write_ctx(fs, fs_fd, buf, req_size) != (int)req_size)
+			die("short write at offset %zu", done);
+		if (b)
+			bench_op(b, start, req_size);
+	}
+
+	free(buf);
+}
+
+static void bench_seq_write(struct bench *b)
+{
+	int fs_fd = open_new("seq");
+
+	bench_begin(b);
+	write_file(b, fs_fd, b->req_size);
+	bench_end(b);
+
+	fs_close_ctx(fs, fs_fd);
+}
+
+static void bench_seq_read(struct bench *b)
+{
+	int fs_fd = open_new("seq");
+	char *buf = malloc(b->req_size);
+
+	if (!buf)
+		die_perror("malloc");
+	write_file(NULL, fs_fd, BLOCK_SIZE);
+	fs_lseek_ctx(fs, fs_fd, 0);
+
+	bench_begin(b);
+	for (size_t done = 0; done < opts.file_size; done += b->req_size) {
+		uint64_t start = now_ns();
+
+		if (fs_read_ctx(fs, fs_fd, buf, b->req_size) != (int)b->req_size)
+			die("short read at offset %zu", done);
+		bench_op(b, start, b->req_size);
+	}
+	bench_end(b);
+
+	free(buf);
+	fs_close_ctx(fs, fs_fd);
+}
+
+/* Maximum number of spans borrowed at once by the map-read workloads */
+#define MAP_SPANS 512
+
+static void bench_map_read(struct bench *b)
+{
+	int fs_fd = open_new("seq");
+	struct iovec iov[MAP_SPANS];
+	volatile uint64_t total;
+	uint64_t sum = 0;
+
+	write_file(NULL, fs_fd, BLOCK_SIZE);
+	fs_lseek_ctx(fs, fs_fd, 0);
+
+	/* Data is looked at in place (summed) instead of being copied */
+	bench_begin(b);
+	for (size_t done = 0; done < opts.file_size; done += b->req_size) {
+		uint64_t start = now_ns();
+		size_t len = 0;
+		int n;
+
+		n = fs_read_map_ctx(fs, fs_fd, iov, MAP_SPANS, b->req_size);
+		for (int i = 0; i < n; i++) {
+			const uint64_t *p = iov[i].iov_base;
+
+			for (size_t j = 0; j < iov[i].iov_len / sizeof(*p); j++)
+				sum += p[j];
+			len += iov[i].iov_len;
+		}
+		if (n < 0 || len != b->req_size ||
+		    fs_read_release_ctx(fs, iov, n))
+			die("short map at offset %zu", done);
+		bench_op(b, start, b->req_size);
+	}
+	bench_end(b);
+	total = sum;
+	(void)total;
+
+	fs_close_ctx(fs, fs_fd);
+}
+
+static void bench_random(struct bench *b, int write)
+{
+	int fs_fd = open_new("rand");
+	size_t slots = opts.file_size / b->req_size;
+	char *buf = malloc(b->req_size);
+
+	if (!buf)
+		die_perror("malloc");
+	fill_pattern(buf, b->req_size);
+	write_file(NULL, fs_fd, BLOCK_SIZE);
+
+	bench_begin(b);
+	for (size_t i = 0; i < opts.random_ops; i++) {
+		size_t offset = (rng_next() % slots) * b->req_size;
+		uint64_t start = now_ns();
+		int ret;
+
+		fs_lseek_ctx(fs, fs_fd, offset);
+		if (write)
+			ret = fs_write_ctx(fs, fs_fd, buf, b->req_size);
+		else
+			ret = fs_read_ctx(fs, fs_fd, buf, b->req_size);
+		if (ret != (int)b->req_size)
+			die("short transfer at offset %zu", offset);
+		bench_op(b, start, b->req_size);
+	}
+	bench_end(b);
+
+	free(buf);
+	fs_close_ctx(fs, fs_fd);
+}
+
+static void bench_rand_write(struct bench *b)
+{
+	bench_random(b, 1);
+}
+
+static void bench_rand_read(struct bench *b)
+{
+	bench_random(b, 0);
+}
+
+/* Number of small files alive at once in the churn workload */
+#define CHURN_FILES 64
+/* Number of create/write/delete cycles in the churn workload */
+#define CHURN_OPS 2000
+
+static void bench_churn(struct bench *b)
+{
+	char *buf = malloc(b->req_size);
+	char filename[FS_FILENAME_LEN];
+
+	if (!buf)
+		die_perror("malloc");
+	fill_pattern(buf, b->req_size);
+
+	bench_begin(b);
+	for (size_t i = 0; i < CHURN_OPS; i++) {
+		uint64_t start = now_ns();
+		int fs_fd;
+
+		/* Recycle the oldest file once the working set is full */
+		snprintf(filename, sizeof(filename), "churn%zu",
+			 i % CHURN_FILES);
+		if (i >= CHURN_FILES && fs_delete_ctx(fs, filename))
+			die("Cannot delete file '%s'", filename);
+
+		fs_fd = open_new(filename);
+		if (fs_write_ctx(fs, fs_fd, buf, b->req_size) != (int)b->req_size)
+			die("short write in '%s'", filename);
+		fs_close_ctx(fs, fs_fd);
+		bench_op(b, start, b->req_size);
+	}
+	bench_end(b);
+
+	free(buf);
+}
+
+/* Number of records appended in the append workloads */
+#define APPEND_OPS 20000
+
+/* Append records to a new file, seeking to its end before each one unless it is
+ * opened with FS_O_APPEND */
+static void append_records(struct bench *b, int flags)
+{
+	int fs_fd;
+	char *buf = malloc(b->req_size);
+
+	if (!buf)
+		die_perror("malloc");
+	fill_pattern(buf, b->req_size);
+
+	if (fs_create_ctx(fs, "log"))
+		die("Cannot create file 'log'");
+	fs_fd = fs_open_flags_ctx(fs, "log", flags);
+	if (fs_fd < 0)
+		die("Cannot open file 'log'");
+
+	bench_begin(b);
+	for (size_t i = 0; i < APPEND_OPS; i++) {
+		uint64_t start = now_ns();
+
+		if (!(flags & FS_O_APPEND))
+			fs_lseek_ctx(fs, fs_fd, fs_stat_ctx(fs, fs_fd));
+		if (fs_write_ctx(fs, fs_fd, buf, b->req_size) != (int)b->req_size)
+			die("short append at record %zu", i);
+		bench_op(b, start, b->req_size);
+	}
+	bench_end(b);
+
+	free(buf);
+	fs_close_ctx(fs, fs_fd);
+}
+
+static void bench_append(struct bench *b)
+{
+	append_records(b, 0);
+}
+
+static void bench_append_mode(struct bench *b)
+{
+	append_records(b, FS_O_APPEND);
+}
+
+static void bench_fill(struct bench *b)
+{
+	int fs_fd = open_new("fill");
+	char *buf = malloc(b->req_size);
+	int written;
+
+	if (!buf)
+		die_perror("malloc");
+	fill_pattern(buf, b->req_size);
+
+	bench_begin(b);
+	do {
+		uint64_t start = now_ns();
+
+		written = fs_write_ctx(fs, fs_fd, buf, b->req_size);
+		if (written < 0)
+			die("write error");
+		bench_op(b, start, written);
+	} while (written == (int)b->req_size);
+	bench_end(b);
+
+	free(buf);
+	fs_close_ctx(fs, fs_fd);
+}
+
+static struct bench benches[] = {
+	{ "seq-write-4k",	bench_seq_write,	4 << 10 },
+	{ "seq-write-64k",	bench_seq_write,	64 << 10 },
+	{ "seq-write-1m",	bench_seq_write,	1 << 20 },
+	{ "seq-read-4k",	bench_seq_read,		4 << 10 },
+	{ "seq-read-64k",	bench_seq_read,		64 << 10 },
+	{ "seq-read-1m",	bench_seq_read,		1 << 20 },
+	{ "map-read-64k",	bench_map_read,		64 << 10 },
+	{ "map-read-1m",	bench_map_read,		1 << 20 },
+	{ "rand-write-512",	bench_rand_write,	512 },
+	{ "rand-write-4k",	bench_rand_write,	4 << 10 },
+	{ "rand-write-64k",	bench_rand_write,	64 << 10 },
+	{ "rand-read-512",	bench_rand_read,	512 },
+	{ "rand-read-4k",	bench_rand_read,	4 << 10 },
+	{ "rand-read-64k",	bench_rand_read,	64 << 10 },
+	{ "churn-1k",		bench_churn,		1 << 10 },
+	{ "append-128",		bench_append,		128 },
+	{ "append-o-128",	bench_append_mode,	128 },
+	{ "fill-64k",		bench_fill,		64 << 10 },
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Latency percentile (in microseconds) of a sorted latency array */
+static double percentile(struct bench *b, double p)
+{
+	size_t i;
+
+	if (!b->nops)
+		return 0;
+	i = (size_t)(p * (b->nops - 1) + 0.5);
+	return b->lat[i] / 1000.0;
+}
+
+static void report(struct bench *b, int first, int last)
+{
+	double secs = b->total_ns / 1e9;
+	double mbps = secs ? b->bytes / secs / (1 << 20) : 0;
+	double opss = secs ? b->nops / secs : 0;
+	double p50, p99, p999;
+
+	qsort(b->lat, b->nops, sizeof(*b->lat), cmp_u64);
+	p50 = percentile(b, 0.50);
+	p99 = percentile(b, 0.99);
+	p999 = percentile(b, 0.999);
+
+	switch (opts.output) {
+	case OUTPUT_HUMAN:
+		if (first)
+			printf("%-16s %8s %10s %10s %10s %10s %10s %10s %10s\n",
+			       "workload", "ops", "MB/s", "ops/s", "p50_us",
+			       "p99_us", "p999_us", "blk_rd", "blk_wr");
+		printf("%-16s %8zu %10.2f %10.0f %10.1f %10.1f %10.1f %10zu %10zu\n",
+		       b->name, b->nops, mbps, opss, p50, p99, p999,
+		       b->io.reads, b->io.writes);
+		break;
+	case OUTPUT_CSV:
+		if (first)
+			printf("workload,req_size,ops,bytes,seconds,mb_per_s,"
+			       "ops_per_s,p50_us,p99_us,p999_us,blk_reads,"
+			       "blk_writes\n");
+		printf("%s,%zu,%zu,%zu,%.6f,%.3f,%.1f,%.1f,%.1f,%.1f,%zu,%zu\n",
+		       b->name, b->req_size, b->nops, b->bytes, secs, mbps,
+		       opss, p50, p99, p999, b->io.reads, b->io.writes);
+		break;
+	case OUTPUT_JSON:
+		if (first)
+			printf("[\n");
+		printf("  {\"workload\": \"%s\", \"req_size\": %zu, "
+		       "\"ops\": %zu, \"bytes\": %zu, \"seconds\": %.6f, "
+		       "\"mb_per_s\": %.3f, \"ops_per_s\": %.1f, "
+		       "\"p50_us\": %.1f, \"p99_us\": %.1f, "
+		       "\"p999_us\": %.1f, \"blk_reads\": %zu, "
+		       "\"blk_writes\": %zu}%s\n",
+		       b->name, b->req_size, b->nops, b->bytes, secs, mbps,
+		       opss, p50, p99, p999, b->io.reads, b->io.writes,
+		       last ? "" : ",");
+		if (last)
+			printf("]\n");
+		break;
+	}
+	fflush(stdout);
+}
+
+static void run(struct bench *b, int first, int last)
+{
+	/* Every workload starts from the same state */
+	rng_state = opts.seed ? opts.seed : 1;
+	format_disk();
+
+	fs = fs_mount_flags(opts.diskname, opts.mount_flags);
+	if (!fs)
+		die("Cannot mount diskname");
+	b->func(b);
+	if (fs_umount_ctx(fs))
+		die("Cannot unmount diskname");
+
+	report(b, first, last);
+	free(b->lat);
+	b->lat = NULL;
+}
+
+static void usage(char *program)
+{
+	size_t i;
+
+	fprintf(stderr, "Usage: %s [-o human|csv|json] [-n <data blocks>] "
+		"[-b <block size>] [-f <file size>] [-r <random ops>] [-s <seed>] "
+		"[-m <formatter>] [-D] [-H] [-C] [-U] [-W] <diskname> [<workload>...]\n",
+		program);
+	fprintf(stderr, "\t-D: direct I/O, -H: huge pages, -C: compression, "
+		"-U: deduplication,\n\t-W: background writeback\n");
+	fprintf(stderr, "Possible workloads are:\n");
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+		fprintf(stderr, "\t%s\n", benches[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench *selected[ARRAY_SIZE(benches)];
+	size_t i, nselected = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "o:n:b:f:r:s:m:DHCUW")) != -1) {
+		switch (c) {
+		case 'o':
+			if (!strcmp(optarg, "human"))
+				opts.output = OUTPUT_HUMAN;
+			else if (!strcmp(optarg, "csv"))
+				opts.output = OUTPUT_CSV;
+			else if (!strcmp(optarg, "json"))
+				opts.output = OUTPUT_JSON;
+			else
+				usage(argv[0]);
+			break;
+		case 'n':
+			opts.data_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			opts.block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			opts.file_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.random_ops = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opts.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'm':
+			opts.formatter = optarg;
+			break;
+		case 'D':
+			opts.mount_flags |= FS_MOUNT_DIRECT;
+			break;
+		case 'H':
+			opts.mount_flags |= FS_MOUNT_HUGEPAGES;
+			break;
+		case 'C':
+			opts.mount_flags |= FS_MOUNT_COMPRESS;
+			break;
+		case 'U':
+			opts.mount_flags |= FS_MOUNT_DEDUP;
+			break;
+		case 'W':
+			opts.mount_flags |= FS_MOUNT_WRITEBACK;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc)
+		usage(argv[0]);
+	opts.diskname = argv[optind++];
+
+	/* The file used by sequential and random workloads must hold whole
+	 * requests of every size */
+	if (!opts.file_size || opts.file_size % (1 << 20))
+		die("file size must be a multiple of 1MiB");
+
+	for (; optind < argc; optind++) {
+		if (nselected == ARRAY_SIZE(benches))
+			die("too many workloads");
+		for (i = 0; i < ARRAY_SIZE(benches); i++)
+			if (!strcmp(argv[optind], benches[i].name))
+				break;
+		if (i == ARRAY_SIZE(benches)) {
+			fs_bench_error("invalid workload '%s'", argv[optind]);
+			usage(argv[0]);
+		}
+		selected[nselected++] = &benches[i];
+	}
+	if (!nselected)
+		for (i = 0; i < ARRAY_SIZE(benches); i++)
+			selected[nselected++] = &benches[i];
+
+	for (i = 0; i < nselected; i++)
+		run(selected[i], i == 0, i == nselected - 1);
+
+	return 0;
+}
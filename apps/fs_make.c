@@ -0,0 +1,67 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-p] [-b <block size>] <diskname> "
+		"<data block count>\n", program);
+	fprintf(stderr, "\t-p: allocate the host storage of the whole image\n");
+	fprintf(stderr, "\t-b: size of the blocks in bytes, a power of two in "
+		"[%d, %d] (default %d)\n", BLOCK_SIZE_MIN, BLOCK_SIZE_MAX,
+		BLOCK_SIZE);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long data_blocks, block_size = BLOCK_SIZE;
+	int flags = 0;
+	char *end;
+	int c;
+
+	while ((c = getopt(argc, argv, "pb:")) != -1) {
+		switch (c) {
+		case 'p':
+			flags |= FS_FORMAT_PREALLOC;
+			break;
+		case 'b':
+			block_size = strtoul(optarg, &end, 0);
+			if (*end || block_size < BLOCK_SIZE_MIN ||
+			    block_size > BLOCK_SIZE_MAX ||
+			    (block_size & (block_size - 1)))
+				die("block size invalid, must be a power of two "
+				    "in [%d, %d]", BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	data_blocks = strtoul(argv[optind + 1], &end, 0);
+	if (*end || data_blocks < 1 || data_blocks > FS_DATA_BLOCK_MAX)
+		die("data block count invalid, range is [1, %d]",
+		    FS_DATA_BLOCK_MAX);
+
+	if (fs_format(argv[optind], data_blocks, block_size, flags))
+		die("Cannot create virtual disk '%s'", argv[optind]);
+
+	printf("Created virtual disk '%s' with '%lu' data blocks\n",
+	       argv[optind], data_blocks);
+
+	return 0;
+}
@@ -0,0 +1,719 @@
+#define _GNU_SOURCE /* for accept4() */
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <proto.h>
+
+#define fs_server_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_server_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Default number of worker threads */
+#define SERVER_THREADS 4
+
+/* Receive buffers grow by at least this much */
+#define SERVER_RECV_CHUNK (64 << 10)
+
+/* Pending replies are sent once they reach this size, or once every received
+ * request has been performed */
+#define SERVER_SEND_BATCH (256 << 10)
+
+/* Host descriptors received by a connection and not used yet */
+#define SERVER_PASSED_FDS 16
+
+/* Client connection */
+struct conn {
+	int sock;
+
+	/* Connections ready to be served, and all connections */
+	struct conn *next_ready;
+	struct conn *prev, *next;
+
+	/* Received requests not performed yet */
+	char *in;
+	size_t in_len, in_cap;
+
+	/* Replies not sent yet */
+	char *out;
+	size_t out_len, out_cap;
+
+	/* The socket is full: no request is performed until there is room */
+	int blocked;
+
+	/* Host descriptors passed along with the requests, in order */
+	int passed[SERVER_PASSED_FDS];
+	int npassed;
+
+	/* File descriptors opened by the client: owned[fd] is set */
+	char *owned;
+	size_t owned_len;
+};
+
+static struct {
+	fs_t *fs;
+	int epoll;
+
+	/* Queue of ready connections and list of connections */
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct conn *ready_head, *ready_tail;
+	struct conn *conns;
+	int stop;
+} server = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+};
+
+static int reserve(char **buf, size_t *cap, size_t len)
+{
+	char *grown;
+	size_t new_cap;
+
+	if (len <= *cap)
+		return 0;
+
+	new_cap = *cap ? *cap : SERVER_RECV_CHUNK;
+	while (new_cap < len)
+		new_cap *= 2;
+	grown = realloc(*buf, new_cap);
+	if (!grown)
+		return -1;
+	*buf = grown;
+	*cap = new_cap;
+
+	return 0;
+}
+
+static struct conn *conn_new(int sock)
+{
+	struct conn *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return NULL;
+	c->sock = sock;
+
+	pthread_mutex_lock(&server.lock);
+	c->next = server.conns;
+	if (server.conns)
+		server.conns->prev = c;
+	server.conns = c;
+	pthread_mutex_unlock(&server.lock);
+
+	return c;
+}
+
+static void conn_close(struct conn *c)
+{
+	size_t fd;
+	int i;
+
+	pthread_mutex_lock(&server.lock);
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		server.conns = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	pthread_mutex_unlock(&server.lock);
+
+	/* Descriptors left open by the client */
+	for (fd = 0; fd < c->owned_len; fd++)
+		if (c->owned[fd])
+			fs_close_ctx(server.fs, fd);
+	for (i = 0; i < c->npassed; i++)
+		close(c->passed[i]);
+
+	close(c->sock);
+	free(c->owned);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+static int conn_owns(struct conn *c, int fd)
+{
+	return fd >= 0 && (size_t)fd < c->owned_len && c->owned[fd];
+}
+
+static int conn_own(struct conn *c, int fd)
+{
+	if ((size_t)fd >= c->owned_len) {
+		size_t len = c->owned_len ? c->owned_len : 32;
+		char *grown;
+
+		while (len <= (size_t)fd)
+			len *= 2;
+		grown = realloc(c->owned, len);
+		if (!grown)
+			return -1;
+		memset(grown + c->owned_len, 0, len - c->owned_len);
+		c->owned = grown;
+		c->owned_len = len;
+	}
+	c->owned[fd] = 1;
+
+	return 0;
+}
+
+/* Take the oldest host descriptor passed by the client, or return -1 */
+static int conn_take_passed(struct conn *c)
+{
+	int fd;
+
+	if (!c->npassed)
+		return -1;
+	fd = c->passed[0];
+	memmove(c->passed, c->passed + 1, --c->npassed * sizeof(int));
+
+	return fd;
+}
+
+/* Send the pending replies the socket has room for, and keep the rest until
+ * it has room again (@c->blocked) */
+static int conn_flush(struct conn *c)
+{
+	size_t done = 0;
+
+	c->blocked = 0;
+	while (done < c->out_len) {
+		ssize_t n = send(c->sock, c->out + done, c->out_len - done,
+				 MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (n < 0 && errno == EAGAIN) {
+			c->blocked = 1;
+			break;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		done += n;
+	}
+	memmove(c->out, c->out + done, c->out_len - done);
+	c->out_len -= done;
+
+	return 0;
+}
+
+/* Receive what is available, along with passed host descriptors. Return the
+ * number of bytes received, 0 if the client is gone, or -1. */
+static ssize_t conn_recv(struct conn *c, size_t need)
+{
+	char control[CMSG_SPACE(SERVER_PASSED_FDS * sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	if (need < c->in_len + SERVER_RECV_CHUNK)
+		need = c->in_len + SERVER_RECV_CHUNK;
+	if (reserve(&c->in, &c->in_cap, need))
+		return -1;
+	iov.iov_base = c->in + c->in_len;
+	iov.iov_len = c->in_cap - c->in_len;
+
+	n = recvmsg(c->sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n < 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		size_t i, nfds;
+
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nfds; i++) {
+			int fd;
+
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (c->npassed < SERVER_PASSED_FDS)
+				c->passed[c->npassed++] = fd;
+			else
+				close(fd);
+		}
+	}
+	c->in_len += n;
+
+	return n;
+}
+
+/* Run fs_info_file_ctx() or fs_ls_file_ctx() into a memory stream, and
+ * append their output to the replies. Return the payload length, or -1. */
+static ssize_t capture(struct conn *c, int (*func)(fs_t *fs, FILE *f), int *ret)
+{
+	char *text = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *f;
+
+	f = open_memstream(&text, &size);
+	if (!f)
+		return -1;
+	*ret = func(server.fs, f);
+	if (fclose(f)) {
+		free(text);
+		return -1;
+	}
+
+	len = size;
+	if (reserve(&c->out, &c->out_cap, c->out_len + len))
+		len = -1;
+	else
+		memcpy(c->out + c->out_len, text, len);
+	free(text);
+
+	return len;
+}
+
+/* Check that @payload holds a name, or two for PROTO_CLONE */
+static const char *payload_name(const char *payload, size_t len, int op)
+{
+	const char *end = memchr(payload, '\0', len);
+
+	if (!end)
+		return NULL;
+	if (op == PROTO_CLONE &&
+	    !memchr(end + 1, '\0', len - (end + 1 - payload)))
+		return NULL;
+
+	return payload;
+}
+
+/* Perform request @req and queue its reply */
+static int perform(struct conn *c, struct proto_req *req, char *payload)
+{
+	struct proto_rep rep = { .id = req->id, .ret = -1 };
+	size_t rep_off = c->out_len;
+	const char *name = NULL;
+	ssize_t len;
+	int host_fd, ret;
+
+	if (reserve(&c->out, &c->out_cap, c->out_len + sizeof(rep)))
+		return -1;
+	c->out_len += sizeof(rep);
+
+	switch (req->op) {
+	case PROTO_CREATE:
+	case PROTO_DELETE:
+	case PROTO_OPEN:
+	case PROTO_CLONE:
+	case PROTO_SNAPSHOT_CREATE:
+	case PROTO_SNAPSHOT_DELETE:
+		name = payload_name(payload, req->len, req->op);
+		if (!name)
+			goto reply;
+		break;
+	case PROTO_CLOSE:
+	case PROTO_STAT:
+	case PROTO_LSEEK:
+	case PROTO_WRITE:
+	case PROTO_READ:
+	case PROTO_ADVISE:
+		if (!conn_owns(c, req->fd))
+			goto reply;
+		break;
+	case PROTO_COPY_TO_FD:
+	case PROTO_COPY_FROM_FD:
+		/* The passed descriptor is consumed even if the request fails */
+		host_fd = conn_take_passed(c);
+		if (host_fd < 0)
+			goto reply;
+		if (conn_owns(c, req->fd) && req->op == PROTO_COPY_TO_FD)
+			rep.ret = fs_copy_to_fd_ctx(server.fs, req->fd, host_fd,
+						    req->arg0, req->arg1);
+		else if (conn_owns(c, req->fd))
+			rep.ret = fs_copy_from_fd_ctx(server.fs, req->fd, host_fd,
+						      req->arg0, req->arg1);
+		close(host_fd);
+		goto reply;
+	}
+
+	switch (req->op) {
+	case PROTO_INFO:
+	case PROTO_LS:
+		len = capture(c, req->op == PROTO_INFO ? fs_info_file_ctx :
+			      fs_ls_file_ctx, &ret);
+		if (len >= 0) {
+			rep.ret = ret;
+			rep.len = len;
+		}
+		break;
+	case PROTO_CREATE:
+		rep.ret = fs_create_ctx(server.fs, name);
+		break;
+	case PROTO_DELETE:
+		rep.ret = fs_delete_ctx(server.fs, name);
+		break;
+	case PROTO_OPEN:
+		rep.ret = fs_open_flags_ctx(server.fs, name, req->arg0);
+		if (rep.ret >= 0 && conn_own(c, rep.ret)) {
+			fs_close_ctx(server.fs, rep.ret);
+			rep.ret = -1;
+		}
+		break;
+	case PROTO_CLOSE:
+		rep.ret = fs_close_ctx(server.fs, req->fd);
+		c->owned[req->fd] = 0;
+		break;
+	case PROTO_STAT:
+		rep.ret = fs_stat_ctx(server.fs, req->fd);
+		break;
+	case PROTO_LSEEK:
+		rep.ret = fs_lseek_ctx(server.fs, req->fd, req->arg0);
+		break;
+	case PROTO_WRITE:
+		rep.ret = fs_write_ctx(server.fs, req->fd, payload, req->len);
+		break;
+	case PROTO_READ:
+		if (req->arg0 > PROTO_PAYLOAD_MAX)
+			break;
+		if (reserve(&c->out, &c->out_cap, c->out_len + req->arg0))
+			return -1;
+		rep.ret = fs_read_ctx(server.fs, req->fd, c->out + c->out_len,
+				      req->arg0);
+		if (rep.ret > 0)
+			rep.len = rep.ret;
+		break;
+	case PROTO_ADVISE:
+		rep.ret = fs_advise_ctx(server.fs, req->fd, req->arg0,
+					req->arg1, req->arg2);
+		break;
+	case PROTO_TRIM:
+		rep.ret = fs_trim_ctx(server.fs);
+		break;
+	case PROTO_CLONE:
+		rep.ret = fs_clone_ctx(server.fs, name, name + strlen(name) + 1);
+		break;
+	case PROTO_SNAPSHOT_CREATE:
+		rep.ret = fs_snapshot_create_ctx(server.fs, name);
+		break;
+	case PROTO_SNAPSHOT_DELETE:
+		rep.ret = fs_snapshot_delete_ctx(server.fs, name);
+		break;
+	}
+
+reply:
+	c->out_len += rep.len;
+	memcpy(c->out + rep_off, &rep, sizeof(rep));
+
+	return 0;
+}
+
+/* Perform the complete requests received so far */
+static int conn_perform(struct conn *c, size_t *need)
+{
+	struct proto_req req;
+	size_t pos = 0;
+
+	*need = 0;
+	while (c->in_len - pos >= sizeof(req)) {
+		memcpy(&req, c->in + pos, sizeof(req));
+		if (req.len > PROTO_PAYLOAD_MAX)
+			return -1;
+		if (c->in_len - pos < sizeof(req) + req.len) {
+			*need = sizeof(req) + req.len;
+			break;
+		}
+		if (perform(c, &req, c->in + pos + sizeof(req)))
+			return -1;
+		pos += sizeof(req) + req.len;
+
+		if (c->out_len >= SERVER_SEND_BATCH && conn_flush(c))
+			return -1;
+		if (c->blocked)
+			break;
+	}
+
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+
+	return 0;
+}
+
+/*
+ * Serve a ready connection: perform every request it has sent, in order, and
+ * send their replies. Stop early if the client does not read its replies, and
+ * leave the rest for when its socket has room. Return -1 if the connection
+ * must be closed.
+ */
+static int conn_serve(struct conn *c)
+{
+	size_t need = 0;
+	ssize_t n;
+
+	/* Replies left over last time, then the requests held back behind them */
+	if (conn_flush(c) || (!c->blocked && conn_perform(c, &need)))
+		return -1;
+
+	while (!c->blocked) {
+		n = conn_recv(c, need);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n <= 0) {
+			/* Client gone: still perform what it sent */
+			conn_perform(c, &need);
+			return -1;
+		}
+		if (conn_perform(c, &need))
+			return -1;
+	}
+
+	return conn_flush(c);
+}
+
+/* Wait for requests, or for room in the socket while replies are pending */
+static void conn_arm(struct conn *c, int op)
+{
+	struct epoll_event ev = {
+		.events = (c->blocked ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) |
+			  EPOLLONESHOT,
+		.data.ptr = c,
+	};
+
+	if (epoll_ctl(server.epoll, op, c->sock, &ev))
+		die_perror("epoll_ctl");
+}
+
+static void *worker(void *arg)
+{
+	struct conn *c;
+
+	for (;;) {
+		pthread_mutex_lock(&server.lock);
+		while (!server.ready_head && !server.stop)
+			pthread_cond_wait(&server.ready, &server.lock);
+		if (server.stop) {
+			pthread_mutex_unlock(&server.lock);
+			break;
+		}
+		c = server.ready_head;
+		server.ready_head = c->next_ready;
+		if (!server.ready_head)
+			server.ready_tail = NULL;
+		pthread_mutex_unlock(&server.lock);
+
+		if (conn_serve(c))
+			conn_close(c);
+		else
+			conn_arm(c, EPOLL_CTL_MOD);
+	}
+
+	return NULL;
+}
+
+static void enqueue(struct conn *c)
+{
+	pthread_mutex_lock(&server.lock);
+	c->next_ready = NULL;
+	if (server.ready_tail)
+		server.ready_tail->next_ready = c;
+	else
+		server.ready_head = c;
+	server.ready_tail = c;
+	pthread_cond_signal(&server.ready);
+	pthread_mutex_unlock(&server.lock);
+}
+
+static void accept_all(int listener)
+{
+	struct conn *c;
+	int sock;
+
+	for (;;) {
+		sock = accept4(listener, NULL, NULL,
+			       SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				perror("accept4");
+			if (errno != EINTR)
+				return;
+			continue;
+		}
+
+		c = conn_new(sock);
+		if (!c) {
+			perror("calloc");
+			close(sock);
+			continue;
+		}
+		conn_arm(c, EPOLL_CTL_ADD);
+	}
+}
+
+static int listen_on(const char *socketname)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock;
+
+	if (strlen(socketname) >= sizeof(addr.sun_path))
+		die("socket name too long");
+	strcpy(addr.sun_path, socketname);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		die_perror("socket");
+	/* Stale socket of a previous instance */
+	unlink(socketname);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
+		die_perror("bind");
+	if (listen(sock, SOMAXCONN))
+		die_perror("listen");
+
+	return sock;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-t <threads>] [-D] [-H] [-C] [-U] [-W] [-R] "
+		"<diskname> <socketname>\n", program);
+	fprintf(stderr, "\t-D: direct I/O, -H: huge pages, -C: compression, "
+		"-U: deduplication,\n\t-W: background writeback, -R: read-only\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	/* Marks the listening socket and the signal descriptor in events */
+	static char listener_mark, signal_mark;
+	struct epoll_event ev, events[64];
+	pthread_t *workers;
+	int threads = SERVER_THREADS;
+	int mount_flags = 0;
+	int listener, sigfd;
+	sigset_t sigs;
+	int c, i, n;
+
+	while ((c = getopt(argc, argv, "t:DHCUWR")) != -1) {
+		switch (c) {
+		case 't':
+			threads = strtol(optarg, NULL, 0);
+			if (threads <= 0)
+				usage(argv[0]);
+			break;
+		case 'D':
+			mount_flags |= FS_MOUNT_DIRECT;
+			break;
+		case 'H':
+			mount_flags |= FS_MOUNT_HUGEPAGES;
+			break;
+		case 'C':
+			mount_flags |= FS_MOUNT_COMPRESS;
+			break;
+		case 'U':
+			mount_flags |= FS_MOUNT_DEDUP;
+			break;
+		case 'W':
+			mount_flags |= FS_MOUNT_WRITEBACK;
+			break;
+		case 'R':
+			mount_flags |= FS_MOUNT_RDONLY;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	server.fs = fs_mount_flags(argv[optind], mount_flags);
+	if (!server.fs)
+		die("Cannot mount diskname");
+
+	/* Termination signals are received through the event loop; the worker
+	 * threads inherit the mask */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	if (pthread_sigmask(SIG_BLOCK, &sigs, NULL))
+		die("Cannot block signals");
+	sigfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+	if (sigfd < 0)
+		die_perror("signalfd");
+
+	listener = listen_on(argv[optind + 1]);
+	server.epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (server.epoll < 0)
+		die_perror("epoll_create1");
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listener_mark;
+	if (epoll_ctl(server.epoll, EPOLL_CTL_ADD, listener, &ev))
+		die_perror("epoll_ctl");
+	ev.data.ptr = &signal_mark;
+	if (epoll_ctl(server.epoll, EPOLL_CTL_ADD, sigfd, &ev))
+		die_perror("epoll_ctl");
+
+	workers = malloc(threads * sizeof(*workers));
+	if (!workers)
+		die_perror("malloc");
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&workers[i], NULL, worker, NULL))
+			die("Cannot create worker threads");
+
+	while (!server.stop) {
+		n = epoll_wait(server.epoll, events, 64, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			die_perror("epoll_wait");
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &listener_mark)
+				accept_all(listener);
+			else if (events[i].data.ptr == &signal_mark)
+				server.stop = 1;
+			else
+				enqueue(events[i].data.ptr);
+		}
+	}
+
+	pthread_mutex_lock(&server.lock);
+	server.stop = 1;
+	pthread_cond_broadcast(&server.ready);
+	pthread_mutex_unlock(&server.lock);
+	for (i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	while (server.conns)
+		conn_close(server.conns);
+	close(listener);
+	close(sigfd);
+	close(server.epoll);
+	unlink(argv[optind + 1]);
+
+	if (fs_umount_ctx(server.fs))
+		die("Cannot unmount diskname");
+
+	return 0;
+}
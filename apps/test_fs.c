@@ -1,14 +1,18 @@
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -34,6 +38,28 @@ struct thread_arg {
 	char **argv;
 };
 
+/* Mount options a script can give to MOUNT */
+static const struct {
+	const char *name;
+	int flag;
+} mount_options[] = {
+	{ "DIRECT",	FS_MOUNT_DIRECT },
+	{ "COMPRESS",	FS_MOUNT_COMPRESS },
+	{ "DEDUP",	FS_MOUNT_DEDUP },
+	{ "WRITEBACK",	FS_MOUNT_WRITEBACK },
+};
+
+int mount_option(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(mount_options); i++)
+		if (!strcmp(name, mount_options[i].name))
+			return mount_options[i].flag;
+
+	die("Unknown mount option '%s'", name);
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -45,6 +71,8 @@ void thread_fs_script(void *arg)
 	char *command_args[total_command_parts];
 	int offset;
 	char mounted = 0;
+	/* Live file system, snapshot being viewed, and the one files are opened in */
+	fs_t *fs = NULL, *view = NULL, *files = NULL;
 
 	char line_buffer[1024];
 	int command_index = 1;
@@ -87,7 +115,12 @@ void thread_fs_script(void *arg)
 			break;
 
 		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+			int flags = 0;
+
+			for (int i = 1; i < total_command_parts && command_args[i]; i++)
+				flags |= mount_option(command_args[i]);
+			fs = files = fs_mount_flags(diskname, flags);
+			if (!fs)
 				die("Cannot mount disk");
 			else {
 				printf("MOUNT successful.\n");
@@ -95,7 +128,7 @@ void thread_fs_script(void *arg)
 			}
 
 		} else if (strcmp(command, "UMOUNT") == 0) {
-			if (mounted && fs_umount())
+			if (mounted && fs_umount_ctx(fs))
 				die("Cannot unmount");
 			else {
 				printf("UMOUNT successful.\n");
@@ -105,8 +138,8 @@ void thread_fs_script(void *arg)
 		} else if (strcmp(command, "CREATE") == 0) {
 			fs_filename = command_args[1];
 
-			if(fs_create(fs_filename)) {
-				fs_umount();
+			if(fs_create_ctx(fs, fs_filename)) {
+				fs_umount_ctx(fs);
 				die("Cannot create file");
 			}
 
@@ -115,8 +148,8 @@ void thread_fs_script(void *arg)
 		} else if (strcmp(command, "DELETE") == 0) {
 			fs_filename = command_args[1];
 
-			if(fs_delete(fs_filename)) {
-				fs_umount();
+			if(fs_delete_ctx(fs, fs_filename)) {
+				fs_umount_ctx(fs);
 				die("Cannot delete file");
 			}
 
@@ -125,18 +158,19 @@ void thread_fs_script(void *arg)
 		} else if (strcmp(command, "OPEN") == 0) {
 			fs_filename = command_args[1];
 
-			fs_fd = fs_open(fs_filename);
+			/* Files are opened in the snapshot being viewed, if any */
+			fs_fd = fs_open_ctx(files, fs_filename);
 
 			if (fs_fd < 0) {
-				fs_umount();
+				fs_umount_ctx(fs);
 				die("Cannot open file");
 			}
 
 			printf("OPEN successful.\n");
 
 		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
-				fs_umount();
+			if (fs_close_ctx(files, fs_fd)) {
+				fs_umount_ctx(fs);
 				die("Cannot close file");
 			}
 
@@ -145,8 +179,8 @@ void thread_fs_script(void *arg)
 		} else if (strcmp(command, "SEEK") == 0) {
 			offset = atoi(command_args[1]);
 
-			if (fs_lseek(fs_fd, offset)) {
-				fs_umount();
+			if (fs_lseek_ctx(files, fs_fd, offset)) {
+				fs_umount_ctx(fs);
 				die("Cannot seek to position");
 			} else {
 				printf("SEEK successful.\n");
@@ -162,15 +196,15 @@ void thread_fs_script(void *arg)
 			} else if (strcmp(data_source, "FILE") == 0) {
 				data_fd = open(data_description, O_RDONLY);
 				if (data_fd < 0) {
-					fs_umount();
+					fs_umount_ctx(fs);
 					die_perror("open");
 				}
 				if (fstat(data_fd, &st)) {
-					fs_umount();
+					fs_umount_ctx(fs);
 					die_perror("fstat");
 				}
 				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
+					fs_umount_ctx(fs);
 					die("Not a regular file: %s\n", data_description);
 				}
 				data_size = st.st_size;
@@ -181,13 +215,13 @@ void thread_fs_script(void *arg)
 			}
 
 			if (!data) {
-				fs_umount();
+				fs_umount_ctx(fs);
 				die_perror("Could not find data to write");
 			}
 
-			count = fs_write(fs_fd, data, data_size);
+			count = fs_write_ctx(files, fs_fd, data, data_size);
 			if (count < 0) {
-				fs_umount();
+				fs_umount_ctx(fs);
 				die("write error");
 			}
 			printf("Wrote %d bytes to file.\n", count);
@@ -205,15 +239,15 @@ void thread_fs_script(void *arg)
 			} else if (strcmp(data_source, "FILE") == 0) {
 				data_fd = open(data_description, O_RDONLY);
 				if (data_fd < 0) {
-					fs_umount();
+					fs_umount_ctx(fs);
 					die_perror("open");
 				}
 				if (fstat(data_fd, &st)) {
-					fs_umount();
+					fs_umount_ctx(fs);
 					die_perror("fstat");
 				}
 				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
+					fs_umount_ctx(fs);
 					die("Not a regular file: %s\n", data_description);
 				}
 
@@ -224,32 +258,39 @@ void thread_fs_script(void *arg)
 				assert(n == sizeof(char) * data_size);
 				fclose(data_file);
 				file_loaded = 1;
+			} else if (strcmp(data_source, "ZERO") == 0) {
+				/* Holes of sparse files read as zeros */
+				data_size = read_req_length > 0 ? read_req_length : 0;
+				data = calloc(data_size+1, sizeof(char));
+				file_loaded = 1;
 			} else {
-				fs_umount();
+				fs_umount_ctx(fs);
 				die("Invalid data description");
 			}
 
 			if (!data) {
-				fs_umount();
+				fs_umount_ctx(fs);
 				die_perror("Could not find data to write");
 			}
 
 			if (read_req_length < 0) {
-				fs_umount();
+				fs_umount_ctx(fs);
 				die("invalid data read length");
 			}
 
 			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+			count = fs_read_ctx(files, fs_fd, read_buf, read_req_length);
 
 			if (count < 0) {
-				fs_umount();
+				fs_umount_ctx(fs);
 				die("read error");
 			}
 
 			// both data and read_buf were allocated with an extra zero byte
 			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
+			/* Zeros past the end of file would compare equal too */
+			if (memcmp(data, read_buf, data_size+1) == 0 &&
+			    (strcmp(data_source, "ZERO") != 0 || count == data_size))
 				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
 			else
 				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
@@ -258,12 +299,67 @@ void thread_fs_script(void *arg)
 			if(file_loaded){
 				free(data);
 			}
+
+		} else if (strcmp(command, "CLONE") == 0) {
+			/* A trailing FAIL expects the clone to be refused */
+			int expect_fail = command_args[3] &&
+					  strcmp(command_args[3], "FAIL") == 0;
+
+			int cloned = fs_clone_ctx(fs, command_args[1], command_args[2]) == 0;
+
+			if (cloned && expect_fail) {
+				fs_umount_ctx(fs);
+				die("Clone not refused");
+			}
+			if (!cloned && !expect_fail) {
+				fs_umount_ctx(fs);
+				die("Cannot clone file");
+			}
+
+			printf("CLONE %s.\n", expect_fail ? "refused" : "successful");
+
+		} else if (strcmp(command, "SNAPSHOT") == 0) {
+			if (fs_snapshot_create_ctx(fs, command_args[1])) {
+				fs_umount_ctx(fs);
+				die("Cannot create snapshot");
+			}
+
+			printf("SNAPSHOT successful.\n");
+
+		} else if (strcmp(command, "SNAPRM") == 0) {
+			if (fs_snapshot_delete_ctx(fs, command_args[1])) {
+				fs_umount_ctx(fs);
+				die("Cannot delete snapshot");
+			}
+
+			printf("SNAPRM successful.\n");
+
+		} else if (strcmp(command, "VIEW") == 0) {
+			if (view || !(view = fs_snapshot_mount_ctx(fs, command_args[1]))) {
+				fs_umount_ctx(fs);
+				die("Cannot mount snapshot");
+			}
+
+			files = view;
+			printf("VIEW successful.\n");
+
+		} else if (strcmp(command, "UNVIEW") == 0) {
+			if (!view || fs_umount_ctx(view)) {
+				fs_umount_ctx(fs);
+				die("Cannot unmount snapshot");
+			}
+			view = NULL;
+			files = fs;
+
+			printf("UNVIEW successful.\n");
 		}
 	}
 
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
-	if (mounted && fs_umount())
+	if (view && fs_umount_ctx(view))
+		die("Cannot unmount snapshot");
+	if (mounted && fs_umount_ctx(fs))
 		die("Cannot unmount diskname");
 
 	fclose(fd_script);
@@ -319,7 +415,7 @@ void thread_fs_stat(void *arg)
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fs_fd;
 	int stat, read;
 
@@ -348,14 +444,12 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
-		fs_umount();
-		die("Cannot malloc");
-	}
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
 
-	read = fs_read(fs_fd, buf, stat);
+	/* Streamed to the standard output, without going through a buffer */
+	read = fs_copy_to_fd(fs_fd, STDOUT_FILENO, 0, stat);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -365,12 +459,8 @@ void thread_fs_cat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
+	if (read != stat)
+		die("Read only %d/%d bytes", read, stat);
 }
 
 void thread_fs_rm(void *arg)
@@ -401,7 +491,7 @@ void thread_fs_rm(void *arg)
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fd, fs_fd;
 	struct stat st;
 	int written;
@@ -421,11 +511,6 @@ void thread_fs_add(void *arg)
 	if (!S_ISREG(st.st_mode))
 		die("Not a regular file: %s\n", filename);
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
-
 	/* Now, deal with our filesystem:
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
@@ -444,7 +529,8 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	/* Streamed from the host file, without going through a buffer */
+	written = fs_copy_from_fd(fs_fd, fd, 0, st.st_size);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -457,7 +543,6 @@ void thread_fs_add(void *arg)
 	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
 		   st.st_size);
 
-	munmap(buf, st.st_size);
 	close(fd);
 }
 
@@ -499,6 +584,234 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_trim(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	ret = fs_trim();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (ret < 0)
+		die("Cannot release free blocks");
+
+	printf("Released %d free data blocks\n", ret);
+}
+
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <copy filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' into '%s'\n", src, dst);
+}
+
+void thread_fs_snapshot(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_create(name)) {
+		fs_umount();
+		die("Cannot create snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created snapshot '%s'\n", name);
+}
+
+void thread_fs_snapls(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+	fs_t *snap;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	snap = fs_snapshot_mount(name);
+	if (!snap) {
+		fs_umount();
+		die("Cannot mount snapshot");
+	}
+
+	fs_ls_ctx(snap);
+
+	if (fs_umount_ctx(snap) || fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_snaprm(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_delete(name)) {
+		fs_umount();
+		die("Cannot delete snapshot");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Deleted snapshot '%s'\n", name);
+}
+
+/* Capacity of the block trace ring used by the trace command */
+#define TRACE_RING_SIZE (1 << 16)
+
+int run_command(char *cmd, struct thread_arg *arg);
+
+void thread_fs_trace(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+	char *mode;
+	int ret;
+
+	if (t_arg->argc < 2)
+		die("Usage: <dump|summary> <command> [<arg>]");
+
+	mode = t_arg->argv[0];
+	if (strcmp(mode, "dump") && strcmp(mode, "summary"))
+		die("invalid trace mode '%s'", mode);
+
+	if (block_trace_enable(TRACE_RING_SIZE))
+		die("Cannot enable block trace");
+
+	/* Run the traced command with the remaining arguments */
+	cmd_arg.argc = t_arg->argc - 2;
+	cmd_arg.argv = &t_arg->argv[2];
+	if (run_command(t_arg->argv[1], &cmd_arg))
+		die("invalid command '%s'", t_arg->argv[1]);
+
+	if (!strcmp(mode, "dump"))
+		ret = block_trace_dump(stdout);
+	else
+		ret = block_trace_summary(stdout);
+	if (ret)
+		die("Cannot print block trace");
+
+	block_trace_disable();
+}
+
+void thread_fs_record(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+
+	if (t_arg->argc < 2)
+		die("Usage: <trace filename> <command> [<arg>]");
+
+	if (fs_record_start(t_arg->argv[0]))
+		die("Cannot start recording");
+
+	/* Run the recorded command with the remaining arguments */
+	cmd_arg.argc = t_arg->argc - 2;
+	cmd_arg.argv = &t_arg->argv[2];
+	if (run_command(t_arg->argv[1], &cmd_arg))
+		die("invalid command '%s'", t_arg->argv[1]);
+
+	if (fs_record_stop())
+		die("Cannot write trace");
+}
+
+void thread_fs_replay(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_replay_stats stats;
+	char *diskname, *tracename;
+	int flags = 0, nthreads = 1;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <trace filename> [fast|timed] [<threads>]");
+
+	diskname = t_arg->argv[0];
+	tracename = t_arg->argv[1];
+	if (t_arg->argc > 2) {
+		if (!strcmp(t_arg->argv[2], "timed"))
+			flags |= FS_REPLAY_TIMED;
+		else if (strcmp(t_arg->argv[2], "fast"))
+			die("invalid replay mode '%s'", t_arg->argv[2]);
+	}
+	if (t_arg->argc > 3)
+		nthreads = atoi(t_arg->argv[3]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_replay(tracename, flags, nthreads, &stats)) {
+		fs_umount();
+		die("Cannot replay trace");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Replayed %zu calls (%zu errors) in %.6f s\n", stats.ops,
+	       stats.errors, stats.seconds);
+	printf("throughput=%.1f ops/s %.2f MB/s\n",
+	       stats.seconds ? stats.ops / stats.seconds : 0,
+	       stats.seconds ? stats.bytes / stats.seconds / (1 << 20) : 0);
+	printf("latency_us p50=%.1f p99=%.1f p999=%.1f\n", stats.p50_us,
+	       stats.p99_us, stats.p999_us);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -507,6 +820,495 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+/* Number of blocks copied at once by the stripe command */
+#define STRIPE_COPY_BLOCKS 256
+
+void thread_fs_stripe(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	disk_t *src, *dst;
+	const char **members;
+	size_t width, count, member_blocks, done, len, n;
+	char *buf;
+	int i, fd;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <stripe width> <member> [<member>...]");
+
+	width = get_argv(t_arg->argv[1]);
+	members = (const char **)&t_arg->argv[2];
+	count = t_arg->argc - 2;
+	if (!width)
+		die("invalid stripe width");
+
+	src = block_disk_open_ctx(t_arg->argv[0]);
+	if (!src)
+		die("Cannot open diskname");
+	n = block_disk_count_ctx(src);
+
+	/* Create members just large enough for whole stripes covering the image */
+	member_blocks = (n + width * count - 1) / (width * count) * width;
+	for (i = 0; i < (int)count; i++) {
+		fd = open(members[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die_perror("open");
+		if (ftruncate(fd, member_blocks * BLOCK_SIZE))
+			die_perror("ftruncate");
+		close(fd);
+	}
+
+	dst = block_disk_open_stripe(members, count, width, 0);
+	if (!dst)
+		die("Cannot open stripe set");
+
+	buf = malloc(STRIPE_COPY_BLOCKS * BLOCK_SIZE);
+	if (!buf)
+		die_perror("malloc");
+
+	for (done = 0; done < n; done += len) {
+		len = n - done < STRIPE_COPY_BLOCKS ? n - done : STRIPE_COPY_BLOCKS;
+		if (block_read_many_ctx(src, done, len, buf) ||
+		    block_write_many_ctx(dst, done, len, buf))
+			die("Cannot copy blocks");
+	}
+
+	free(buf);
+	block_disk_close_ctx(dst);
+	block_disk_close_ctx(src);
+
+	printf("Striped %zu blocks over %zu members (width %zu)\n", n, count,
+	       width);
+}
+
+/* Default number of host I/O threads used by the bulk commands */
+#define MANY_THREADS 4
+
+/* Number of host files read ahead of the writer by add-many */
+#define MANY_QUEUE 16
+
+/* Largest host file read in memory by add-many (larger files are prefetched
+ * and streamed by the writer instead) */
+#define MANY_BUF_MAX (4 << 20)
+
+/* File handled by a bulk command */
+struct many_file {
+	char *path; // Host path
+	char name[FS_FILENAME_LEN]; // Name in the file system
+	int fd;
+	size_t size;
+	char *buf; // Whole content, or NULL when streamed from @fd
+	int error;
+};
+
+/* Files of a bulk command, shared by its threads */
+struct many {
+	struct many_file *files;
+	size_t count;
+	size_t next; // Next file to be handled by a host I/O thread
+	/* Files read by add-many, in completion order */
+	struct many_file *queue[MANY_QUEUE];
+	size_t head, tail;
+	size_t inflight;
+	pthread_mutex_t lock;
+	pthread_cond_t ready, room;
+	const char *outdir;
+	size_t bytes, failed;
+};
+
+double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void many_add_file(struct many *m, const char *path)
+{
+	struct many_file *f;
+	const char *base;
+
+	f = realloc(m->files, (m->count + 1) * sizeof(*f));
+	if (!f)
+		die_perror("realloc");
+	m->files = f;
+
+	f = &m->files[m->count++];
+	memset(f, 0, sizeof(*f));
+	f->fd = -1;
+	f->path = strdup(path);
+	if (!f->path)
+		die_perror("strdup");
+
+	base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	if (strlen(base) >= FS_FILENAME_LEN) {
+		test_fs_error("name too long: %s", base);
+		f->error = 1;
+	} else {
+		strcpy(f->name, base);
+	}
+}
+
+/* Files named by @source: the regular files of a directory, or the lines of
+ * a list file when prefixed with '@' */
+void many_load(struct many *m, const char *source)
+{
+	char path[PATH_MAX];
+
+	memset(m, 0, sizeof(*m));
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->ready, NULL);
+	pthread_cond_init(&m->room, NULL);
+
+	if (source[0] == '@') {
+		FILE *list = fopen(source + 1, "r");
+
+		if (!list)
+			die_perror("fopen");
+		while (fgets(path, sizeof(path), list)) {
+			char *nl = strchr(path, '\n');
+
+			if (nl)
+				*nl = '\0';
+			if (path[0])
+				many_add_file(m, path);
+		}
+		fclose(list);
+	} else {
+		struct dirent *de;
+		struct stat st;
+		DIR *dir = opendir(source);
+
+		if (!dir)
+			die_perror("opendir");
+		while ((de = readdir(dir))) {
+			snprintf(path, sizeof(path), "%s/%s", source, de->d_name);
+			if (!stat(path, &st) && S_ISREG(st.st_mode))
+				many_add_file(m, path);
+		}
+		closedir(dir);
+	}
+
+	if (!m->count)
+		die("No file in '%s'", source);
+}
+
+void many_free(struct many *m)
+{
+	size_t i;
+
+	for (i = 0; i < m->count; i++)
+		free(m->files[i].path);
+	free(m->files);
+	pthread_cond_destroy(&m->room);
+	pthread_cond_destroy(&m->ready);
+	pthread_mutex_destroy(&m->lock);
+}
+
+void many_report(struct many *m, const char *verb, double seconds)
+{
+	printf("%s %zu files (%zu failed), %zu bytes in %.6f s\n", verb,
+	       m->count - m->failed, m->failed, m->bytes, seconds);
+	printf("throughput=%.1f files/s %.2f MB/s\n",
+	       seconds ? (m->count - m->failed) / seconds : 0,
+	       seconds ? m->bytes / seconds / (1 << 20) : 0);
+}
+
+/* Open a host file for add-many, and read it or prefetch it */
+void many_read_file(struct many_file *f)
+{
+	struct stat st;
+	size_t done;
+	ssize_t ret;
+
+	f->fd = open(f->path, O_RDONLY);
+	if (f->fd < 0 || fstat(f->fd, &st) || !S_ISREG(st.st_mode)) {
+		f->error = 1;
+		return;
+	}
+	f->size = st.st_size;
+
+	if (f->size > MANY_BUF_MAX) {
+		posix_fadvise(f->fd, 0, 0, POSIX_FADV_WILLNEED);
+		return;
+	}
+
+	f->buf = malloc(f->size ? f->size : 1);
+	if (!f->buf) {
+		f->error = 1;
+		return;
+	}
+	for (done = 0; done < f->size; done += ret) {
+		ret = pread(f->fd, f->buf + done, f->size - done, done);
+		if (ret <= 0) {
+			f->error = 1;
+			return;
+		}
+	}
+	close(f->fd);
+	f->fd = -1;
+}
+
+void *many_reader(void *arg)
+{
+	struct many *m = arg;
+	struct many_file *f;
+
+	pthread_mutex_lock(&m->lock);
+	while (m->next < m->count) {
+		/* Bound the memory held by files waiting for the writer */
+		if (m->inflight == MANY_QUEUE) {
+			pthread_cond_wait(&m->room, &m->lock);
+			continue;
+		}
+		f = &m->files[m->next++];
+		m->inflight++;
+		pthread_mutex_unlock(&m->lock);
+
+		if (!f->error)
+			many_read_file(f);
+
+		pthread_mutex_lock(&m->lock);
+		m->queue[m->tail++ % MANY_QUEUE] = f;
+		pthread_cond_signal(&m->ready);
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	return NULL;
+}
+
+/* Write a file read by the host I/O threads into the file system */
+int many_write_file(struct many_file *f)
+{
+	int fs_fd, written;
+
+	if (f->error)
+		return -1;
+
+	if (fs_create(f->name))
+		return -1;
+	fs_fd = fs_open(f->name);
+	if (fs_fd < 0)
+		return -1;
+
+	if (f->buf)
+		written = f->size ? fs_write(fs_fd, f->buf, f->size) : 0;
+	else
+		written = fs_copy_from_fd(fs_fd, f->fd, 0, f->size);
+
+	if (fs_close(fs_fd) || written != (int)f->size)
+		return -1;
+
+	return 0;
+}
+
+void thread_fs_add_many(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct many m;
+	struct many_file *f;
+	pthread_t *threads;
+	int i, nthreads = MANY_THREADS;
+	double start;
+	size_t done;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <directory|@listfile> [<threads>]");
+
+	if (t_arg->argc > 2)
+		nthreads = atoi(t_arg->argv[2]);
+	if (nthreads <= 0)
+		die("invalid number of threads");
+
+	many_load(&m, t_arg->argv[1]);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads)
+		die_perror("calloc");
+
+	/* Host files are read by a pool of threads, while this thread streams
+	 * them into the file system in the order they become ready */
+	start = now_seconds();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, many_reader, &m);
+
+	for (done = 0; done < m.count; done++) {
+		pthread_mutex_lock(&m.lock);
+		while (m.head == m.tail)
+			pthread_cond_wait(&m.ready, &m.lock);
+		f = m.queue[m.head++ % MANY_QUEUE];
+		pthread_mutex_unlock(&m.lock);
+
+		if (many_write_file(f)) {
+			test_fs_error("Cannot add file '%s'", f->path);
+			m.failed++;
+		} else {
+			m.bytes += f->size;
+		}
+
+		free(f->buf);
+		f->buf = NULL;
+		if (f->fd >= 0)
+			close(f->fd);
+
+		pthread_mutex_lock(&m.lock);
+		m.inflight--;
+		pthread_cond_signal(&m.room);
+		pthread_mutex_unlock(&m.lock);
+	}
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	many_report(&m, "Added", now_seconds() - start);
+	free(threads);
+	many_free(&m);
+	if (m.failed)
+		exit(1);
+}
+
+/* Export a file of the file system into the output directory */
+int many_export_file(struct many *m, struct many_file *f)
+{
+	char path[PATH_MAX];
+	int fs_fd, fd, size, read;
+
+	if (f->error)
+		return -1;
+
+	fs_fd = fs_open(f->name);
+	if (fs_fd < 0)
+		return -1;
+
+	size = fs_stat(fs_fd);
+	snprintf(path, sizeof(path), "%s/%s", m->outdir, f->name);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (size < 0 || fd < 0) {
+		if (fd >= 0)
+			close(fd);
+		fs_close(fs_fd);
+		return -1;
+	}
+
+	read = fs_copy_to_fd(fs_fd, fd, 0, size);
+	fs_close(fs_fd);
+	if (close(fd) || read != size)
+		return -1;
+
+	f->size = size;
+	return 0;
+}
+
+void *many_exporter(void *arg)
+{
+	struct many *m = arg;
+	struct many_file *f;
+	size_t bytes = 0, failed = 0;
+
+	pthread_mutex_lock(&m->lock);
+	while (m->next < m->count) {
+		f = &m->files[m->next++];
+		pthread_mutex_unlock(&m->lock);
+
+		if (many_export_file(m, f)) {
+			test_fs_error("Cannot export file '%s'", f->name);
+			failed++;
+		} else {
+			bytes += f->size;
+		}
+
+		pthread_mutex_lock(&m->lock);
+	}
+	m->bytes += bytes;
+	m->failed += failed;
+	pthread_mutex_unlock(&m->lock);
+
+	return NULL;
+}
+
+void thread_fs_cat_many(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct many m;
+	pthread_t *threads;
+	int i, nthreads = MANY_THREADS;
+	double start;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <directory|@listfile> <output directory> "
+		    "[<threads>]");
+
+	if (t_arg->argc > 3)
+		nthreads = atoi(t_arg->argv[3]);
+	if (nthreads <= 0)
+		die("invalid number of threads");
+
+	many_load(&m, t_arg->argv[1]);
+	m.outdir = t_arg->argv[2];
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads)
+		die_perror("calloc");
+
+	/* Each thread streams whole files straight into host files */
+	start = now_seconds();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, many_exporter, &m);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	many_report(&m, "Exported", now_seconds() - start);
+	free(threads);
+	many_free(&m);
+	if (m.failed)
+		exit(1);
+}
+
+void thread_fs_rm_many(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct many m;
+	double start;
+	size_t i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <directory|@listfile>");
+
+	many_load(&m, t_arg->argv[1]);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	start = now_seconds();
+	for (i = 0; i < m.count; i++) {
+		if (m.files[i].error || fs_delete(m.files[i].name)) {
+			test_fs_error("Cannot delete file '%s'", m.files[i].name);
+			m.failed++;
+		}
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	many_report(&m, "Removed", now_seconds() - start);
+	many_free(&m);
+	if (m.failed)
+		exit(1);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -516,10 +1318,36 @@ static struct {
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
+	{ "add-many",	thread_fs_add_many },
+	{ "cat-many",	thread_fs_cat_many },
+	{ "rm-many",	thread_fs_rm_many },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "trim",	thread_fs_trim },
+	{ "clone",	thread_fs_clone },
+	{ "snapshot",	thread_fs_snapshot },
+	{ "snapls",	thread_fs_snapls },
+	{ "snaprm",	thread_fs_snaprm },
+	{ "script",	thread_fs_script },
+	{ "trace",	thread_fs_trace },
+	{ "record",	thread_fs_record },
+	{ "replay",	thread_fs_replay },
+	{ "stripe",	thread_fs_stripe }
 };
 
+int run_command(char *cmd, struct thread_arg *arg)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(cmd, commands[i].name)) {
+			commands[i].func(arg);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
 void usage(char *program)
 {
 	size_t i;
@@ -532,7 +1360,6 @@ void usage(char *program)
 
 int main(int argc, char **argv)
 {
-	size_t i;
 	char *program;
 	char *cmd;
 	struct thread_arg arg;
@@ -550,13 +1377,7 @@ int main(int argc, char **argv)
 	arg.argc = --argc;
 	arg.argv = &argv[1];
 
-	for (i = 0; i < ARRAY_SIZE(commands); i++) {
-		if (!strcmp(cmd, commands[i].name)) {
-			commands[i].func(&arg);
-			break;
-		}
-	}
-	if (i == ARRAY_SIZE(commands)) {
+	if (run_command(cmd, &arg)) {
 		test_fs_error("invalid command '%s'", cmd);
 		usage(program);
 	}
@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+
+/* Size of the chunks an arena is carved from */
+#define ARENA_CHUNK_SIZE (2 << 20)
+
+/* Number of I/O buffers cached by each thread */
+#define ARENA_CACHE_SIZE 8
+
+/* Chunk of memory mapped for an arena */
+struct chunk {
+	struct chunk *next;
+	size_t size; // Mapped size, including this header
+	size_t used;
+};
+
+/* Free I/O buffer (the link lives in the buffer itself) */
+struct free_buf {
+	struct free_buf *next;
+};
+
+struct arena {
+	int flags;
+	uint64_t id;
+	size_t page_size;
+	size_t buf_size;
+	struct chunk *chunks;
+	struct free_buf *free_bufs; // Shared free list of I/O buffers
+	pthread_mutex_t lock;
+};
+
+/* Identifier of the next arena, so that stale per-thread entries never match */
+static uint64_t next_id = 1;
+
+/* Per-thread cache of I/O buffers, tagged with the arena they belong to */
+static __thread struct {
+	uint64_t arena_id;
+	void *buf;
+} buf_cache[ARENA_CACHE_SIZE];
+
+static size_t round_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+static struct chunk *chunk_map(struct arena *a, size_t size)
+{
+	struct chunk *c = MAP_FAILED;
+
+	size = round_up(size, ARENA_CHUNK_SIZE);
+
+#ifdef MAP_HUGETLB
+	/* Reserved huge pages first, then transparent ones */
+	if (a->flags & ARENA_HUGEPAGES)
+		c = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (c == MAP_FAILED) {
+		c = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (c == MAP_FAILED) {
+			perror("mmap");
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if (a->flags & ARENA_HUGEPAGES)
+			madvise(c, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	c->size = size;
+	c->used = round_up(sizeof(*c), a->page_size);
+	c->next = a->chunks;
+	a->chunks = c;
+
+	return c;
+}
+
+struct arena *arena_create(int flags, size_t buf_size)
+{
+	struct arena *a = calloc(1, sizeof(*a));
+
+	if (!a)
+		return NULL;
+
+	a->flags = flags;
+	a->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+	a->page_size = sysconf(_SC_PAGESIZE);
+	a->buf_size = buf_size;
+	pthread_mutex_init(&a->lock, NULL);
+
+	return a;
+}
+
+void arena_destroy(struct arena *a)
+{
+	struct chunk *c, *next;
+
+	if (!a)
+		return;
+
+	for (c = a->chunks; c; c = next) {
+		next = c->next;
+		munmap(c, c->size);
+	}
+
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct chunk *c;
+	void *p;
+
+	size = round_up(size ? size : 1, a->page_size);
+
+	pthread_mutex_lock(&a->lock);
+	c = a->chunks;
+	if (!c || c->size - c->used < size)
+		c = chunk_map(a, size + round_up(sizeof(*c), a->page_size));
+	if (!c) {
+		pthread_mutex_unlock(&a->lock);
+		return NULL;
+	}
+
+	/* Chunks are freshly mapped anonymous memory: already zeroed */
+	p = (char *)c + c->used;
+	c->used += size;
+	pthread_mutex_unlock(&a->lock);
+
+	return p;
+}
+
+void *arena_buf_get(struct arena *a)
+{
+	struct free_buf *buf;
+	int i;
+
+	for (i = 0; i < ARENA_CACHE_SIZE; i++) {
+		if (buf_cache[i].arena_id == a->id && buf_cache[i].buf) {
+			buf = buf_cache[i].buf;
+			buf_cache[i].buf = NULL;
+			return buf;
+		}
+	}
+
+	pthread_mutex_lock(&a->lock);
+	buf = a->free_bufs;
+	if (buf)
+		a->free_bufs = buf->next;
+	pthread_mutex_unlock(&a->lock);
+	if (buf)
+		return buf;
+
+	return arena_alloc(a, a->buf_size);
+}
+
+void arena_buf_put(struct arena *a, void *buf)
+{
+	struct free_buf *fb = buf;
+	int i;
+
+	if (!buf)
+		return;
+
+	/* Keep it for this thread: take an empty slot, or evict the buffer of
+	 * another arena (its memory stays owned by, and released with, it) */
+	for (i = 0; i < ARENA_CACHE_SIZE; i++) {
+		if (!buf_cache[i].buf || buf_cache[i].arena_id != a->id) {
+			buf_cache[i].arena_id = a->id;
+			buf_cache[i].buf = buf;
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&a->lock);
+	fb->next = a->free_bufs;
+	a->free_bufs = fb;
+	pthread_mutex_unlock(&a->lock);
+}
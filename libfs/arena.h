@@ -0,0 +1,54 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h> /* for size_t definition */
+
+/* Back the arena with huge pages when the host has some available */
+#define ARENA_HUGEPAGES 0x1
+
+/* Mount-scoped memory arena */
+struct arena;
+
+/*
+ * arena_create - Create an empty arena
+ * @flags: ARENA_* flags
+ * @buf_size: Size of the I/O buffers of arena_buf_get() (a block)
+ */
+struct arena *arena_create(int flags, size_t buf_size);
+
+/*
+ * arena_destroy - Release every allocation of an arena at once
+ * @a: Arena
+ *
+ * I/O buffers still cached by other threads are forgotten, not used again.
+ */
+void arena_destroy(struct arena *a);
+
+/*
+ * arena_alloc - Allocate zeroed, page-aligned memory that lives as long as @a
+ * @a: Arena
+ * @size: Number of bytes
+ *
+ * Return: NULL if no memory is available.
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+/*
+ * arena_buf_get - Get an I/O buffer of the size given to arena_create()
+ * @a: Arena
+ *
+ * Buffers are recycled through a per-thread free list first, then through a
+ * free list shared by the threads using @a.
+ *
+ * Return: NULL if no memory is available.
+ */
+void *arena_buf_get(struct arena *a);
+
+/*
+ * arena_buf_put - Give back an I/O buffer obtained with arena_buf_get()
+ * @a: Arena
+ * @buf: Buffer
+ */
+void arena_buf_put(struct arena *a, void *buf);
+
+#endif /* _ARENA_H */
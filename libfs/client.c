@@ -0,0 +1,410 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "fs_client.h"
+#include "proto.h"
+
+#define client_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+struct fs_client {
+	int sock;
+	/* Serializes the sending of requests, in the order of their tickets */
+	pthread_mutex_t send_lock;
+	uint32_t next_ticket;
+	/* Replies come back in request order: the caller holding ticket
+	 * @next_reply is the one reading the next reply */
+	pthread_mutex_t recv_lock;
+	pthread_cond_t recv_turn;
+	uint32_t next_reply;
+	int broken;
+};
+
+fs_client_t *fs_client_connect(const char *socketname)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	fs_client_t *c;
+
+	if (!socketname || strlen(socketname) >= sizeof(addr.sun_path)) {
+		client_error("invalid socket name");
+		return NULL;
+	}
+	strcpy(addr.sun_path, socketname);
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		perror("calloc");
+		return NULL;
+	}
+
+	c->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->sock < 0 ||
+	    connect(c->sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("connect");
+		if (c->sock >= 0)
+			close(c->sock);
+		free(c);
+		return NULL;
+	}
+
+	pthread_mutex_init(&c->send_lock, NULL);
+	pthread_mutex_init(&c->recv_lock, NULL);
+	pthread_cond_init(&c->recv_turn, NULL);
+
+	return c;
+}
+
+int fs_client_disconnect(fs_client_t *c)
+{
+	if (!c)
+		return -1;
+
+	close(c->sock);
+	pthread_mutex_destroy(&c->send_lock);
+	pthread_mutex_destroy(&c->recv_lock);
+	pthread_cond_destroy(&c->recv_turn);
+	free(c);
+
+	return 0;
+}
+
+/* Send the buffers of @iov whole, along with host descriptor @pass_fd unless
+ * it is -1 */
+static int send_all(int sock, struct iovec *iov, int iovcnt, int pass_fd)
+{
+	char control[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+	ssize_t n;
+
+	if (pass_fd >= 0) {
+		struct cmsghdr *cmsg;
+
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+
+	while (msg.msg_iovlen > 0) {
+		n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+
+		/* The descriptor goes with the first bytes only */
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static int recv_all(int sock, void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = recv(sock, buf, len, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (char *)buf + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Receive the payload of a reply: into @out, or on the standard output if
+ * @out is NULL */
+static int recv_payload(int sock, size_t len, void *out, size_t out_len)
+{
+	char chunk[4096];
+
+	if (out)
+		return len <= out_len ? recv_all(sock, out, len) : -1;
+
+	while (len > 0) {
+		size_t n = len < sizeof(chunk) ? len : sizeof(chunk);
+
+		if (recv_all(sock, chunk, n))
+			return -1;
+		fwrite(chunk, 1, n, stdout);
+		len -= n;
+	}
+	fflush(stdout);
+
+	return 0;
+}
+
+/*
+ * Perform a call: send request @req, followed by its payload @data and
+ * host descriptor @pass_fd (unless it is -1), then wait for the reply and
+ * receive its payload (see recv_payload()). The requests of other threads go
+ * out while the reply is awaited.
+ */
+static int call(fs_client_t *c, struct proto_req *req, const void *data,
+		int pass_fd, void *out, size_t out_len)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = req, .iov_len = sizeof(*req) },
+		{ .iov_base = (void *)data, .iov_len = req->len },
+	};
+	struct proto_rep rep;
+	uint32_t ticket;
+	int err;
+
+	if (!c)
+		return -1;
+
+	pthread_mutex_lock(&c->send_lock);
+	ticket = c->next_ticket++;
+	req->id = ticket;
+	err = send_all(c->sock, iov, 2, pass_fd);
+	pthread_mutex_unlock(&c->send_lock);
+
+	pthread_mutex_lock(&c->recv_lock);
+	while (!err && !c->broken && c->next_reply != ticket)
+		pthread_cond_wait(&c->recv_turn, &c->recv_lock);
+	if (err || c->broken) {
+		c->broken = 1;
+		pthread_cond_broadcast(&c->recv_turn);
+		pthread_mutex_unlock(&c->recv_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&c->recv_lock);
+
+	/* Our turn: nobody else reads the socket until we are done */
+	err = recv_all(c->sock, &rep, sizeof(rep)) || rep.id != ticket ||
+		recv_payload(c->sock, rep.len, out, out_len);
+
+	pthread_mutex_lock(&c->recv_lock);
+	if (err)
+		c->broken = 1;
+	else
+		c->next_reply++;
+	pthread_cond_broadcast(&c->recv_turn);
+	pthread_mutex_unlock(&c->recv_lock);
+
+	if (err) {
+		client_error("connection lost");
+		return -1;
+	}
+
+	return rep.ret;
+}
+
+static int call_name(fs_client_t *c, int op, const char *name, size_t arg0)
+{
+	struct proto_req req = { .op = op, .arg0 = arg0 };
+
+	if (!name)
+		return -1;
+	req.len = strlen(name) + 1;
+
+	return call(c, &req, name, -1, NULL, 0);
+}
+
+static int call_fd(fs_client_t *c, int op, int fd, size_t arg0, size_t arg1,
+		   size_t arg2)
+{
+	struct proto_req req = {
+		.op = op,
+		.fd = fd,
+		.arg0 = arg0,
+		.arg1 = arg1,
+		.arg2 = arg2,
+	};
+
+	return call(c, &req, NULL, -1, NULL, 0);
+}
+
+int fs_client_info(fs_client_t *c)
+{
+	struct proto_req req = { .op = PROTO_INFO };
+
+	return call(c, &req, NULL, -1, NULL, 0);
+}
+
+int fs_client_ls(fs_client_t *c)
+{
+	struct proto_req req = { .op = PROTO_LS };
+
+	return call(c, &req, NULL, -1, NULL, 0);
+}
+
+int fs_client_create(fs_client_t *c, const char *filename)
+{
+	return call_name(c, PROTO_CREATE, filename, 0);
+}
+
+int fs_client_delete(fs_client_t *c, const char *filename)
+{
+	return call_name(c, PROTO_DELETE, filename, 0);
+}
+
+int fs_client_open(fs_client_t *c, const char *filename)
+{
+	return call_name(c, PROTO_OPEN, filename, 0);
+}
+
+int fs_client_open_flags(fs_client_t *c, const char *filename, int flags)
+{
+	return call_name(c, PROTO_OPEN, filename, flags);
+}
+
+int fs_client_close(fs_client_t *c, int fd)
+{
+	return call_fd(c, PROTO_CLOSE, fd, 0, 0, 0);
+}
+
+int fs_client_stat(fs_client_t *c, int fd)
+{
+	return call_fd(c, PROTO_STAT, fd, 0, 0, 0);
+}
+
+int fs_client_lseek(fs_client_t *c, int fd, size_t offset)
+{
+	return call_fd(c, PROTO_LSEEK, fd, offset, 0, 0);
+}
+
+int fs_client_write(fs_client_t *c, int fd, void *buf, size_t count)
+{
+	size_t done = 0;
+
+	/* Larger writes are split into several requests */
+	do {
+		struct proto_req req = { .op = PROTO_WRITE, .fd = fd };
+		int ret;
+
+		req.len = count - done < PROTO_PAYLOAD_MAX ?
+			count - done : PROTO_PAYLOAD_MAX;
+		ret = call(c, &req, (char *)buf + done, -1, NULL, 0);
+		if (ret < 0)
+			return done ? (int)done : -1;
+		done += ret;
+		if (ret < (int)req.len)
+			break;
+	} while (done < count);
+
+	return done;
+}
+
+int fs_client_read(fs_client_t *c, int fd, void *buf, size_t count)
+{
+	size_t done = 0;
+
+	/* Larger reads are split into several requests */
+	do {
+		size_t len = count - done < PROTO_PAYLOAD_MAX ?
+			count - done : PROTO_PAYLOAD_MAX;
+		struct proto_req req = { .op = PROTO_READ, .fd = fd, .arg0 = len };
+		int ret;
+
+		ret = call(c, &req, NULL, -1, (char *)buf + done, len);
+		if (ret < 0)
+			return done ? (int)done : -1;
+		done += ret;
+		if (ret < (int)len)
+			break;
+	} while (done < count);
+
+	return done;
+}
+
+int fs_client_advise(fs_client_t *c, int fd, size_t offset, size_t len,
+		     int advice)
+{
+	return call_fd(c, PROTO_ADVISE, fd, offset, len, advice);
+}
+
+int fs_client_trim(fs_client_t *c)
+{
+	struct proto_req req = { .op = PROTO_TRIM };
+
+	return call(c, &req, NULL, -1, NULL, 0);
+}
+
+int fs_client_clone(fs_client_t *c, const char *src, const char *dst)
+{
+	struct proto_req req = { .op = PROTO_CLONE };
+	char names[2 * FS_FILENAME_LEN];
+	size_t src_len, dst_len;
+
+	if (!src || !dst)
+		return -1;
+	src_len = strlen(src) + 1;
+	dst_len = strlen(dst) + 1;
+	if (src_len > FS_FILENAME_LEN || dst_len > FS_FILENAME_LEN)
+		return -1;
+
+	memcpy(names, src, src_len);
+	memcpy(names + src_len, dst, dst_len);
+	req.len = src_len + dst_len;
+
+	return call(c, &req, names, -1, NULL, 0);
+}
+
+int fs_client_snapshot_create(fs_client_t *c, const char *name)
+{
+	return call_name(c, PROTO_SNAPSHOT_CREATE, name, 0);
+}
+
+int fs_client_snapshot_delete(fs_client_t *c, const char *name)
+{
+	return call_name(c, PROTO_SNAPSHOT_DELETE, name, 0);
+}
+
+int fs_client_copy_to_fd(fs_client_t *c, int fd, int host_fd, size_t offset,
+			 size_t count)
+{
+	struct proto_req req = {
+		.op = PROTO_COPY_TO_FD,
+		.fd = fd,
+		.arg0 = offset,
+		.arg1 = count,
+	};
+
+	if (host_fd < 0)
+		return -1;
+
+	return call(c, &req, NULL, host_fd, NULL, 0);
+}
+
+int fs_client_copy_from_fd(fs_client_t *c, int fd, int host_fd, size_t offset,
+			   size_t count)
+{
+	struct proto_req req = {
+		.op = PROTO_COPY_FROM_FD,
+		.fd = fd,
+		.arg0 = offset,
+		.arg1 = count,
+	};
+
+	if (host_fd < 0)
+		return -1;
+
+	return call(c, &req, NULL, host_fd, NULL, 0);
+}
@@ -1,8 +1,19 @@
+#define _GNU_SOURCE /* for O_DIRECT and fallocate() */
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
@@ -10,135 +21,1443 @@
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Free aligned bounce buffer (the link lives in the buffer itself) */
+struct aligned_buf {
+	struct aligned_buf *next;
+};
+
+/* Multi-block request being split across the members of a disk */
+struct stripe_req {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending; // Member jobs not completed yet
+	int error;
+};
+
+/* Share of a multi-block request for one member: a contiguous range of the
+ * member image, scattered over (or gathered from) the caller's buffer */
+struct stripe_job {
+	struct stripe_job *next;
+	struct stripe_req *req;
+	int write;
+	off_t offset;
+	struct iovec *iov;
+	int iovcnt;
+};
+
+/* Image file backing a disk (a stripe set has several of them) */
+struct member {
+	int fd;
+	size_t size;
+	/* Read-only mapping of the image (NULL until a block is mapped) */
+	void *map;
+	/* Worker issuing the member's jobs, for stripe sets only */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct stripe_job *jobs;
+	int stop;
+};
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
-	/* Block count */
+	/* Member images, and number of blocks of each stripe unit */
+	struct member *members;
+	int nmembers;
+	size_t width;
+	/* Block count, block size and its log2 */
 	size_t bcount;
+	size_t bsize;
+	unsigned int bshift;
+	/* BLOCK_DISK_* flags */
+	int flags;
+	/* Pool of aligned bounce buffers, for unaligned transfers in direct mode */
+	struct aligned_buf *pool;
+	pthread_mutex_t pool_lock;
+	/* Serializes the mapping of the member images */
+	pthread_mutex_t map_lock;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Virtual disk used by the functions without a disk handle (none by default) */
+static disk_t *default_disk;
 
-int block_disk_open(const char *diskname)
+/* Block operation counters */
+static struct block_stats stats;
+
+/* Trace ring slot: @seq is the ring position + 1 once @rec is complete */
+struct trace_slot {
+	uint64_t seq;
+	struct block_trace_rec rec;
+};
+
+/* Block operation trace ring (disabled by default) */
+static struct {
+	struct trace_slot *slots;
+	uint64_t mask;
+	uint64_t head;
+	uint64_t users;		/* Threads recording into or copying the ring */
+	size_t meta_last;
+} trace;
+
+/* Operation tag of the calling thread */
+static __thread const char *trace_op;
+
+static uint64_t trace_now(void)
 {
-	int fd;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Get the ring, or NULL if tracing is disabled. The ring is not freed until
+ * trace_put() is called.
+ */
+static struct trace_slot *trace_get(void)
+{
+	struct trace_slot *slots;
+
+	/* Either block_trace_disable() sees the user, or the user sees NULL */
+	__atomic_fetch_add(&trace.users, 1, __ATOMIC_SEQ_CST);
+	slots = __atomic_load_n(&trace.slots, __ATOMIC_SEQ_CST);
+	if (!slots)
+		__atomic_fetch_sub(&trace.users, 1, __ATOMIC_RELEASE);
+
+	return slots;
+}
+
+static void trace_put(void)
+{
+	__atomic_fetch_sub(&trace.users, 1, __ATOMIC_RELEASE);
+}
+
+static void trace_record(size_t block, int dir, uint64_t start)
+{
+	struct trace_slot *slots = trace_get();
+	struct trace_slot *slot;
+	uint64_t pos;
+
+	if (!slots)
+		return;
+
+	/* Claim a position, then publish the record through its sequence */
+	pos = __atomic_fetch_add(&trace.head, 1, __ATOMIC_RELAXED);
+	slot = &slots[pos & trace.mask];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->rec.ts_ns = start;
+	slot->rec.latency_ns = trace_now() - start;
+	slot->rec.block = block;
+	slot->rec.dir = dir;
+	slot->rec.op = trace_op;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	trace_put();
+}
+
+/* Get an aligned bounce buffer from the pool of @d */
+static void *pool_get(disk_t *d)
+{
+	struct aligned_buf *buf;
+	void *mem;
+
+	pthread_mutex_lock(&d->pool_lock);
+	buf = d->pool;
+	if (buf)
+		d->pool = buf->next;
+	pthread_mutex_unlock(&d->pool_lock);
+	if (buf)
+		return buf;
+
+	if (posix_memalign(&mem, BLOCK_ALIGN, d->bsize)) {
+		block_error("cannot allocate aligned buffer");
+		return NULL;
+	}
+	return mem;
+}
+
+static void pool_put(disk_t *d, void *mem)
+{
+	struct aligned_buf *buf = mem;
+
+	pthread_mutex_lock(&d->pool_lock);
+	buf->next = d->pool;
+	d->pool = buf;
+	pthread_mutex_unlock(&d->pool_lock);
+}
+
+/* Whether a transfer from/to @buf must go through an aligned bounce buffer */
+static int needs_bounce(disk_t *d, const void *buf)
+{
+	return (d->flags & BLOCK_DISK_DIRECT) &&
+		((uintptr_t)buf % BLOCK_ALIGN) != 0;
+}
+
+/* Member holding logical block @block, and byte offset of the block in it */
+static struct member *locate(disk_t *d, size_t block, off_t *offset)
+{
+	size_t unit = block / d->width;
+
+	*offset = (off_t)((unit / d->nmembers) * d->width + block % d->width) <<
+		d->bshift;
+	return &d->members[unit % d->nmembers];
+}
+
+/* Transfer a whole job, resuming after short transfers */
+static int job_run(int fd, struct stripe_job *job)
+{
+	struct iovec *iov = job->iov;
+	int iovcnt = job->iovcnt;
+	off_t offset = job->offset;
+
+	while (iovcnt > 0) {
+		int cnt = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		ssize_t ret;
+
+		if (job->write)
+			ret = pwritev(fd, iov, cnt, offset);
+		else
+			ret = preadv(fd, iov, cnt, offset);
+		if (ret <= 0) {
+			perror(job->write ? "pwritev" : "preadv");
+			return -1;
+		}
+
+		offset += ret;
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (ret) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static void job_done(struct stripe_job *job, int ret)
+{
+	struct stripe_req *req = job->req;
+
+	pthread_mutex_lock(&req->lock);
+	if (ret)
+		req->error = 1;
+	if (--req->pending == 0)
+		pthread_cond_signal(&req->done);
+	pthread_mutex_unlock(&req->lock);
+}
+
+static void *member_worker(void *arg)
+{
+	struct member *m = arg;
+	struct stripe_job *job;
+
+	pthread_mutex_lock(&m->lock);
+	for (;;) {
+		while (!m->jobs && !m->stop)
+			pthread_cond_wait(&m->cond, &m->lock);
+		if (!m->jobs)
+			break;
+		job = m->jobs;
+		m->jobs = job->next;
+		pthread_mutex_unlock(&m->lock);
+
+		job_done(job, job_run(m->fd, job));
+
+		pthread_mutex_lock(&m->lock);
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	return NULL;
+}
+
+static void member_submit(struct member *m, struct stripe_job *job)
+{
+	pthread_mutex_lock(&m->lock);
+	job->next = m->jobs;
+	m->jobs = job;
+	pthread_cond_signal(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+}
+
+static void members_close(struct member *members, int n, int workers)
+{
+	for (int i = 0; i < n; i++) {
+		struct member *m = &members[i];
+
+		if (workers) {
+			pthread_mutex_lock(&m->lock);
+			m->stop = 1;
+			pthread_cond_signal(&m->cond);
+			pthread_mutex_unlock(&m->lock);
+			pthread_join(m->thread, NULL);
+			pthread_mutex_destroy(&m->lock);
+			pthread_cond_destroy(&m->cond);
+		}
+		if (m->map)
+			munmap(m->map, m->size);
+		close(m->fd);
+	}
+	free(members);
+}
+
+/* Open image @diskname as a member, and get its block count */
+static int member_open(struct member *m, const char *diskname, int flags)
+{
+	int oflags = (flags & BLOCK_DISK_RDONLY) ? O_RDONLY : O_RDWR;
 	struct stat st;
 
+	if (flags & BLOCK_DISK_DIRECT)
+		oflags |= O_DIRECT;
+
+	if ((m->fd = open(diskname, oflags, 0644)) < 0) {
+		if (errno == EINVAL && (flags & BLOCK_DISK_DIRECT))
+			block_error("'%s' does not support direct I/O",
+				    diskname);
+		else
+			perror("open");
+		return -1;
+	}
+
+	if (fstat(m->fd, &st)) {
+		perror("fstat");
+		close(m->fd);
+		return -1;
+	}
+
+	/* The disk image's size should be a multiple of any block size */
+	if (st.st_size % BLOCK_SIZE_MIN != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    st.st_size, BLOCK_SIZE_MIN);
+		close(m->fd);
+		return -1;
+	}
+
+	/* The host's read-ahead follows the image, not the files it holds:
+	 * callers read ahead themselves with block_advise_ctx() */
+	if (!(flags & BLOCK_DISK_DIRECT))
+		posix_fadvise(m->fd, 0, 0, POSIX_FADV_RANDOM);
+
+	m->size = st.st_size;
+	return 0;
+}
+
+/* Lay out the blocks of @d with a size of 1 << @shift bytes: only the whole
+ * blocks (whole stripe units, for stripe sets) of the smallest member are
+ * used. With @strict, the members must be made of whole blocks. */
+static int disk_layout(disk_t *d, unsigned int shift, int strict)
+{
+	size_t min = SIZE_MAX;
+	int i;
+
+	for (i = 0; i < d->nmembers; i++) {
+		size_t size = d->members[i].size;
+
+		if (strict && size % ((size_t)1 << shift)) {
+			block_error("size '%zu' is not multiple of '%zu'",
+				    size, (size_t)1 << shift);
+			return -1;
+		}
+		if (size >> shift < min)
+			min = size >> shift;
+	}
+
+	if (d->nmembers > 1) {
+		min = min / d->width * d->width;
+		if (!min) {
+			block_error("stripe members smaller than a stripe unit");
+			return -1;
+		}
+	}
+
+	d->bcount = min * d->nmembers;
+	d->bsize = (size_t)1 << shift;
+	d->bshift = shift;
+
+	return 0;
+}
+
+disk_t *block_disk_open_ctx(const char *diskname)
+{
+	return block_disk_open_flags(diskname, 0);
+}
+
+disk_t *block_disk_open_flags(const char *diskname, int flags)
+{
+	const char *names[BLOCK_STRIPE_MAX];
+	char *spec, *sep, *name;
+	size_t width = BLOCK_STRIPE_WIDTH;
+	int n = 0;
+	disk_t *d;
+
 	if (!diskname) {
+		block_error("invalid file diskname");
+		return NULL;
+	}
+
+	if (!strchr(diskname, ','))
+		return block_disk_open_stripe(&diskname, 1, 1, flags);
+
+	/* Stripe set: "<image>,<image>[,...][:<width>]" */
+	if (!(spec = strdup(diskname))) {
+		perror("strdup");
+		return NULL;
+	}
+	if ((sep = strrchr(spec, ':'))) {
+		*sep = '\0';
+		width = strtoul(sep + 1, NULL, 0);
+	}
+	for (name = strtok(spec, ","); name; name = strtok(NULL, ",")) {
+		if (n == BLOCK_STRIPE_MAX) {
+			block_error("too many stripe members");
+			free(spec);
+			return NULL;
+		}
+		names[n++] = name;
+	}
+
+	d = block_disk_open_stripe(names, n, width, flags);
+	free(spec);
+
+	return d;
+}
+
+int block_disk_create(const char *diskname, size_t count, size_t block_size,
+		      int flags)
+{
+	off_t size = (off_t)count * block_size;
+	int fd, ret = 0;
+
+	if (!diskname || strchr(diskname, ',')) {
 		block_error("invalid file diskname");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
+	if (block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX ||
+	    (block_size & (block_size - 1))) {
+		block_error("invalid block size '%zu'", block_size);
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
 		perror("open");
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
-		return -1;
+	/* Blocks never written are holes, read as zeros */
+	if (ftruncate(fd, size)) {
+		perror("ftruncate");
+		ret = -1;
+	} else if ((flags & BLOCK_DISK_PREALLOC) && size > 0 &&
+		   fallocate(fd, 0, 0, size)) {
+		perror("fallocate");
+		ret = -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	close(fd);
+	if (ret)
+		unlink(diskname);
+
+	return ret;
+}
+
+disk_t *block_disk_open_stripe(const char **disknames, int count,
+			       size_t width, int flags)
+{
+	struct member *members;
+	disk_t *d;
+	int i;
+
+	if (!disknames || count <= 0 || count > BLOCK_STRIPE_MAX || !width) {
+		block_error("invalid stripe set");
+		return NULL;
+	}
+
+	members = calloc(count, sizeof(*members));
+	if (!members) {
+		perror("calloc");
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!disknames[i] ||
+		    member_open(&members[i], disknames[i], flags)) {
+			members_close(members, i, 0);
+			return NULL;
+		}
+	}
+
+	d = malloc(sizeof(*d));
+	if (!d) {
+		perror("malloc");
+		members_close(members, count, 0);
+		return NULL;
+	}
+
+	d->members = members;
+	d->nmembers = count;
+	d->width = count > 1 ? width : SIZE_MAX;
+	/* Until the actual block size is set, trailing bytes that do not make
+	 * a whole default block are left out */
+	if (disk_layout(d, __builtin_ctz(BLOCK_SIZE), 0)) {
+		members_close(members, count, 0);
+		free(d);
+		return NULL;
+	}
+	d->flags = flags;
+	d->pool = NULL;
+	pthread_mutex_init(&d->pool_lock, NULL);
+	pthread_mutex_init(&d->map_lock, NULL);
+
+	/* A single image is accessed directly by the calling threads */
+	for (i = 0; count > 1 && i < count; i++) {
+		pthread_mutex_init(&members[i].lock, NULL);
+		pthread_cond_init(&members[i].cond, NULL);
+		pthread_create(&members[i].thread, NULL, member_worker,
+			       &members[i]);
+	}
+
+	return d;
+}
+
+int block_disk_close_ctx(disk_t *d)
+{
+	if (!d) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	members_close(d->members, d->nmembers, d->nmembers > 1);
+	while (d->pool) {
+		struct aligned_buf *next = d->pool->next;
+
+		free(d->pool);
+		d->pool = next;
+	}
+	pthread_mutex_destroy(&d->pool_lock);
+	pthread_mutex_destroy(&d->map_lock);
+	free(d);
 
 	return 0;
 }
 
-int block_disk_close(void)
+int block_disk_count_ctx(disk_t *d)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	return d->bcount;
+}
 
-	disk.fd = INVALID_FD;
+int block_disk_set_block_size_ctx(disk_t *d, size_t size)
+{
+	struct aligned_buf *buf;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX ||
+	    (size & (size - 1))) {
+		block_error("invalid block size '%zu'", size);
+		return -1;
+	}
+
+	if (disk_layout(d, __builtin_ctzl(size), 1))
+		return -1;
+
+	/* Bounce buffers of the previous size */
+	pthread_mutex_lock(&d->pool_lock);
+	while ((buf = d->pool)) {
+		d->pool = buf->next;
+		free(buf);
+	}
+	pthread_mutex_unlock(&d->pool_lock);
 
 	return 0;
 }
 
-int block_disk_count(void)
+int block_disk_block_size_ctx(disk_t *d)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return d->bsize;
 }
 
-int block_write(size_t block, const void *buf)
+int block_write_ctx(disk_t *d, size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	struct member *m;
+	uint64_t start;
+	void *bounce = NULL;
+	off_t offset;
+	ssize_t ret;
+
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block >= d->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block, d->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (d->flags & BLOCK_DISK_RDONLY) {
+		block_error("disk is read-only");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	start = trace.slots ? trace_now() : 0;
+
+	/* Direct I/O needs an aligned buffer */
+	if (needs_bounce(d, buf)) {
+		if (!(bounce = pool_get(d)))
+			return -1;
+		memcpy(bounce, buf, d->bsize);
+		buf = bounce;
+	}
+
+	/* Perform the actual write into the disk image, at the specified
+	 * block number (positioned I/O so that threads can share a disk) */
+	m = locate(d, block, &offset);
+	ret = pwrite(m->fd, buf, d->bsize, offset);
+	if (bounce)
+		pool_put(d, bounce);
+	if (ret < 0) {
+		perror("pwrite");
 		return -1;
 	}
 
+	__atomic_fetch_add(&stats.writes, 1, __ATOMIC_RELAXED);
+	if (start)
+		trace_record(block, BLOCK_TRACE_WRITE, start);
+
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+int block_read_ctx(disk_t *d, size_t block, void *buf)
+{
+	struct member *m;
+	uint64_t start;
+	void *bounce = NULL;
+	off_t offset;
+	ssize_t ret;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= d->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, d->bcount);
+		return -1;
+	}
+
+	start = trace.slots ? trace_now() : 0;
+
+	/* Direct I/O needs an aligned buffer */
+	if (needs_bounce(d, buf) && !(bounce = pool_get(d)))
+		return -1;
+
+	/* Perform the actual read from the disk image, at the specified
+	 * block number */
+	m = locate(d, block, &offset);
+	ret = pread(m->fd, bounce ? bounce : buf, d->bsize, offset);
+	if (bounce) {
+		if (ret >= 0)
+			memcpy(buf, bounce, d->bsize);
+		pool_put(d, bounce);
+	}
+	if (ret < 0) {
+		perror("pread");
+		return -1;
+	}
+
+	__atomic_fetch_add(&stats.reads, 1, __ATOMIC_RELAXED);
+	if (start)
+		trace_record(block, BLOCK_TRACE_READ, start);
+
+	return 0;
+}
+
+int block_discard_ctx(disk_t *d, size_t block, size_t count)
+{
+	size_t b;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= d->bcount || count > d->bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, d->bcount);
+		return -1;
+	}
+
+	if (d->flags & BLOCK_DISK_RDONLY) {
+		block_error("disk is read-only");
+		return -1;
+	}
+
+	/* Punch each stripe unit of the range out of its member */
+	for (b = block; b < block + count; ) {
+		size_t len = d->width - b % d->width;
+		struct member *m;
+		off_t offset;
+
+		if (len > block + count - b)
+			len = block + count - b;
+
+		m = locate(d, b, &offset);
+		if (fallocate(m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      offset, (off_t)len << d->bshift)) {
+			/* Not supported by the host file system: nothing to release */
+			if (errno != EOPNOTSUPP)
+				perror("fallocate");
+			return -1;
+		}
+		b += len;
+	}
+
+	return 0;
+}
+
+int block_advise_ctx(disk_t *d, size_t block, size_t count, int advice)
 {
-	if (disk.fd == INVALID_FD) {
+	size_t b;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= d->bcount || count > d->bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, d->bcount);
+		return -1;
+	}
+
+	if (advice != BLOCK_ADVISE_WILLNEED && advice != BLOCK_ADVISE_DONTNEED)
+		return -1;
+
+	if (d->flags & BLOCK_DISK_DIRECT)
+		return 0;
+
+	/* Hint each stripe unit of the range to its member */
+	for (b = block; b < block + count; ) {
+		size_t len = d->nmembers > 1 ? d->width - b % d->width :
+			block + count - b;
+		struct member *m;
+		off_t offset;
+
+		if (len > block + count - b)
+			len = block + count - b;
+
+		m = locate(d, b, &offset);
+		posix_fadvise(m->fd, offset, (off_t)len << d->bshift,
+			      advice == BLOCK_ADVISE_WILLNEED ?
+			      POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+		b += len;
+	}
+
+	return 0;
+}
+
+int block_writeback_ctx(disk_t *d, size_t block, size_t count, int wait)
+{
+	unsigned int flags = SYNC_FILE_RANGE_WRITE;
+	size_t b;
+
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block >= d->bcount || count > d->bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, d->bcount);
+		return -1;
+	}
+
+	if (d->flags & BLOCK_DISK_DIRECT)
+		return 0;
+
+	if (wait)
+		flags |= SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WAIT_AFTER;
+
+	/* Write each stripe unit of the range back from its member */
+	for (b = block; b < block + count; ) {
+		size_t len = d->nmembers > 1 ? d->width - b % d->width :
+			block + count - b;
+		struct member *m;
+		off_t offset;
+
+		if (len > block + count - b)
+			len = block + count - b;
+
+		m = locate(d, b, &offset);
+		if (sync_file_range(m->fd, offset, (off_t)len << d->bshift,
+				    flags)) {
+			perror("sync_file_range");
+			return -1;
+		}
+		b += len;
+	}
+
+	return 0;
+}
+
+const void *block_map_ctx(disk_t *d, size_t block)
+{
+	struct member *m;
+	off_t offset;
+	void *map;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return NULL;
+	}
+
+	if (block >= d->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block, d->bcount);
+		return NULL;
+	}
+
+	/* Each member image is mapped whole, on first use */
+	m = locate(d, block, &offset);
+	map = __atomic_load_n(&m->map, __ATOMIC_ACQUIRE);
+	if (!map) {
+		pthread_mutex_lock(&d->map_lock);
+		if (!m->map) {
+			map = mmap(NULL, m->size, PROT_READ, MAP_SHARED, m->fd,
+				   0);
+			if (map == MAP_FAILED) {
+				pthread_mutex_unlock(&d->map_lock);
+				perror("mmap");
+				return NULL;
+			}
+			__atomic_store_n(&m->map, map, __ATOMIC_RELEASE);
+		}
+		map = m->map;
+		pthread_mutex_unlock(&d->map_lock);
+	}
+
+	return (char *)map + offset;
+}
+
+long block_map_lookup_ctx(disk_t *d, const void *addr)
+{
+	const char *p = addr;
+
+	if (!d)
 		return -1;
+
+	for (int i = 0; i < d->nmembers; i++) {
+		struct member *m = &d->members[i];
+		const char *map = __atomic_load_n(&m->map, __ATOMIC_ACQUIRE);
+		size_t block;
+
+		if (!map || p < map || p >= map + m->size)
+			continue;
+
+		/* Inverse of locate() */
+		block = (p - map) >> d->bshift;
+		return (block / d->width * d->nmembers + i) * d->width +
+			block % d->width;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return -1;
+}
+
+/* Whether a failed copy between file descriptors should be done another way */
+static int copy_unsupported(void)
+{
+	return errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+		errno == EOPNOTSUPP || errno == EBADF;
+}
+
+/* Send the rest of the block at byte @offset of member @m (up to @len bytes)
+ * to @fd, through a bounce buffer */
+static ssize_t send_buffered(disk_t *d, struct member *m, off_t offset,
+			     size_t len, int fd)
+{
+	size_t skip = offset & (d->bsize - 1);
+	void *bounce = pool_get(d);
+	ssize_t ret;
+
+	if (!bounce)
 		return -1;
+
+	/* Whole aligned blocks, for direct I/O */
+	ret = pread(m->fd, bounce, d->bsize, offset - skip);
+	if (ret == (ssize_t)d->bsize) {
+		ret = write(fd, (char *)bounce + skip,
+			    len < d->bsize - skip ? len : d->bsize - skip);
+	} else if (ret >= 0) {
+		errno = EIO;
+		ret = -1;
 	}
+	pool_put(d, bounce);
+
+	return ret;
+}
+
+/* Send @len bytes from byte @offset of member @m to @fd */
+static ssize_t send_range(disk_t *d, struct member *m, off_t offset,
+			  size_t len, int fd)
+{
+	ssize_t ret;
+
+	/* Within the host kernel: shared extents or in-kernel copy to a file,
+	 * page cache to a pipe or socket otherwise */
+	ret = copy_file_range(m->fd, &offset, fd, NULL, len, 0);
+	if (ret >= 0 || !copy_unsupported())
+		return ret;
+	ret = sendfile(fd, m->fd, &offset, len);
+	if (ret >= 0 || !copy_unsupported())
+		return ret;
+
+	return send_buffered(d, m, offset, len, fd);
+}
+
+/* Receive up to one block from @fd into the block at byte @offset of member
+ * @m, through a bounce buffer (the rest of the block is zeroed) */
+static ssize_t receive_buffered(disk_t *d, struct member *m, off_t offset,
+				size_t len, int fd)
+{
+	void *bounce = pool_get(d);
+	ssize_t ret = 0, n = 1;
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (!bounce)
 		return -1;
+
+	if (len > d->bsize)
+		len = d->bsize;
+	while (ret < (ssize_t)len &&
+	       (n = read(fd, (char *)bounce + ret, len - ret)) > 0)
+		ret += n;
+	if (n < 0) {
+		ret = -1;
+	} else if (ret > 0) {
+		memset((char *)bounce + ret, 0, d->bsize - ret);
+		if (pwrite(m->fd, bounce, d->bsize, offset) != (ssize_t)d->bsize)
+			ret = -1;
+	}
+	pool_put(d, bounce);
+
+	return ret;
+}
+
+/* Receive up to @len bytes from @fd at byte @offset of member @m */
+static ssize_t receive_range(disk_t *d, struct member *m, off_t offset,
+			     size_t len, int fd)
+{
+	ssize_t ret;
+
+	ret = copy_file_range(fd, NULL, m->fd, &offset, len, 0);
+	if (ret >= 0 || !copy_unsupported())
+		return ret;
+
+	return receive_buffered(d, m, offset, len, fd);
+}
+
+/* Copy @len bytes between @fd and the disk, from byte @start of the disk: each
+ * stripe unit is a contiguous range of its member */
+static long copy_fd(disk_t *d, size_t start, size_t len, int fd, int write)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		size_t pos = start + done, block = pos >> d->bshift;
+		size_t n = len - done, unit;
+		struct member *m;
+		off_t offset;
+		ssize_t ret;
+
+		m = locate(d, block, &offset);
+		offset += pos & (d->bsize - 1);
+		if (d->nmembers > 1) {
+			unit = ((d->width - block % d->width) << d->bshift) -
+				(pos & (d->bsize - 1));
+			if (n > unit)
+				n = unit;
+		}
+
+		if (write)
+			ret = receive_range(d, m, offset, n, fd);
+		else
+			ret = send_range(d, m, offset, n, fd);
+		if (ret < 0) {
+			perror(write ? "copy from fd" : "copy to fd");
+			if (!done)
+				return -1;
+			break;
+		}
+		if (!ret) /* End of the input */
+			break;
+		done += ret;
 	}
 
+	if (done)
+		__atomic_fetch_add(write ? &stats.writes : &stats.reads,
+				   ((start & (d->bsize - 1)) + done + d->bsize - 1) >>
+				   d->bshift, __ATOMIC_RELAXED);
+	return done;
+}
+
+long block_copy_to_fd_ctx(disk_t *d, size_t block, size_t offset, size_t len,
+			  int fd)
+{
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= d->bcount ||
+	    offset + len > (d->bcount - block) << d->bshift) {
+		block_error("byte range out of bounds (%zu+%zu+%zu/%zu)",
+			    block, offset, len, d->bcount);
+		return -1;
+	}
+
+	return copy_fd(d, (block << d->bshift) + offset, len, fd, 0);
+}
+
+long block_copy_from_fd_ctx(disk_t *d, size_t block, size_t count, int fd)
+{
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= d->bcount || count > d->bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, d->bcount);
+		return -1;
+	}
+
+	if (d->flags & BLOCK_DISK_RDONLY) {
+		block_error("disk is read-only");
+		return -1;
+	}
+
+	return copy_fd(d, block << d->bshift, count << d->bshift, fd, 1);
+}
+
+/*
+ * Transfer blocks @block..@block+@count-1. The request is cut into stripe
+ * units; the units of a member are contiguous in its image, so each member
+ * gets a single vectored job. Jobs of other members are handed to their
+ * workers while the calling thread runs the first one itself.
+ */
+static int transfer_many(disk_t *d, size_t block, size_t count, char *buf,
+			 int write)
+{
+	struct stripe_req req = { .pending = 0 };
+	struct stripe_job *jobs, *first = NULL;
+	struct iovec *iovs;
+	size_t per_member, b, i;
+	uint64_t start;
+	int ret = 0;
+
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= d->bcount || count > d->bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, d->bcount);
+		return -1;
+	}
+
+	if (!count)
+		return 0;
+
+	if (write && (d->flags & BLOCK_DISK_RDONLY)) {
+		block_error("disk is read-only");
+		return -1;
+	}
+
+	/* Unaligned buffers in direct mode go block by block through the pool */
+	if (needs_bounce(d, buf)) {
+		for (i = 0; i < count && !ret; i++) {
+			if (write)
+				ret = block_write_ctx(d, block + i, buf + (i << d->bshift));
+			else
+				ret = block_read_ctx(d, block + i, buf + (i << d->bshift));
+		}
+		return ret;
+	}
+
+	start = trace.slots ? trace_now() : 0;
+
+	/* A member gets at most one unit out of each full stripe, plus the
+	 * partial stripes at both ends */
+	per_member = d->nmembers > 1 ? count / (d->width * d->nmembers) + 2 : 1;
+	jobs = calloc(d->nmembers, sizeof(*jobs));
+	iovs = malloc(d->nmembers * per_member * sizeof(*iovs));
+	if (!jobs || !iovs) {
+		perror("malloc");
+		free(jobs);
+		free(iovs);
+		return -1;
+	}
+
+	for (b = block; b < block + count; ) {
+		size_t len = d->width - b % d->width;
+		struct stripe_job *job;
+		struct member *m;
+		off_t offset;
+
+		if (len > block + count - b)
+			len = block + count - b;
+
+		m = locate(d, b, &offset);
+		job = &jobs[m - d->members];
+		if (!job->iov) {
+			job->iov = &iovs[(m - d->members) * per_member];
+			job->offset = offset;
+			job->write = write;
+			job->req = &req;
+			req.pending++;
+		}
+		job->iov[job->iovcnt].iov_base = buf + ((b - block) << d->bshift);
+		job->iov[job->iovcnt].iov_len = len << d->bshift;
+		job->iovcnt++;
+		b += len;
+	}
+
+	pthread_mutex_init(&req.lock, NULL);
+	pthread_cond_init(&req.done, NULL);
+	for (i = 0; i < (size_t)d->nmembers; i++) {
+		if (!jobs[i].iov)
+			continue;
+		if (!first)
+			first = &jobs[i];
+		else
+			member_submit(&d->members[i], &jobs[i]);
+	}
+	job_done(first, job_run(d->members[first - jobs].fd, first));
+
+	pthread_mutex_lock(&req.lock);
+	while (req.pending)
+		pthread_cond_wait(&req.done, &req.lock);
+	pthread_mutex_unlock(&req.lock);
+	pthread_mutex_destroy(&req.lock);
+	pthread_cond_destroy(&req.done);
+	free(jobs);
+	free(iovs);
+
+	if (req.error)
+		return -1;
+
+	__atomic_fetch_add(write ? &stats.writes : &stats.reads, count,
+			   __ATOMIC_RELAXED);
+	for (i = 0; start && i < count; i++)
+		trace_record(block + i, write ? BLOCK_TRACE_WRITE :
+			     BLOCK_TRACE_READ, start);
+
 	return 0;
 }
 
+int block_write_many_ctx(disk_t *d, size_t block, size_t count,
+			 const void *buf)
+{
+	return transfer_many(d, block, count, (char *)buf, 1);
+}
+
+int block_read_many_ctx(disk_t *d, size_t block, size_t count, void *buf)
+{
+	return transfer_many(d, block, count, buf, 0);
+}
+
+int block_disk_open(const char *diskname)
+{
+	if (default_disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	default_disk = block_disk_open_ctx(diskname);
+
+	return default_disk ? 0 : -1;
+}
+
+int block_disk_close(void)
+{
+	int ret = block_disk_close_ctx(default_disk);
+
+	default_disk = NULL;
+
+	return ret;
+}
+
+int block_disk_count(void)
+{
+	return block_disk_count_ctx(default_disk);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return block_write_ctx(default_disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return block_read_ctx(default_disk, block, buf);
+}
+
+void block_stats_get(struct block_stats *st)
+{
+	st->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+	st->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+}
+
+void block_stats_reset(void)
+{
+	__atomic_store_n(&stats.reads, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats.writes, 0, __ATOMIC_RELAXED);
+}
+
+int block_trace_enable(size_t nrecords)
+{
+	struct trace_slot *slots;
+	uint64_t size = 1;
+
+	if (!nrecords) {
+		block_error("invalid trace size");
+		return -1;
+	}
+
+	if (trace.slots) {
+		block_error("trace already enabled");
+		return -1;
+	}
+
+	/* Round up to a power of two so that positions wrap with a mask */
+	while (size < nrecords)
+		size <<= 1;
+
+	slots = calloc(size, sizeof(*slots));
+	if (!slots) {
+		perror("calloc");
+		return -1;
+	}
+
+	trace.mask = size - 1;
+	trace.head = 0;
+	__atomic_store_n(&trace.slots, slots, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int block_trace_disable(void)
+{
+	struct trace_slot *slots = trace.slots;
+
+	if (!slots) {
+		block_error("trace not enabled");
+		return -1;
+	}
+
+	__atomic_store_n(&trace.slots, NULL, __ATOMIC_SEQ_CST);
+
+	/* Wait for the threads still recording into or copying the ring */
+	while (__atomic_load_n(&trace.users, __ATOMIC_ACQUIRE))
+		sched_yield();
+	free(slots);
+
+	return 0;
+}
+
+void block_trace_set_op(const char *op)
+{
+	trace_op = op;
+}
+
+void block_trace_set_meta(size_t last_block)
+{
+	trace.meta_last = last_block;
+}
+
+size_t block_trace_snapshot(struct block_trace_rec *recs, size_t max)
+{
+	struct trace_slot *slots = trace_get();
+	uint64_t head, pos, first;
+	size_t n = 0;
+
+	if (!slots)
+		return 0;
+
+	head = __atomic_load_n(&trace.head, __ATOMIC_ACQUIRE);
+	first = head > trace.mask + 1 ? head - (trace.mask + 1) : 0;
+	if (head - first > max)
+		first = head - max;
+
+	for (pos = first; pos < head; pos++) {
+		struct trace_slot *slot = &slots[pos & trace.mask];
+
+		/* Skip records still being written or already overwritten */
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			continue;
+		recs[n] = slot->rec;
+
+		/* Drop the copy if a writer wrapped around the ring meanwhile */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != pos + 1)
+			continue;
+		n++;
+	}
+	trace_put();
+
+	return n;
+}
+
+/* Copy the whole ring, or return NULL if there is nothing to look at */
+static struct block_trace_rec *trace_collect(size_t *count)
+{
+	struct block_trace_rec *recs;
+
+	if (!trace.slots) {
+		block_error("trace not enabled");
+		return NULL;
+	}
+
+	recs = malloc((trace.mask + 1) * sizeof(*recs));
+	if (!recs) {
+		perror("malloc");
+		return NULL;
+	}
+	*count = block_trace_snapshot(recs, trace.mask + 1);
+
+	return recs;
+}
+
+int block_trace_dump(FILE *f)
+{
+	struct block_trace_rec *recs;
+	size_t i, count;
+
+	if (!(recs = trace_collect(&count)))
+		return -1;
+
+	fprintf(f, "%-14s %-5s %-8s %-10s %s\n",
+		"time_us", "dir", "block", "lat_us", "op");
+	for (i = 0; i < count; i++) {
+		fprintf(f, "%-14.3f %-5s %-8zu %-10.3f %s\n",
+			(recs[i].ts_ns - recs[0].ts_ns) / 1000.0,
+			recs[i].dir == BLOCK_TRACE_READ ? "R" : "W",
+			recs[i].block, recs[i].latency_ns / 1000.0,
+			recs[i].op ? recs[i].op : "-");
+	}
+
+	free(recs);
+	return 0;
+}
+
+/* Number of log2 buckets in the seek distance distribution */
+#define TRACE_SEEK_BUCKETS 17
+/* Number of hot blocks reported */
+#define TRACE_HOT_COUNT 10
+
+int block_trace_summary(FILE *f)
+{
+	struct block_trace_rec *recs;
+	size_t i, j, count, max_block = 0;
+	size_t dir_count[2] = { 0 }, meta_count = 0;
+	uint64_t dir_lat[2] = { 0 };
+	size_t seek[TRACE_SEEK_BUCKETS] = { 0 };
+	size_t *hits;
+
+	if (!(recs = trace_collect(&count)))
+		return -1;
+
+	for (i = 0; i < count; i++)
+		if (recs[i].block > max_block)
+			max_block = recs[i].block;
+
+	hits = calloc(max_block + 1, sizeof(*hits));
+	if (!hits) {
+		perror("calloc");
+		free(recs);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct block_trace_rec *r = &recs[i];
+
+		dir_count[r->dir]++;
+		dir_lat[r->dir] += r->latency_ns;
+		hits[r->block]++;
+		if (r->block <= trace.meta_last)
+			meta_count++;
+
+		/* Bucket b holds distances in [2^(b-1), 2^b) */
+		if (i) {
+			size_t prev = recs[i - 1].block;
+			size_t dist = r->block > prev ?
+				r->block - prev : prev - r->block;
+			int b = 0;
+
+			while (dist && b < TRACE_SEEK_BUCKETS - 1) {
+				dist >>= 1;
+				b++;
+			}
+			seek[b]++;
+		}
+	}
+
+	fprintf(f, "Trace summary:\n");
+	fprintf(f, "records=%zu\n", count);
+	fprintf(f, "reads=%zu avg_lat_us=%.3f\n", dir_count[BLOCK_TRACE_READ],
+		dir_count[BLOCK_TRACE_READ] ?
+		dir_lat[BLOCK_TRACE_READ] / 1000.0 / dir_count[BLOCK_TRACE_READ] : 0);
+	fprintf(f, "writes=%zu avg_lat_us=%.3f\n", dir_count[BLOCK_TRACE_WRITE],
+		dir_count[BLOCK_TRACE_WRITE] ?
+		dir_lat[BLOCK_TRACE_WRITE] / 1000.0 / dir_count[BLOCK_TRACE_WRITE] : 0);
+	fprintf(f, "metadata=%zu/%zu (blocks 0..%zu)\n",
+		meta_count, count, trace.meta_last);
+	fprintf(f, "data=%zu/%zu\n", count - meta_count, count);
+
+	fprintf(f, "Seek distance:\n");
+	for (i = 0; i < TRACE_SEEK_BUCKETS; i++) {
+		if (!seek[i])
+			continue;
+		if (i <= 1)
+			fprintf(f, "  %zu: %zu\n", i, seek[i]);
+		else
+			fprintf(f, "  %zu-%zu: %zu\n", (size_t)1 << (i - 1),
+				((size_t)1 << i) - 1, seek[i]);
+	}
+
+	fprintf(f, "Hot blocks:\n");
+	for (i = 0; i < TRACE_HOT_COUNT; i++) {
+		size_t best = 0;
+
+		for (j = 1; j <= max_block; j++)
+			if (hits[j] > hits[best])
+				best = j;
+		if (!hits[best])
+			break;
+		fprintf(f, "  block %zu: %zu\n", best, hits[best]);
+		hits[best] = 0;
+	}
+
+	free(hits);
+	free(recs);
+	return 0;
+}
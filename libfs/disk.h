@@ -2,10 +2,41 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <stdio.h>
 
-/** Size of a disk block in bytes */
+/** Default size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Range of block sizes (powers of two) of block_disk_set_block_size_ctx() */
+#define BLOCK_SIZE_MIN 1024
+#define BLOCK_SIZE_MAX 65536
+
+/** Buffer alignment required by direct I/O (%BLOCK_DISK_DIRECT) */
+#define BLOCK_ALIGN 4096
+
+/** Bypass the host page cache (O_DIRECT) */
+#define BLOCK_DISK_DIRECT 0x1
+
+/** Open the images read-only: writes and discards fail */
+#define BLOCK_DISK_RDONLY 0x2
+
+/** Allocate the host storage of a new image up front (block_disk_create()) */
+#define BLOCK_DISK_PREALLOC 0x4
+
+/** Hints about blocks for block_advise_ctx() */
+#define BLOCK_ADVISE_WILLNEED 1 /* About to be read: fetch them ahead */
+#define BLOCK_ADVISE_DONTNEED 2 /* Not to be read again soon: evict them */
+
+/** Default stripe width (in blocks) of stripe sets */
+#define BLOCK_STRIPE_WIDTH 16
+
+/** Maximum number of images in a stripe set */
+#define BLOCK_STRIPE_MAX 16
+
+/** Opaque virtual disk handle */
+typedef struct disk disk_t;
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -39,8 +70,8 @@ int block_disk_count(void);
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
- * block @block.
+ * Write the content of buffer @buf (one block, of %BLOCK_SIZE bytes unless set
+ * otherwise) in the virtual disk's block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
  * operation fails. 0 otherwise.
@@ -52,13 +83,404 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
- * buffer @buf.
+ * Read the content of virtual disk's block @block (one block, of %BLOCK_SIZE
+ * bytes unless set otherwise) into buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
  * operation fails. 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_disk_open_ctx - Open a virtual disk file as a new disk instance
+ * @diskname: Name of the virtual disk file
+ *
+ * Like block_disk_open(), but return a handle to an independent disk instance
+ * instead of opening the default one. Any number of disks can be open at the
+ * same time, and a disk can be accessed concurrently from several threads.
+ *
+ * Return: NULL if @diskname is invalid or if the virtual disk file cannot be
+ * opened. The disk handle otherwise.
+ */
+disk_t *block_disk_open_ctx(const char *diskname);
+
+/**
+ * block_disk_open_flags - Open a virtual disk file as a new disk instance
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of %BLOCK_DISK_* options
+ *
+ * Like block_disk_open_ctx(). With %BLOCK_DISK_DIRECT, blocks are transferred
+ * with direct I/O and do not go through the host page cache. Buffers aligned
+ * on %BLOCK_ALIGN are transferred as is; other buffers go through a pool of
+ * aligned bounce buffers owned by the disk. With %BLOCK_DISK_RDONLY, the
+ * images are opened read-only, so that images without write permission can be
+ * opened, and every write or discard fails.
+ *
+ * A @diskname of the form "<image>,<image>[,...][:<width>]" opens the listed
+ * images as a stripe set (see block_disk_open_stripe()), with a stripe width
+ * of @width blocks or %BLOCK_STRIPE_WIDTH by default.
+ *
+ * Return: NULL if @diskname is invalid, if the virtual disk file cannot be
+ * opened, or if it does not support direct I/O when requested. The disk handle
+ * otherwise.
+ */
+disk_t *block_disk_open_flags(const char *diskname, int flags);
+
+/**
+ * block_disk_open_stripe - Open several virtual disk files as one disk
+ * @disknames: Names of the virtual disk files
+ * @count: Number of entries in @disknames
+ * @width: Stripe width, in blocks
+ * @flags: Bitwise OR of %BLOCK_DISK_* options
+ *
+ * Open a stripe set (RAID-0) made of @count images, which appears as a single
+ * disk. Blocks are laid out round-robin over the images by units of @width
+ * consecutive blocks: block b lives in image (b / @width) % @count. Only the
+ * whole stripe units of the smallest image are used, so the disk contains
+ * @count times that many blocks. Each image gets a worker thread, so that
+ * multi-block transfers (see block_read_many_ctx()) proceed on all the images
+ * in parallel. A single image is opened as a plain disk.
+ *
+ * Return: NULL if the stripe set is invalid, if one of the virtual disk files
+ * cannot be opened, or if an image is smaller than a stripe unit. The disk
+ * handle otherwise.
+ */
+disk_t *block_disk_open_stripe(const char **disknames, int count,
+			       size_t width, int flags);
+
+/**
+ * block_disk_set_block_size_ctx - Set the block size of a disk instance
+ * @disk: Disk handle
+ * @size: Block size in bytes, a power of two between %BLOCK_SIZE_MIN and
+ * %BLOCK_SIZE_MAX
+ *
+ * Disks are opened with blocks of %BLOCK_SIZE bytes. Once the actual block size
+ * of the images is known (e.g. from a superblock, read with the smallest block
+ * size), it is set with this function, before any other block is transferred.
+ * Block indices, counts and stripe widths are then expressed in blocks of @size
+ * bytes, and buffers hold blocks of @size bytes.
+ *
+ * Return: -1 if @disk or @size is invalid, or if an image is not made of whole
+ * blocks of @size bytes (or of whole stripe units, for stripe sets). 0
+ * otherwise.
+ */
+int block_disk_set_block_size_ctx(disk_t *disk, size_t size);
+
+/**
+ * block_disk_block_size_ctx - Get the block size of a disk instance
+ * @disk: Disk handle
+ *
+ * Return: -1 if @disk is invalid, otherwise the size of the blocks of @disk in
+ * bytes.
+ */
+int block_disk_block_size_ctx(disk_t *disk);
+
+/**
+ * block_disk_create - Create a virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @count: Number of blocks of the disk
+ * @block_size: Size of the blocks in bytes
+ * @flags: Bitwise OR of %BLOCK_DISK_* options
+ *
+ * Create virtual disk file @diskname, or truncate it if it exists, with @count
+ * blocks of @block_size bytes that all read as zeros. The file is sparse:
+ * creating it takes the same time whatever its size, and the host storage of a
+ * block is only allocated once the block is written. With %BLOCK_DISK_PREALLOC,
+ * the storage of all the blocks is allocated at once instead (fallocate()),
+ * still without writing it.
+ *
+ * Return: -1 if @diskname is invalid (stripe sets cannot be created), if
+ * @block_size is not a power of two between %BLOCK_SIZE_MIN and
+ * %BLOCK_SIZE_MAX, or if the virtual disk file cannot be created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t count, size_t block_size,
+		      int flags);
+
+/**
+ * block_disk_close_ctx - Close a disk instance
+ * @disk: Disk handle
+ *
+ * Return: -1 if @disk is invalid. 0 otherwise.
+ */
+int block_disk_close_ctx(disk_t *disk);
+
+/**
+ * block_disk_count_ctx - Get the block count of a disk instance
+ * @disk: Disk handle
+ *
+ * Return: -1 if @disk is invalid, otherwise the number of blocks of @disk.
+ */
+int block_disk_count_ctx(disk_t *disk);
+
+/**
+ * block_write_ctx - Write a block to a disk instance
+ * @disk: Disk handle
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Return: same as block_write().
+ */
+int block_write_ctx(disk_t *disk, size_t block, const void *buf);
+
+/**
+ * block_read_ctx - Read a block from a disk instance
+ * @disk: Disk handle
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: same as block_read().
+ */
+int block_read_ctx(disk_t *disk, size_t block, void *buf);
+
+/**
+ * block_write_many_ctx - Write consecutive blocks to a disk instance
+ * @disk: Disk handle
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer of @count blocks
+ *
+ * Write the blocks with as few system calls as possible. On a stripe set, the
+ * request is split between the images, which are written in parallel.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_many_ctx(disk_t *disk, size_t block, size_t count,
+			 const void *buf);
+
+/**
+ * block_read_many_ctx - Read consecutive blocks from a disk instance
+ * @disk: Disk handle
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer of @count blocks
+ *
+ * Counterpart of block_write_many_ctx().
+ *
+ * Return: -1 if the range is out of bounds or inaccessible, or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_many_ctx(disk_t *disk, size_t block, size_t count, void *buf);
+
+/**
+ * block_discard_ctx - Release consecutive blocks of a disk instance
+ * @disk: Disk handle
+ * @block: Index of the first block to release
+ * @count: Number of blocks to release
+ *
+ * Punch the blocks out of the image files, so that the host storage backing
+ * them is freed. The disk keeps its size, and released blocks read as zeros.
+ *
+ * Return: -1 if the range is out of bounds, or if the blocks cannot be
+ * released (e.g. the host file system does not support it). 0 otherwise.
+ */
+int block_discard_ctx(disk_t *disk, size_t block, size_t count);
+
+/**
+ * block_advise_ctx - Hint the host page cache about consecutive blocks
+ * @disk: Disk handle
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @advice: %BLOCK_ADVISE_WILLNEED or %BLOCK_ADVISE_DONTNEED
+ *
+ * Start reading the blocks into the host page cache in the background, or drop
+ * them from it. The host does not read ahead by itself on disk images, since
+ * consecutive blocks of an image need not belong together: reading ahead is up
+ * to the caller. Disks opened with %BLOCK_DISK_DIRECT bypass the page cache:
+ * hints are ignored.
+ *
+ * Return: -1 if the range is out of bounds or @advice is invalid. 0 otherwise.
+ */
+int block_advise_ctx(disk_t *disk, size_t block, size_t count, int advice);
+
+/**
+ * block_writeback_ctx - Write consecutive blocks back to storage
+ * @disk: Disk handle
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @wait: Whether to wait for the blocks to reach storage
+ *
+ * Start writing the blocks of the range that are dirty in the host page cache
+ * back to storage, and wait for it if @wait is set. Disks opened with
+ * %BLOCK_DISK_DIRECT have no dirty blocks.
+ *
+ * Return: -1 if the range is out of bounds, or if writing back fails. 0
+ * otherwise.
+ */
+int block_writeback_ctx(disk_t *disk, size_t block, size_t count, int wait);
+
+/**
+ * block_map_ctx - Get the memory of a block of a disk instance
+ * @disk: Disk handle
+ * @block: Index of the block
+ *
+ * Map the image holding block @block read-only in memory (once for all its
+ * blocks), and return the address of the block in it. The block's bytes can
+ * then be read in place, without any transfer: they reflect the writes to the
+ * block (including releases, which read as zeros). The mapping stays valid
+ * until the disk is closed.
+ *
+ * Return: NULL if @block is out of bounds, or if the image cannot be mapped.
+ * The address of the block otherwise.
+ */
+const void *block_map_ctx(disk_t *disk, size_t block);
+
+/**
+ * block_map_lookup_ctx - Get the block at an address returned by block_map_ctx()
+ * @disk: Disk handle
+ * @addr: Address in the memory of a block
+ *
+ * Return: -1 if @addr is not in the memory of a mapped block of @disk. The
+ * index of the block otherwise.
+ */
+long block_map_lookup_ctx(disk_t *disk, const void *addr);
+
+/**
+ * block_copy_to_fd_ctx - Copy bytes of a disk instance to a file descriptor
+ * @disk: Disk handle
+ * @block: Index of the block holding the first byte to copy
+ * @offset: Offset of the first byte to copy in @block
+ * @len: Number of bytes to copy (possibly past @block)
+ * @fd: Host file descriptor, written at its current position
+ *
+ * Copy the bytes without bringing them to user space when the host allows it:
+ * with copy_file_range() if @fd is a file, or sendfile() otherwise (e.g. to a
+ * pipe or a socket). Other transfers go through a bounce buffer.
+ *
+ * Return: -1 if the range is out of bounds, or if nothing could be copied.
+ * Otherwise the number of bytes copied, which is less than @len if the copy
+ * failed midway.
+ */
+long block_copy_to_fd_ctx(disk_t *disk, size_t block, size_t offset,
+			  size_t len, int fd);
+
+/**
+ * block_copy_from_fd_ctx - Copy a file descriptor into blocks of a disk
+ * instance
+ * @disk: Disk handle
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @fd: Host file descriptor, read from its current position
+ *
+ * Counterpart of block_copy_to_fd_ctx(), with copy_file_range() if @fd is a
+ * file. The copy stops early at the end of @fd; the rest of the last block
+ * written is then left as is (or zeroed, if it went through a bounce buffer).
+ *
+ * Return: -1 if the range is out of bounds, or if nothing could be copied.
+ * Otherwise the number of bytes copied.
+ */
+long block_copy_from_fd_ctx(disk_t *disk, size_t block, size_t count, int fd);
+
+/**
+ * struct block_stats - Block operation counters
+ * @reads: Number of blocks read since the last reset
+ * @writes: Number of blocks written since the last reset
+ */
+struct block_stats {
+	size_t reads;
+	size_t writes;
+};
+
+/**
+ * block_stats_get - Get block operation counters
+ * @stats: Structure to be filled with the current counters
+ */
+void block_stats_get(struct block_stats *stats);
+
+/**
+ * block_stats_reset - Reset block operation counters
+ */
+void block_stats_reset(void);
+
+/** Direction of a traced block operation */
+#define BLOCK_TRACE_READ	0
+#define BLOCK_TRACE_WRITE	1
+
+/**
+ * struct block_trace_rec - One traced block operation
+ * @ts_ns: Monotonic timestamp (in nanoseconds) at which the operation started
+ * @latency_ns: Time spent in the operation (in nanoseconds)
+ * @block: Index of the block that was accessed
+ * @dir: %BLOCK_TRACE_READ or %BLOCK_TRACE_WRITE
+ * @op: Name of the file system operation that issued the access (or NULL)
+ */
+struct block_trace_rec {
+	uint64_t ts_ns;
+	uint64_t latency_ns;
+	size_t block;
+	int dir;
+	const char *op;
+};
+
+/**
+ * block_trace_enable - Start recording block operations
+ * @nrecords: Capacity of the trace ring buffer
+ *
+ * Allocate a ring buffer able to hold (at least) @nrecords records and start
+ * recording every block_read() and block_write() into it. Once the ring is
+ * full, the oldest records are overwritten. Recording is lock-free and can be
+ * done concurrently from several threads.
+ *
+ * Return: -1 if @nrecords is 0, if tracing is already enabled, or if the ring
+ * cannot be allocated. 0 otherwise.
+ */
+int block_trace_enable(size_t nrecords);
+
+/**
+ * block_trace_disable - Stop recording block operations
+ *
+ * Stop recording and release the trace ring buffer, once the threads still
+ * recording into it or copying it are done.
+ *
+ * Return: -1 if tracing was not enabled. 0 otherwise.
+ */
+int block_trace_disable(void);
+
+/**
+ * block_trace_set_op - Tag the calling thread's block operations
+ * @op: Name of the current file system operation (must be a static string)
+ *
+ * Every block operation subsequently issued by the calling thread is recorded
+ * with @op as its calling operation.
+ */
+void block_trace_set_op(const char *op);
+
+/**
+ * block_trace_set_meta - Set the metadata boundary used in trace summaries
+ * @last_block: Index of the last metadata block (e.g. the root directory)
+ *
+ * Blocks 0..@last_block are accounted as metadata by block_trace_summary(),
+ * and the remaining blocks as data.
+ */
+void block_trace_set_meta(size_t last_block);
+
+/**
+ * block_trace_snapshot - Copy the recorded trace
+ * @recs: Array to be filled with records, oldest first
+ * @max: Number of entries in @recs
+ *
+ * Return: the number of records copied into @recs.
+ */
+size_t block_trace_snapshot(struct block_trace_rec *recs, size_t max);
+
+/**
+ * block_trace_dump - Print every recorded block operation
+ * @f: Stream to print to
+ *
+ * Return: -1 if tracing is not enabled. 0 otherwise.
+ */
+int block_trace_dump(FILE *f);
+
+/**
+ * block_trace_summary - Print a summary of the recorded block operations
+ * @f: Stream to print to
+ *
+ * Print the read/write counts and latencies, the seek distance distribution,
+ * the hottest blocks and the share of metadata versus data traffic.
+ *
+ * Return: -1 if tracing is not enabled. 0 otherwise.
+ */
+int block_trace_summary(FILE *f);
+
 #endif /* _DISK_H */
 
@@ -1,13 +1,29 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
+#include "replay.h"
 
 #define FAT_EOC 0xFFFF
+// Set in the FAT entry of a data block that stands for a hole: it is part of the chain of its
+// file, but it was never written and reads as zeros. Data block indices stay below FS_DATA_BLOCK_MAX,
+// so that a link with this bit set never reads as one of the markers below.
+#define FAT_HOLE 0x8000
+// Last block of a chain, standing for a hole
+#define FAT_HOLE_EOC (FAT_EOC & ~1)
+// Data block that the live file system no longer uses, but snapshots still do (or metadata of snapshots)
+#define FAT_SNAP (FAT_EOC - 2)
 struct SuperBlock{
 	uint8_t SIGNATURE[8]; // ECS150FS
 	uint16_t TOTAL_BLOCKS_COUNTS; // Total # of blocks
@@ -15,36 +31,216 @@ struct SuperBlock{
 	uint16_t DATA_BLOCK; // First data block index
 	uint16_t DATA_BLOCK_COUNT; // # of data blocks
 	uint8_t FAT_BLOCK_COUNT; // # of FAT blocks
-	uint8_t PADDING[4079];
-};
+	uint16_t PACK_BLOCK; // Data block packing the contents of small files (0 if none yet)
+	uint16_t DEDUP_BLOCK; // First data block of the table of shared blocks (0 if none yet)
+	uint16_t SNAP_BLOCK; // Data block holding the table of snapshots (0 if none yet)
+	uint8_t BLOCK_SHIFT; // log2 of the block size (0 for BLOCK_SIZE)
+	uint8_t PADDING[4072];
+} __attribute__((packed));
 
 struct file {
 	uint8_t FILENAME[FS_FILENAME_LEN];
 	uint32_t FILE_SIZE;
 	uint16_t FILE_FIRST_BLOCK; // Index of the first data block for the file
-	uint8_t FILE_PADDING[10];
+	uint16_t FILE_INLINE_OFFSET; // Offset of the contents in the pack block, for inline files
+	uint8_t FILE_FLAGS; // FILE_* flags
+	uint8_t FILE_PADDING[7];
 };
 
+// The file is stored as compressed extents
+#define FILE_COMPRESSED 0x1
+
 struct RootDirectory{
 	struct file all_files[FS_FILE_MAX_COUNT];
 };
 
+// Entry of the table of snapshots
+struct snapshot {
+	uint8_t NAME[FS_FILENAME_LEN]; // Empty if the entry is free
+	uint16_t SEQUENCE; // Order of creation
+	uint16_t ROOT_COPY; // Data block holding the root directory of the snapshot (0 while it's the live one)
+	uint16_t PACK_BLOCK; // Pack block of the snapshot
+	uint16_t DEDUP_BLOCK; // Table of shared blocks of the snapshot
+	uint16_t FAT_MAP; // Data block holding the data block of the copy of each FAT block (0 while it's the live one)
+	uint8_t PADDING[6];
+};
+
+_Static_assert(FS_SNAPSHOT_MAX * sizeof(struct snapshot) == BLOCK_SIZE, "the table of snapshots fills a block");
+_Static_assert(sizeof(struct RootDirectory) == BLOCK_SIZE, "the root directory fills a block");
+_Static_assert(((FS_DATA_BLOCK_MAX - 1) | FAT_HOLE) < FAT_SNAP, "a hole link never reads as a FAT marker");
+
+/* State shared by all the file descriptors open on the same file */
+struct open_file {
+	struct file* cur_file; // Directory entry of the file (name, size, first block)
+	int entry; // Index of the entry in the root directory
+	int refcount; // Number of descriptors (and in-flight reads) using this file
+	// Cached FAT chain: data block index of each block of the file
+	uint16_t *block_map;
+	size_t map_len;
+	size_t map_cap;
+	int map_loaded;
+	// Compressed files: contents of extent ext_cached (-1 if none), and room for its compressed form
+	char *ext_data;
+	char *ext_comp;
+	long ext_cached;
+	// Appends: contents of the partial last block of the file, block tail_block of the file (-1 if none)
+	char *tail;
+	long tail_block;
+	// Serializes data transfers on the file
+	pthread_mutex_t lock;
+};
+
 struct file_desc{
-	struct file* cur_file;
-	int offset;
+	struct open_file* file; // NULL if the descriptor is free
+	size_t offset;
+	int next_free; // Next free descriptor, when this one is free
+	int flags; // FS_O_* options
+	// Access pattern (FS_ADVISE_NORMAL, _SEQUENTIAL or _RANDOM), and whether data read is dropped from the cache
+	int advice;
+	int noreuse;
+	// Read-ahead: end of the previous read, first block not read ahead yet, and size of the last window
+	size_t ra_prev;
+	size_t ra_next;
+	size_t ra_window;
+};
+
+/* Number of buckets of the parts of spans lent by fs_read_map() */
+#define LENT_BUCKETS 256
+
+/* Number of file descriptors in each slab of the open file table */
+#define FD_SLAB_SIZE FS_OPEN_MAX_COUNT
+
+/* Mounted file system instance */
+struct fs {
+	disk_t *disk;
+	// Block size of the image (recorded in the superblock at format time), its log2, and the number of blocks
+	// of the root directory
+	size_t block_size;
+	unsigned int block_shift;
+	size_t root_blocks;
+	// Memory of the metadata, descriptors and I/O buffers, released at unmount
+	struct arena *arena;
+	uint16_t *FAT;
+	struct SuperBlock* super_block;
+	struct RootDirectory* root_directory;
+	// Open file table: slabs of FD_SLAB_SIZE descriptors, allocated on demand. The array of slabs comes from
+	// the arena, so that the previous ones stay valid for the lock-free lookups of read-only instances.
+	struct file_desc **fd_slabs;
+	int fd_slab_count;
+	int fd_slab_cap;
+	int fd_free; // First free descriptor, -1 if all slabs are in use
+	int current_open_amount;
+	// Open file objects, by root directory entry
+	struct open_file *open_files[FS_FILE_MAX_COUNT];
+	int flags; // FS_MOUNT_* options
+	// Contents of the pack block (NULL until a small file is written)
+	char *pack;
+	// Freed data blocks not released from the disk yet (one bit per data block)
+	uint8_t *discard_map;
+	size_t discard_pending;
+	// Shared blocks (NULL unless the file system has some, or is mounted with FS_MOUNT_DEDUP)
+	uint16_t *dedup_src; // Data block holding the contents of each data block, FAT_EOC if it holds its own
+	uint16_t *dedup_refs; // Number of data blocks sharing the contents of each data block
+	int dedup_dirty; // The table changed since it was last written
+	// Hash index of the blocks written in full (with FS_MOUNT_DEDUP only): chained buckets of data blocks
+	uint64_t *dedup_hash;
+	uint16_t *dedup_bucket;
+	uint16_t *dedup_next;
+	size_t dedup_mask;
+	// Snapshots (none if snap_table is NULL)
+	struct snapshot *snap_table;
+	uint16_t *snap_fat_maps[FS_SNAPSHOT_MAX]; // Contents of the FAT map of each entry
+	int snap_latest; // Entry of the latest snapshot, -1 if none
+	uint16_t snap_sequence; // Sequence of the next snapshot
+	int snap_dirty; // The table or FAT maps changed since they were last written
+	int snap_reserve; // Free data blocks kept for the copy-on-write of metadata
+	uint16_t *fat_frozen; // FAT of the latest snapshot: data blocks it uses are never written in place
+	struct RootDirectory *root_frozen; // Root directory of the latest snapshot
+	int fat_dirty; // Metadata blocks were allocated since the FAT was last written
+	// Read-only views of snapshots: the live instance (NULL if live), and the number of views of a live instance
+	fs_t *snapshot_of;
+	int views;
+	char *diskname;
+	// Spans lent by fs_read_map() (pins is NULL until the first one)
+	uint16_t *pins; // Number of borrowed spans in each data block
+	uint8_t *pin_freed; // Data blocks freed while borrowed, released with their last span (one bit per data block)
+	size_t borrowed; // Borrowed data blocks and lent copies not released yet
+	struct lent_span *lent[LENT_BUCKETS]; // What each borrowed block or lent copy is, by address of its span
+	// Background writeback (NULL unless mounted with FS_MOUNT_WRITEBACK)
+	struct flusher *flusher;
+	/* Serializes the operations on this instance */
+	pthread_mutex_t lock;
+};
+
+/*
+ * Compressed files are made of extents of EXTENT_BLOCKS blocks. An extent is either stored as is,
+ * or compressed: its first blocks then hold the length of the compressed stream (32 bits) followed
+ * by the stream, and its other blocks are holes. The block map of the file is the index of its
+ * extents.
+ */
+#define EXTENT_BLOCKS 8
+#define EXTENT_SIZE(fs) (EXTENT_BLOCKS * (fs)->block_size)
+
+/* Block holding byte @off of a file, and offset of the byte in that block */
+#define BLOCK_OF(fs, off) ((off) >> (fs)->block_shift)
+#define BLOCK_OFF(fs, off) ((off) & ((fs)->block_size - 1))
+
+/* Largest file stored inline, in the pack block */
+#define INLINE_MAX 512
+
+/* Bytes copied from or to host files at once, between which other operations on the instance go on */
+#define COPY_CHUNK (1 << 20)
+
+/* Read-ahead windows (in bytes, whatever the block size): the first one, and the largest ones by default and for
+ * sequential access */
+#define READ_AHEAD_MIN (64 << 10)
+#define READ_AHEAD_MAX (1 << 20)
+#define READ_AHEAD_SEQ_MAX (4 << 20)
+
+/* Part of a span lent by fs_read_map(), within one block: a borrowed data block, or a lent copy */
+struct lent_span {
+	const char *addr; // Address of the part
+	size_t len;
+	int data_index; // Data block borrowed, -1 for a copy
+	char *copy; // Base of the copy (NULL for a data block)
+	struct lent_span *next; // Next part in the same bucket
+};
+
+/* Flusher of an instance mounted with FS_MOUNT_WRITEBACK, protected by the instance lock */
+struct flusher {
+	pthread_t thread;
+	pthread_cond_t wake; // Wakes the flusher up before the end of its period
+	pthread_cond_t done; // Broadcast when a batch has been written back
+	struct fs_writeback params;
+	int stop;
+	int meta_dirty; // The root directory, shared block table or FAT changed since they were last written
+	int pack_dirty; // The pack block changed since it was last written
+	uint8_t *dirty; // Data blocks written since the last batch (one bit per data block)
+	uint8_t *batch; // Data blocks of the batch being written back
+	size_t ndirty;
+	size_t inflight;
+	uint64_t dirty_since; // Time of the oldest change not written back (in ms, 0 if none)
 };
 
-uint16_t *FAT;
-struct SuperBlock* super_block;
-struct RootDirectory* root_directory;
-struct file_desc *fd_table[FS_OPEN_MAX_COUNT];
-int disk_opened;
-int current_open_amount;
-
-int memFree(void){
-	free(FAT);
-	free(super_block);
-	free(root_directory);
+/* Default thresholds of the flusher */
+#define WB_DIRTY_BACKGROUND 10
+#define WB_DIRTY_LIMIT 20
+#define WB_EXPIRE_MS 100
+#define WB_INTERVAL_MS 20
+
+/* Number of freed data blocks after which deferred releases are carried out */
+#define FS_DISCARD_BATCH 1024
+
+/* Instance used by the functions without a file system handle (none by default) */
+static fs_t *default_fs;
+
+/* Contents lent for the holes of files */
+static const char zero_block[BLOCK_SIZE_MAX] __attribute__((aligned(BLOCK_SIZE_MAX)));
+
+int memFree(fs_t *fs){
+	arena_destroy(fs->arena);
+	pthread_mutex_destroy(&fs->lock);
+	free(fs);
 	return 0;
 }
 
@@ -57,478 +253,3615 @@ int signature_cmp(uint8_t* sig, char* target, int len){
 	return 0;
 }
 
-int index_containing_offset (struct file_desc* cur_file_desc, int first_block) {
-	int start_block_num = (cur_file_desc->offset / BLOCK_SIZE);
-	uint16_t target_index = start_block_num + first_block + super_block->DATA_BLOCK;
-	return target_index;
-}
 
 /**
  *  get_new_block_index() returns the first available data block index. 
  * 	If no data block available, returns -1
  */
-int get_new_block_index() {
+int get_new_block_index(fs_t *fs) {
 	int new_block_index = -1;
-	for (int i = 0; i < super_block->DATA_BLOCK_COUNT; i++) {
-		if (FAT[i] == 0) { // if data block is free (rep as 0 in prompt)
+	for (int i = 0; i < fs->super_block->DATA_BLOCK_COUNT; i++) {
+		if (fs->FAT[i] == 0) { // if data block is free (rep as 0 in prompt)
 			new_block_index = i;
 			break;
 		}
 	}
+	// The last free blocks are kept for the copy-on-write of the metadata of snapshots
+	if (new_block_index != -1 && fs->snap_reserve > 0) {
+		int spare = 0;
+		for (int i = new_block_index; i < fs->super_block->DATA_BLOCK_COUNT && spare <= fs->snap_reserve; i++) {
+			if (fs->FAT[i] == 0) {
+				spare++;
+			}
+		}
+		if (spare <= fs->snap_reserve) {
+			return -1;
+		}
+	}
+	// A reused block must not be released later on
+	if (new_block_index != -1 && (fs->discard_map[new_block_index / 8] & (1 << (new_block_index % 8)))) {
+		fs->discard_map[new_block_index / 8] &= ~(1 << (new_block_index % 8));
+		fs->discard_pending--;
+	}
 	return new_block_index;
 }
 
-int fs_mount(const char *diskname)
-{
-	int disk_opened = block_disk_open(diskname);
-	if(disk_opened == -1){
-		return -1;
+/**
+ *  get_block_after() returns a free data block to follow data block @prev in a file (-1 for its first block):
+ *	the next data block if it is free, so that the file stays contiguous without scanning the FAT, or the
+ *	first free one. Returns -1 if there is none.
+ */
+int get_block_after(fs_t *fs, int prev) {
+	int index = prev + 1;
+	if (prev == -1 || index >= fs->super_block->DATA_BLOCK_COUNT || fs->FAT[index] != 0 || fs->snap_reserve > 0) {
+		return get_new_block_index(fs);
 	}
-	// printf("Ok - 1\n");
-	super_block = malloc(sizeof(struct SuperBlock));
-	block_read(0, super_block);
-
-	if(strncmp((char*)super_block->SIGNATURE, "ECS150FS", 8) != 0){
-		return -1;
+	if (fs->discard_map[index / 8] & (1 << (index % 8))) {
+		fs->discard_map[index / 8] &= ~(1 << (index % 8));
+		fs->discard_pending--;
 	}
+	return index;
+}
 
-	if(super_block->TOTAL_BLOCKS_COUNTS != block_disk_count()){
-		return -1;
+/**
+ *  discard_mark() records data block @index as freed, to be released from the disk by discard_flush().
+ */
+void discard_mark(fs_t *fs, uint16_t index) {
+	if (!(fs->discard_map[index / 8] & (1 << (index % 8)))) {
+		fs->discard_map[index / 8] |= 1 << (index % 8);
+		fs->discard_pending++;
 	}
-	
-	// Initialize Root_directory
-	root_directory = malloc(BLOCK_SIZE);
-	block_read(super_block->ROOT_DIRECTORY_BLOCK, root_directory);
+}
 
-	FAT = malloc(super_block->FAT_BLOCK_COUNT * BLOCK_SIZE); // assign memory space for BLOCK_SIZE of table
-	for(int i = 0; i < super_block->FAT_BLOCK_COUNT; i++){
-		// each FAT is uint16_t, which means its length is 2 bytes (8 bits = 1 byte)
-		// BLOCK_SIZE = 4096, which means a block can take 4096 bytes, but we only store 2 bytes for FAT in a block
-		// To get into next FAT information, we work like an array, but the difference is
-		// we have to go to next FAT in block to take the information of the FAT
-		block_read(i + 1, FAT + (i * BLOCK_SIZE/2)); 
+/**
+ *  discard_flush() releases the freed data blocks between @first and @last (included) from the disk,
+ *  one range of consecutive blocks at a time. Returns -1 if the disk cannot release blocks.
+ */
+int discard_flush(fs_t *fs, int first, int last) {
+	int ret = 0;
+	int start = -1;
+	for (int i = first; i <= last + 1; i++) {
+		if (i <= last && (fs->discard_map[i / 8] & (1 << (i % 8)))) {
+			fs->discard_map[i / 8] &= ~(1 << (i % 8));
+			fs->discard_pending--;
+			if (start == -1) {
+				start = i;
+			}
+		} else if (start != -1) {
+			if (block_discard_ctx(fs->disk, fs->super_block->DATA_BLOCK + start, i - start)) {
+				ret = -1;
+			}
+			start = -1;
+		}
 	}
+	return ret;
+}
 
-	return 0;
+/*
+ * A snapshot freezes the FAT, root directory, pack block and table of shared blocks of the moment.
+ * The data blocks used by the latest snapshot (hence by all the snapshots, if they are still used by
+ * the live file system) are never written or released in place: the live file system goes on with
+ * new blocks, and the old ones are kept as FAT_SNAP. The FAT and root directory blocks, which have
+ * fixed locations, are copied for the snapshots when they first change.
+ */
+
+/**
+ *  block_frozen() tells whether data block @index is used by the latest snapshot.
+ */
+int block_frozen(fs_t *fs, uint16_t index) {
+	return fs->snap_latest != -1 && fs->fat_frozen[index] != 0 && fs->fat_frozen[index] != FAT_SNAP;
 }
 
-int fs_umount(void)
-{
-	// if there are still open file descriptors
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (fd_table[i] != NULL) { // If not NULL, means a file is open somewhere. Cannot unmount successfully.
-			return -1;
-		}
-	}
+/**
+ *  block_pinned() tells whether data block @index is borrowed from fs_read_map(). Like the blocks of
+ *	the latest snapshot, it is never written or released in place.
+ */
+int block_pinned(fs_t *fs, uint16_t index) {
+	return fs->pins != NULL && fs->pins[index] != 0;
+}
 
-	int closeFlag = block_disk_close();
-	if(closeFlag == -1){
-		return -1;
+/**
+ *  block_keep() keeps data block @index, that the live file system no longer uses, for the snapshots
+ *	or borrowers still using it. A block only kept for borrowers is freed with its last span.
+ */
+void block_keep(fs_t *fs, uint16_t index) {
+	if (!block_frozen(fs, index)) {
+		fs->pin_freed[index / 8] |= 1 << (index % 8);
 	}
-	int freeFlag = memFree();
-	if(freeFlag != 0){
-		return -1;
+	fs->FAT[index] = FAT_SNAP;
+}
+
+/**
+ *  snap_alloc() allocates a data block for the metadata of snapshots, from the reserved blocks.
+ */
+int snap_alloc(fs_t *fs) {
+	int reserve = fs->snap_reserve;
+	fs->snap_reserve = 0;
+	int index = get_new_block_index(fs);
+	fs->snap_reserve = reserve;
+	if (index != -1) {
+		fs->FAT[index] = FAT_SNAP;
+		fs->fat_dirty = 1;
 	}
-	return 0;
+	return index;
 }
 
-int fs_info(void)
-{
-	if(super_block == NULL || root_directory == NULL || FAT == NULL){ //no underlying virtual disk was opened
-		return -1;
+/**
+ *  snap_reserve_update() counts the data blocks that copy-on-write of metadata may still need: the
+ *	FAT and root directory blocks not copied yet for the latest snapshot, and the metadata data
+ *	blocks it uses.
+ */
+void snap_reserve_update(fs_t *fs) {
+	fs->snap_reserve = 0;
+	if (fs->snap_latest == -1) {
+		return;
 	}
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", super_block->TOTAL_BLOCKS_COUNTS);
-	printf("fat_blk_count=%d\n",super_block->FAT_BLOCK_COUNT);
-	printf("rdir_blk=%d\n",super_block->ROOT_DIRECTORY_BLOCK);
-	printf("data_blk=%d\n",super_block->DATA_BLOCK);
-	printf("data_blk_count=%d\n",super_block->DATA_BLOCK_COUNT);
-	int fatFreeCounter = 0;
-	for(int i = 0; i < super_block->DATA_BLOCK_COUNT; i++){
-		if(FAT[i] == 0){
-			fatFreeCounter++;
-		}
+	struct snapshot *latest = &fs->snap_table[fs->snap_latest];
+	fs->snap_reserve += latest->ROOT_COPY == 0;
+	for (int i = 0; i < fs->super_block->FAT_BLOCK_COUNT; i++) {
+		fs->snap_reserve += fs->snap_fat_maps[fs->snap_latest][i] == 0;
 	}
-	int root_directory_free_size = 0;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(root_directory->all_files[i].FILENAME[0] == '\0'){
-			root_directory_free_size++;
+	fs->snap_reserve += fs->super_block->PACK_BLOCK != 0 && block_frozen(fs, fs->super_block->PACK_BLOCK);
+	if (fs->super_block->DEDUP_BLOCK != 0) {
+		for (uint16_t i = fs->super_block->DEDUP_BLOCK; i != FAT_EOC; i = fs->FAT[i]) {
+			fs->snap_reserve += block_frozen(fs, i);
 		}
 	}
-	printf("fat_free_ratio=%d/%d\n",fatFreeCounter,super_block->DATA_BLOCK_COUNT);
-	printf("rdir_free_ratio=%d/%d\n",root_directory_free_size,FS_FILE_MAX_COUNT);
-	return 0;
 }
 
-int fs_create(const char *filename)
-{
-	if(filename == NULL){
-		return -1;
-	}
-	int file_length = strlen(filename);
-	
-	if(file_length >= FS_FILENAME_LEN){
-		return -1;
+/**
+ *  snap_sync() writes the table of snapshots and their FAT maps, if they changed.
+ */
+void snap_sync(fs_t *fs) {
+	if (!fs->snap_dirty || fs->super_block->SNAP_BLOCK == 0) {
+		return;
 	}
-	// If file already exists
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp(filename, (char*)root_directory->all_files[i].FILENAME) == 0) { 
-			return -1;
+	for (size_t e = 0; e < FS_SNAPSHOT_MAX; e++) {
+		if (fs->snap_table[e].NAME[0] != '\0') {
+			block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + fs->snap_table[e].FAT_MAP, fs->snap_fat_maps[e]);
 		}
 	}
+	block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + fs->super_block->SNAP_BLOCK, fs->snap_table);
+	fs->snap_dirty = 0;
+}
 
-	// If the root directory already contains FS_FILE_MAX_COUNT files
-	int root_directory_length = 0;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(root_directory->all_files[i].FILENAME[0] != '\0'){
-			root_directory_length += 1;;
-		}
-	}
-	
-	if (root_directory_length >= FS_FILE_MAX_COUNT) {
-		return -1;
-	}
-	
-	int new_file_index;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root_directory->all_files[i].FILENAME[0] == '\0') { // first available in rootdirectory
-			new_file_index = i;
-			break;
+/**
+ *  root_sync() writes the root directory, after copying its previous version for the snapshots that
+ *	still share it with the live file system.
+ */
+void root_sync(fs_t *fs) {
+	if (fs->snap_latest != -1 && fs->snap_table[fs->snap_latest].ROOT_COPY == 0 &&
+	    memcmp(fs->root_directory, fs->root_frozen, sizeof(struct RootDirectory)) != 0) {
+		int copy = snap_alloc(fs);
+		if (copy != -1) {
+			block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + copy, fs->root_frozen);
+			for (size_t e = 0; e < FS_SNAPSHOT_MAX; e++) {
+				if (fs->snap_table[e].NAME[0] != '\0' && fs->snap_table[e].ROOT_COPY == 0) {
+					fs->snap_table[e].ROOT_COPY = copy;
+				}
+			}
+			fs->snap_dirty = 1;
+			snap_reserve_update(fs);
 		}
 	}
-	
-	memcpy(root_directory->all_files[new_file_index].FILENAME, filename, file_length+1);
-	root_directory->all_files[new_file_index].FILE_SIZE = 0;
-	root_directory->all_files[new_file_index].FILE_FIRST_BLOCK = FAT_EOC;
-	block_write(super_block->ROOT_DIRECTORY_BLOCK, root_directory);
-	return 0;
+	block_write_many_ctx(fs->disk, fs->super_block->ROOT_DIRECTORY_BLOCK, fs->root_blocks, fs->root_directory);
 }
 
-int fs_delete(const char *filename)
-{
-	int errFlag = -1;
-	if (filename == NULL) {
-		printf("1st if\n");
-		errFlag = -1;
+/**
+ *  fat_sync() writes the FAT, after copying the previous version of its blocks for the snapshots
+ *	that still share them with the live file system. Then writes the snapshots that changed.
+ */
+void fat_sync(fs_t *fs) {
+	// Each copy changes the FAT in turn: go on until no shared block differs anymore
+	int copied = fs->snap_latest != -1;
+	while (copied) {
+		copied = 0;
+		for (int i = 0; i < fs->super_block->FAT_BLOCK_COUNT; i++) {
+			uint16_t *frozen = fs->fat_frozen + i * (fs->block_size/2);
+			if (fs->snap_fat_maps[fs->snap_latest][i] != 0 ||
+			    memcmp(fs->FAT + i * (fs->block_size/2), frozen, fs->block_size) == 0) {
+				continue;
+			}
+			int copy = snap_alloc(fs);
+			if (copy == -1) {
+				continue;
+			}
+			block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + copy, frozen);
+			for (size_t e = 0; e < FS_SNAPSHOT_MAX; e++) {
+				if (fs->snap_table[e].NAME[0] != '\0' && fs->snap_fat_maps[e][i] == 0) {
+					fs->snap_fat_maps[e][i] = copy;
+				}
+			}
+			fs->snap_dirty = 1;
+			copied = 1;
+		}
+		snap_reserve_update(fs);
+	}
+	for(int i = 0; i < fs->super_block->FAT_BLOCK_COUNT; i++){
+		block_write_ctx(fs->disk, i+1, fs->FAT + i * (fs->block_size/2));
 	}
+	fs->fat_dirty = 0;
+	snap_sync(fs);
+}
 
-	// If file not exist
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp(filename, (char*)root_directory->all_files[i].FILENAME) == 0) {
-			errFlag = 0;
-		}
+/**
+ *  fat_sync_range() writes the FAT blocks holding entries @first to @last, when no other entry changed
+ *	since the FAT was last written, and no snapshot shares it. Otherwise writes the whole FAT.
+ */
+void fat_sync_range(fs_t *fs, uint16_t first, uint16_t last) {
+	if (fs->fat_dirty || fs->snap_latest != -1) {
+		fat_sync(fs);
+		return;
 	}
-	if(errFlag == -1){
-		printf("error flag\n");
-		return -1;
+	for (int i = first / (fs->block_size/2); i <= last / (fs->block_size/2); i++) {
+		block_write_ctx(fs->disk, i+1, fs->FAT + i * (fs->block_size/2));
 	}
+}
 
-	int file_index;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)root_directory->all_files[i].FILENAME, filename) == 0) {
-			file_index = i;
-			break;
+/**
+ *  pack_sync() writes the pack block, moving it to a new data block if the latest snapshot uses it.
+ */
+void pack_sync(fs_t *fs) {
+	uint16_t index = fs->super_block->PACK_BLOCK;
+	if (block_frozen(fs, index)) {
+		int new_index = snap_alloc(fs);
+		if (new_index != -1) {
+			fs->FAT[new_index] = FAT_EOC;
+			fs->FAT[index] = FAT_SNAP;
+			fs->super_block->PACK_BLOCK = new_index;
+			block_write_ctx(fs->disk, 0, fs->super_block);
+			snap_reserve_update(fs);
 		}
 	}
-	uint16_t fat_index = root_directory->all_files[file_index].FILE_FIRST_BLOCK;
-	uint16_t temp_fat_index;
-	if(fat_index != FAT_EOC){
-		while (FAT[fat_index] != FAT_EOC) {
-			temp_fat_index = FAT[fat_index];
-			FAT[fat_index] = 0;
-			fat_index = temp_fat_index;
-		}
+	block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + fs->super_block->PACK_BLOCK, fs->pack);
+}
+
+/**
+ *  get_desc() returns the descriptor @fd, or NULL if @fd is out of bounds or not currently open.
+ */
+struct file_desc *get_desc(fs_t *fs, int fd) {
+	if (fd < 0 || fd >= __atomic_load_n(&fs->fd_slab_count, __ATOMIC_ACQUIRE) * FD_SLAB_SIZE) {
+		return NULL;
 	}
-	root_directory->all_files[file_index].FILENAME[0] = '\0';
-	root_directory->all_files[file_index].FILE_SIZE = 0;
-	block_write(super_block->ROOT_DIRECTORY_BLOCK, root_directory);
-	for(int i = 1; i <= super_block->FAT_BLOCK_COUNT; i++){
-		block_write(i + 1, FAT + ((i-1) * (BLOCK_SIZE/2)));
+	struct file_desc *desc = &__atomic_load_n(&fs->fd_slabs, __ATOMIC_ACQUIRE)[fd / FD_SLAB_SIZE][fd % FD_SLAB_SIZE];
+	if (desc->file == NULL) {
+		return NULL;
 	}
-	return 0;
+	return desc;
 }
 
-int fs_ls(void)
-{
-	if(disk_opened == -1){ //no underlying virtual disk was opened
-		return -1;
+/**
+ *  alloc_desc() pops a free descriptor from the free list, growing the table by one slab
+ *	when it is empty. Returns -1 if no memory is available.
+ */
+int alloc_desc(fs_t *fs) {
+	if (fs->fd_free == -1) {
+		if (fs->fd_slab_count == fs->fd_slab_cap) {
+			int cap = fs->fd_slab_cap ? 2 * fs->fd_slab_cap : 8;
+			struct file_desc **slabs = arena_alloc(fs->arena, cap * sizeof(*slabs));
+			if (slabs == NULL) {
+				return -1;
+			}
+			memcpy(slabs, fs->fd_slabs, fs->fd_slab_count * sizeof(*slabs));
+			__atomic_store_n(&fs->fd_slabs, slabs, __ATOMIC_RELEASE);
+			fs->fd_slab_cap = cap;
+		}
+		struct file_desc *slab = arena_alloc(fs->arena, FD_SLAB_SIZE * sizeof(struct file_desc));
+		if (slab == NULL) {
+			return -1;
+		}
+		// Chain the new descriptors in the free list, lowest first
+		int first = fs->fd_slab_count * FD_SLAB_SIZE;
+		for (int i = 0; i < FD_SLAB_SIZE; i++) {
+			slab[i].next_free = (i == FD_SLAB_SIZE - 1) ? -1 : first + i + 1;
+		}
+		fs->fd_slabs[fs->fd_slab_count] = slab;
+		__atomic_store_n(&fs->fd_slab_count, fs->fd_slab_count + 1, __ATOMIC_RELEASE);
+		fs->fd_free = first;
 	}
+	int fd = fs->fd_free;
+	fs->fd_free = fs->fd_slabs[fd / FD_SLAB_SIZE][fd % FD_SLAB_SIZE].next_free;
+	return fd;
+}
 
-	printf("FS Ls:\n");
+void free_desc(fs_t *fs, int fd) {
+	struct file_desc *desc = &fs->fd_slabs[fd / FD_SLAB_SIZE][fd % FD_SLAB_SIZE];
+	desc->file = NULL;
+	desc->next_free = fs->fd_free;
+	fs->fd_free = fd;
+}
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root_directory->all_files[i].FILENAME[0] != '\0') { // If filename is not empty, then print contents
-			printf("file: %s, size: %d, data_blk: %d\n", root_directory->all_files[i].FILENAME, 
-			root_directory->all_files[i].FILE_SIZE ,root_directory->all_files[i].FILE_FIRST_BLOCK);
+/**
+ *  get_open_file() returns the open file object of root directory entry @entry, creating it
+ *	if the file isn't open yet. Returns NULL if no memory is available.
+ */
+struct open_file *get_open_file(fs_t *fs, int entry) {
+	struct open_file *file = fs->open_files[entry];
+	if (file == NULL) {
+		file = calloc(1, sizeof(struct open_file));
+		if (file == NULL) {
+			return NULL;
 		}
+		file->cur_file = &fs->root_directory->all_files[entry];
+		file->entry = entry;
+		file->tail_block = -1;
+		pthread_mutex_init(&file->lock, NULL);
+		fs->open_files[entry] = file;
 	}
-	return 0;
+	file->refcount++;
+	return file;
 }
 
+void put_open_file(fs_t *fs, struct open_file *file) {
+	if (--file->refcount > 0) {
+		return;
+	}
+	fs->open_files[file->entry] = NULL;
+	pthread_mutex_destroy(&file->lock);
+	free(file->block_map);
+	free(file->ext_data);
+	free(file->ext_comp);
+	free(file->tail);
+	free(file);
+}
 
-int fs_open(const char *filename)
-{
-	int returnFlag = -1;
-	// filename invalid
-	int file_length = strlen(filename);
-	if (filename[file_length] != '\0' || file_length > FS_FILENAME_LEN) {
-		returnFlag = -1;
+/**
+ *  file_is_inline() tells whether the contents of @entry are stored in the pack block: non-empty
+ *	files without any data block.
+ */
+int file_is_inline(struct file *entry) {
+	return entry->FILE_SIZE > 0 && entry->FILE_FIRST_BLOCK == FAT_EOC;
+}
+
+/**
+ *  pack_reserve() makes room for @size bytes of inline contents for @entry in the pack block,
+ *	keeping its current contents, and returns their offset. The pack block is allocated on
+ *	first use. Returns -1 if the pack block cannot hold them.
+ */
+int pack_reserve(fs_t *fs, struct file *entry, size_t size) {
+	if (fs->pack == NULL) {
+		int index = get_new_block_index(fs);
+		if (index == -1) {
+			return -1;
+		}
+		fs->pack = arena_alloc(fs->arena, fs->block_size);
+		if (fs->pack == NULL) {
+			return -1;
+		}
+		fs->FAT[index] = FAT_EOC;
+		fs->super_block->PACK_BLOCK = index;
+		block_write_ctx(fs->disk, 0, fs->super_block);
+		fat_sync(fs);
 	}
-	// no filename to open
+
+	// Keep the contents in place, or put new contents after the others, if possible
+	size_t used = 0, end = 0;
 	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(strcmp((char*)root_directory->all_files[i].FILENAME, filename) == 0){
-			returnFlag = 0;
-			break;
+		struct file *other = &fs->root_directory->all_files[i];
+		if (other != entry && file_is_inline(other)) {
+			used += other->FILE_SIZE;
+			if (other->FILE_INLINE_OFFSET + other->FILE_SIZE > end) {
+				end = other->FILE_INLINE_OFFSET + other->FILE_SIZE;
+			}
 		}
 	}
-	
-	// max count
-	if(current_open_amount == FS_OPEN_MAX_COUNT){
-		returnFlag = -1;
-	}
-	if(returnFlag == -1){
+	if (used + size > fs->block_size) {
 		return -1;
 	}
-	// =========
-	struct file_desc* temp_file_desc = malloc(sizeof(struct file_desc));
-	int fd_table_index;
-	//fd_table
-	//find file from root_directory
-	//parse file from root to fd_table[i]
-	//set file offset in fd_table to 0
-	//currentopenamount++
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(strcmp((char*)root_directory->all_files[i].FILENAME, filename) == 0){
-			temp_file_desc->cur_file = &(root_directory->all_files[i]);
-			temp_file_desc->offset = 0;
-			current_open_amount++;
-			break;
+	size_t offset = file_is_inline(entry) ? entry->FILE_INLINE_OFFSET : end;
+	int fits = offset + size <= fs->block_size;
+	for (int i = 0; fits && i < FS_FILE_MAX_COUNT; i++) {
+		struct file *other = &fs->root_directory->all_files[i];
+		if (other != entry && file_is_inline(other) &&
+		    other->FILE_INLINE_OFFSET < offset + size && offset < other->FILE_INLINE_OFFSET + other->FILE_SIZE) {
+			fits = 0;
 		}
 	}
-	
-	for(int j = 0; j < FS_OPEN_MAX_COUNT; j++){
-		if(fd_table[j] == NULL){ //first empty position
-			fd_table[j] =temp_file_desc;;
-			fd_table_index = j;
-			break;
-		}
+	if (fits) {
+		return offset;
 	}
 
-	return fd_table_index;
+	// Compact the pack block: the other contents first, then the ones of @entry
+	char *packed = arena_buf_get(fs->arena);
+	size_t pos = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		struct file *other = &fs->root_directory->all_files[i];
+		if (other != entry && file_is_inline(other)) {
+			memcpy(packed + pos, fs->pack + other->FILE_INLINE_OFFSET, other->FILE_SIZE);
+			other->FILE_INLINE_OFFSET = pos;
+			pos += other->FILE_SIZE;
+		}
+	}
+	if (file_is_inline(entry)) {
+		memcpy(packed + pos, fs->pack + entry->FILE_INLINE_OFFSET, entry->FILE_SIZE);
+	}
+	memcpy(fs->pack, packed, fs->block_size);
+	arena_buf_put(fs->arena, packed);
+	return pos;
 }
 
-int fs_close(int fd)
-{
-	// fd invalid out of bounds
-	if(fd >= FS_OPEN_MAX_COUNT){
-		return -1;
-	}
-	// not currently open
-	if(fd_table[fd] == NULL){
-		return -1;
+/**
+ *  fat_next() returns the data block following data block @index in its chain, or FAT_EOC.
+ */
+uint16_t fat_next(fs_t *fs, uint16_t index) {
+	uint16_t entry = fs->FAT[index];
+	if (entry == FAT_EOC || entry == FAT_HOLE_EOC) {
+		return FAT_EOC;
 	}
-	// file close
-	// set fd_table[fd] to NULL
-	fd_table[fd] = NULL;
-	// open amount--
-	current_open_amount--;
-	return 0;
+	return entry & ~FAT_HOLE;
 }
 
-int fs_stat(int fd)
-{
-	// fd invalid out of bounds
+/**
+ *  fat_is_hole() tells whether data block @index stands for a hole.
+ */
+int fat_is_hole(fs_t *fs, uint16_t index) {
+	return fs->FAT[index] != FAT_EOC && (fs->FAT[index] & FAT_HOLE);
+}
 
-	if(fd >= FS_OPEN_MAX_COUNT){
-		return -1;
+/**
+ *  fat_set() links data block @index to @next (a data block or FAT_EOC), as a hole if @hole is set.
+ */
+void fat_set(fs_t *fs, uint16_t index, uint16_t next, int hole) {
+	if (next == FAT_EOC) {
+		fs->FAT[index] = hole ? FAT_HOLE_EOC : FAT_EOC;
+	} else {
+		// Only blocks past FS_DATA_BLOCK_MAX could collide (e.g. a hole before block 0x7FFD reading as FAT_SNAP)
+		assert(next < fs->super_block->DATA_BLOCK_COUNT && (next | FAT_HOLE) < FAT_SNAP);
+		fs->FAT[index] = hole ? (next | FAT_HOLE) : next;
 	}
-	// not currently open
-	if(fd_table[fd] == NULL){
-		return -1;
+}
+
+/**
+ *  map_append() adds data block @data_index at the end of the block map of @file.
+ */
+int map_append(struct open_file *file, uint16_t data_index) {
+	if (file->map_len == file->map_cap) {
+		size_t cap = file->map_cap ? file->map_cap * 2 : 16;
+		uint16_t *map = realloc(file->block_map, cap * sizeof(uint16_t));
+		if (map == NULL) {
+			return -1;
+		}
+		file->block_map = map;
+		file->map_cap = cap;
 	}
-	uint32_t cur_file_size;
-	cur_file_size = fd_table[fd]->cur_file->FILE_SIZE;
-	return cur_file_size;
+	file->block_map[file->map_len++] = data_index;
+	return 0;
 }
 
-int fs_lseek(int fd, size_t offset)
+/*
+ * Data blocks with the same contents can be shared: a block then stays in the chain of its file, but
+ * its contents are read from the source block recorded in the table of shared blocks, and its own
+ * storage is released. Writing into, or freeing, a block of a group stops sharing it first.
+ */
+
+/**
+ *  hash_words() returns the hash of @n words of @words.
+ */
+static inline uint64_t hash_words(const uint64_t *words, size_t n)
 {
-	// fd invalid out of bounds
-	if(fd >= FS_OPEN_MAX_COUNT){
-		return -1;
-	}
-	// not currently open
-	if(fd_table[fd] == NULL){
-		return -1;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < n; i++) {
+		hash = (hash ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 29;
 	}
-	// offset larger than current file size
-	if(offset > fd_table[fd]->cur_file->FILE_SIZE){
-		return -1;
+	return hash;
+}
+
+/**
+ *  dedup_hash_block() returns the hash of the contents of a data block.
+ */
+uint64_t dedup_hash_block(fs_t *fs, const void *data) {
+	// The common block sizes get a loop of constant length, unrolled by the compiler
+	switch (fs->block_size) {
+	case BLOCK_SIZE_MIN:
+		return hash_words(data, BLOCK_SIZE_MIN / sizeof(uint64_t));
+	case BLOCK_SIZE:
+		return hash_words(data, BLOCK_SIZE / sizeof(uint64_t));
+	case BLOCK_SIZE_MAX:
+		return hash_words(data, BLOCK_SIZE_MAX / sizeof(uint64_t));
+	default:
+		return hash_words(data, fs->block_size / sizeof(uint64_t));
 	}
-	// set the file offset
-	fd_table[fd]->offset = offset;
-	return 0;
 }
 
-int fs_write(int fd, void *buf, size_t count) {
-	// Error Management
-	if (fd >= FS_OPEN_MAX_COUNT || fd < 0) { // fd out of bounds
-		printf("bound error\n");
+/**
+ *  dedup_init() loads the table of shared blocks, or starts an empty one, and counts the references to
+ *	each block. The hash index is only set up when mounted with FS_MOUNT_DEDUP.
+ */
+int dedup_init(fs_t *fs) {
+	fs->dedup_src = arena_alloc(fs->arena, fs->super_block->FAT_BLOCK_COUNT * fs->block_size);
+	fs->dedup_refs = arena_alloc(fs->arena, fs->super_block->DATA_BLOCK_COUNT * sizeof(uint16_t));
+	if (fs->dedup_src == NULL || fs->dedup_refs == NULL) {
 		return -1;
 	}
-	if (fd_table[fd] == NULL) { // if file not currently open
-		printf("file not open\n");
-		return -1;
+	if (fs->super_block->DEDUP_BLOCK == 0) {
+		memset(fs->dedup_src, 0xFF, fs->super_block->FAT_BLOCK_COUNT * fs->block_size);
+	} else {
+		uint16_t index = fs->super_block->DEDUP_BLOCK;
+		for (int i = 0; i < fs->super_block->FAT_BLOCK_COUNT && index != FAT_EOC; i++) {
+			block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + index, fs->dedup_src + i * (fs->block_size/2));
+			index = fat_next(fs, index);
+		}
 	}
-	if (count < 0) {
-		printf("no need read byte\n");
-		return -1;
+	for (int i = 0; i < fs->super_block->DATA_BLOCK_COUNT; i++) {
+		if (fs->dedup_src[i] != FAT_EOC) {
+			fs->dedup_refs[fs->dedup_src[i]]++;
+		}
 	}
 
-	// Get the file using fd_table
-	int first_block_pos = 0;
-	struct file_desc *cur_file_desc = fd_table[fd];
-	int file_in_direc = 0;
-	int start_offset = 0;
-	// Get index position of the first data block of the file
-	for (int i = 0 ; i < FS_FILE_MAX_COUNT; i++){
-		if (root_directory->all_files[i].FILENAME == cur_file_desc->cur_file->FILENAME){ // found the file
-			first_block_pos = root_directory->all_files[i].FILE_FIRST_BLOCK;
-			file_in_direc = i;
-			start_offset = cur_file_desc->offset;
+	if (fs->flags & FS_MOUNT_DEDUP) {
+		size_t buckets = 1;
+		while (buckets < fs->super_block->DATA_BLOCK_COUNT) {
+			buckets *= 2;
 		}
-	}
-	// If the file is empty, assign data block and update FAT linking
-	if (root_directory->all_files[file_in_direc].FILE_FIRST_BLOCK == FAT_EOC) {
-		int new_block_index = get_new_block_index();
-		if (new_block_index == -1){
-			return 0; // No more blocks available, so we couldn't write any bytes. Therefore, we wrote 0 bytes. Return 0.
+		fs->dedup_hash = arena_alloc(fs->arena, fs->super_block->DATA_BLOCK_COUNT * sizeof(uint64_t));
+		fs->dedup_next = arena_alloc(fs->arena, fs->super_block->DATA_BLOCK_COUNT * sizeof(uint16_t));
+		fs->dedup_bucket = arena_alloc(fs->arena, buckets * sizeof(uint16_t));
+		if (fs->dedup_hash == NULL || fs->dedup_next == NULL || fs->dedup_bucket == NULL) {
+			return -1;
 		}
-		cur_file_desc->cur_file->FILE_FIRST_BLOCK = new_block_index;
-		first_block_pos = new_block_index;
-		root_directory->all_files[file_in_direc].FILE_FIRST_BLOCK = first_block_pos;
-		FAT[new_block_index] = FAT_EOC;
-	}	
+		memset(fs->dedup_bucket, 0xFF, buckets * sizeof(uint16_t));
+		fs->dedup_mask = buckets - 1;
+	}
+	return 0;
+}
+
+/**
+ *  dedup_table() allocates the blocks of the table of shared blocks on disk, when the first block gets
+ *	shared. Returns -1 if there aren't enough free data blocks.
+ */
+int dedup_table(fs_t *fs) {
+	if (fs->super_block->DEDUP_BLOCK != 0) {
+		return 0;
+	}
+	uint16_t first = FAT_EOC, last = FAT_EOC;
+	for (int i = 0; i < fs->super_block->FAT_BLOCK_COUNT; i++) {
+		int index = get_new_block_index(fs);
+		if (index == -1) {
+			while (first != FAT_EOC) {
+				uint16_t next = fat_next(fs, first);
+				fs->FAT[first] = 0;
+				first = next;
+			}
+			return -1;
+		}
+		fs->FAT[index] = FAT_EOC;
+		if (last == FAT_EOC) {
+			first = index;
+		} else {
+			fs->FAT[last] = index;
+		}
+		last = index;
+	}
+	fs->super_block->DEDUP_BLOCK = first;
+	block_write_ctx(fs->disk, 0, fs->super_block);
+	fs->dedup_dirty = 1;
+	return 0;
+}
 
-	int remaining_to_write = count;
-	char* bounce = malloc(BLOCK_SIZE);
-	int buffer_offset = 0; // Keep track of how much of the buffer we already wrote into disk
-	while (remaining_to_write > 0){
-		int target_index = index_containing_offset(cur_file_desc, first_block_pos); // block index which contains the offset
-		
-		int block_offset = cur_file_desc->offset % BLOCK_SIZE; // We know how far in we are into this block
-		block_read(target_index, bounce); // Read entire block into bounce
+/**
+ *  dedup_sync() writes the table of shared blocks, if it changed.
+ */
+void dedup_sync(fs_t *fs) {
+	if (!fs->dedup_dirty || fs->super_block->DEDUP_BLOCK == 0) {
+		return;
+	}
+	uint16_t index = fs->super_block->DEDUP_BLOCK, prev = FAT_EOC;
+	for (int i = 0; i < fs->super_block->FAT_BLOCK_COUNT && index != FAT_EOC; i++) {
+		// Blocks of the table used by the latest snapshot move to new blocks
+		int new_index = block_frozen(fs, index) ? snap_alloc(fs) : -1;
+		if (new_index != -1) {
+			fs->FAT[new_index] = fs->FAT[index];
+			fs->FAT[index] = FAT_SNAP;
+			if (prev == FAT_EOC) {
+				fs->super_block->DEDUP_BLOCK = new_index;
+				block_write_ctx(fs->disk, 0, fs->super_block);
+			} else {
+				fs->FAT[prev] = new_index;
+			}
+			index = new_index;
+			snap_reserve_update(fs);
+		}
+		block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + index, fs->dedup_src + i * (fs->block_size/2));
+		prev = index;
+		index = fat_next(fs, index);
+	}
+	fs->dedup_dirty = 0;
+}
 
-		// 3 cases 
-		//	1. if (block_offset + remaining_to_write < BLOCK_SIZE) ==> We can fit the data into the block
-		//	2. if (block_offset + remaining_to_write >= BLOCK SIZE) ==> Can't fit into block.
-		// 	3. if equal, just copy
+/**
+ *  clock_ms() returns the time of a monotonic clock, in milliseconds.
+ */
+uint64_t clock_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-		if (block_offset + remaining_to_write < BLOCK_SIZE){ // We can fit the data into this block
-			memcpy(bounce+block_offset, buf+buffer_offset, remaining_to_write);
-			cur_file_desc->offset += remaining_to_write;
-			buffer_offset += remaining_to_write;
-			remaining_to_write = 0; // Wrote the small buf case into block. Nothing more to read.
-			
-			block_write(target_index, bounce);
+/**
+ *  data_dirty() records that data blocks @index to @index + @count - 1 were written, for the flusher.
+ */
+void data_dirty(fs_t *fs, uint16_t index, size_t count) {
+	struct flusher *wb = fs->flusher;
+	if (wb == NULL || (fs->flags & FS_MOUNT_DIRECT)) { // Direct writes are not cached by the host
+		return;
+	}
+	for (size_t i = index; i < index + count; i++) {
+		if (!(wb->dirty[i / 8] & (1 << (i % 8)))) {
+			wb->dirty[i / 8] |= 1 << (i % 8);
+			wb->ndirty++;
 		}
-		// Can't fit entire data in the block. Fit as much as we can in this block, then create a new data_block, do linking,
-		// then put remaining into that block
-		else if (block_offset + remaining_to_write > BLOCK_SIZE) { 
-			int block_left = BLOCK_SIZE - block_offset;
-			memcpy(bounce+block_offset, buf+buffer_offset, block_left);
-			cur_file_desc->offset += block_left;
-			buffer_offset += block_left;
-			remaining_to_write = remaining_to_write - block_left;
-			// Now, copy the bounce into the disk (as much as we have read)
-			block_write(target_index, bounce);
-			// So far, we read as much as we could into the block. Now, assign new data block and link with FAT. Then add data into new block.
+	}
+	if (wb->dirty_since == 0) {
+		wb->dirty_since = clock_ms();
+	}
+}
 
-			int new_block_index = get_new_block_index();
-			if (new_block_index == -1) { // We wrote as much as possible. We don't have any more space. Just return.
-				return (count - remaining_to_write);
-			}
-			FAT[target_index] = new_block_index; // Update FAT to link to new block
-			FAT[new_block_index] = FAT_EOC; // Added a new data block to the file. This one is now the end of the file.
+/**
+ *  meta_sync() writes the root directory, shared block table and FAT after a write, or leaves them to
+ *	the flusher if there is one.
+ */
+void meta_sync(fs_t *fs) {
+	struct flusher *wb = fs->flusher;
+	if (wb == NULL) {
+		root_sync(fs);
+		dedup_sync(fs);
+		fat_sync(fs);
+		return;
+	}
+	wb->meta_dirty = 1;
+	if (wb->dirty_since == 0) {
+		wb->dirty_since = clock_ms();
+	}
+}
+
+/**
+ *  meta_flush() writes the metadata left to the flusher, so that the disk is up to date.
+ */
+void meta_flush(fs_t *fs) {
+	struct flusher *wb = fs->flusher;
+	if (wb == NULL || !wb->meta_dirty) {
+		return;
+	}
+	if (wb->pack_dirty) {
+		pack_sync(fs);
+	}
+	root_sync(fs);
+	dedup_sync(fs);
+	fat_sync(fs);
+	wb->meta_dirty = 0;
+	wb->pack_dirty = 0;
+}
+
+/**
+ *  wb_blocks() converts @percent of the data blocks into a number of blocks (at least 1).
+ */
+size_t wb_blocks(fs_t *fs, unsigned int percent) {
+	size_t blocks = (size_t)fs->super_block->DATA_BLOCK_COUNT * percent / 100;
+	return blocks > 0 ? blocks : 1;
+}
+
+/**
+ *  wb_throttle() makes a writer wait for the flusher while the data blocks not written back yet exceed
+ *	the hard limit. Called with the instance lock held, before the descriptor is looked up.
+ */
+void wb_throttle(fs_t *fs) {
+	struct flusher *wb = fs->flusher;
+	if (wb == NULL) {
+		return;
+	}
+	while (!wb->stop && wb->ndirty + wb->inflight >= wb_blocks(fs, wb->params.dirty_limit)) {
+		pthread_cond_signal(&wb->wake);
+		pthread_cond_wait(&wb->done, &fs->lock);
+	}
+}
 
+/**
+ *  writeback_map() writes back the data blocks set in @map (one bit per data block) by runs, in block
+ *	order. Waits for each run to reach storage if @wait.
+ */
+void writeback_map(fs_t *fs, const uint8_t *map, size_t count, int wait) {
+	size_t data = fs->super_block->DATA_BLOCK;
+	for (size_t i = 0; i < count; i++) {
+		if (!(map[i / 8] & (1 << (i % 8)))) {
+			continue;
 		}
-		else if (block_offset + remaining_to_write == BLOCK_SIZE){
-			memcpy(bounce+block_offset, buf+buffer_offset, remaining_to_write);
-			cur_file_desc->offset += remaining_to_write;
-			buffer_offset += remaining_to_write;
-			remaining_to_write = remaining_to_write - BLOCK_SIZE;
-			block_write(target_index, bounce);
+		size_t run = 1;
+		while (i + run < count && (map[(i + run) / 8] & (1 << ((i + run) % 8)))) {
+			run++;
+		}
+		block_writeback_ctx(fs->disk, data + i, run, wait);
+		i += run - 1;
+	}
+}
+
+/**
+ *  meta_map() sets in @map the data blocks holding metadata: the pack block, the table of shared blocks,
+ *	and the snapshot table with the copies kept for the snapshots.
+ */
+void meta_map(fs_t *fs, uint8_t *map) {
+	for (int i = 0; i < fs->super_block->DATA_BLOCK_COUNT; i++) {
+		if (fs->FAT[i] == FAT_SNAP) {
+			map[i / 8] |= 1 << (i % 8);
 		}
 	}
-	if(root_directory->all_files[file_in_direc].FILE_SIZE < buffer_offset + start_offset){
-		root_directory->all_files[file_in_direc].FILE_SIZE = buffer_offset + start_offset;
-	} else if (root_directory->all_files[file_in_direc].FILE_SIZE >= buffer_offset + start_offset){
-		root_directory->all_files[file_in_direc].FILE_SIZE = root_directory->all_files[file_in_direc].FILE_SIZE;
+	if (fs->super_block->PACK_BLOCK != 0) {
+		map[fs->super_block->PACK_BLOCK / 8] |= 1 << (fs->super_block->PACK_BLOCK % 8);
 	}
-	block_write(super_block->ROOT_DIRECTORY_BLOCK, root_directory);
-	for(int i = 0; i < super_block->FAT_BLOCK_COUNT; i++){
-		block_write(i+1, FAT + i * (BLOCK_SIZE/2));
+	if (fs->super_block->DEDUP_BLOCK != 0) {
+		for (uint16_t i = fs->super_block->DEDUP_BLOCK; i != FAT_EOC; i = fs->FAT[i]) {
+			map[i / 8] |= 1 << (i % 8);
+		}
 	}
+}
 
-	return buffer_offset;
+/**
+ *  flusher_batch() writes back the data blocks written so far in block order, and once they reached
+ *	storage, writes the pending metadata and writes it back in turn. The instance lock is dropped
+ *	meanwhile.
+ */
+void flusher_batch(fs_t *fs) {
+	struct flusher *wb = fs->flusher;
+	uint8_t *batch = wb->dirty;
+	wb->dirty = wb->batch;
+	wb->batch = batch;
+	wb->inflight = wb->ndirty;
+	wb->ndirty = 0;
+	wb->dirty_since = 0;
+	size_t count = fs->super_block->DATA_BLOCK_COUNT;
+	size_t data = fs->super_block->DATA_BLOCK;
+	pthread_mutex_unlock(&fs->lock);
+
+	// All runs are started before waiting for the first one
+	writeback_map(fs, batch, count, 0);
+	writeback_map(fs, batch, count, 1);
+	memset(batch, 0, count / 8 + 1);
+
+	// Only now can the metadata point at the data of the batch
+	pthread_mutex_lock(&fs->lock);
+	meta_flush(fs);
+	meta_map(fs, batch);
+	pthread_mutex_unlock(&fs->lock);
+	block_writeback_ctx(fs->disk, 0, data, 1);
+	writeback_map(fs, batch, count, 1);
+	memset(batch, 0, count / 8 + 1);
+
+	pthread_mutex_lock(&fs->lock);
+	wb->inflight = 0;
+	pthread_cond_broadcast(&wb->done);
 }
 
-int fs_read(int fd, void *buf, size_t count)
-{
-	// fd invalid out of bounds
-	if(fd >= FS_OPEN_MAX_COUNT){
+/**
+ *  flusher_thread() writes back the changes of instance @arg whenever a threshold is crossed.
+ */
+void *flusher_thread(void *arg) {
+	fs_t *fs = arg;
+	struct flusher *wb = fs->flusher;
+	pthread_mutex_lock(&fs->lock);
+	while (!wb->stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		uint64_t ns = ts.tv_nsec + (uint64_t)wb->params.interval_ms * 1000000;
+		ts.tv_sec += ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		pthread_cond_timedwait(&wb->wake, &fs->lock, &ts);
+		if (wb->stop || wb->dirty_since == 0) {
+			continue;
+		}
+		if (wb->ndirty < wb_blocks(fs, wb->params.dirty_background) &&
+		    wb->ndirty + wb->inflight < wb_blocks(fs, wb->params.dirty_limit) &&
+		    clock_ms() - wb->dirty_since < wb->params.expire_ms) {
+			continue;
+		}
+		flusher_batch(fs);
+	}
+	pthread_mutex_unlock(&fs->lock);
+	return NULL;
+}
+
+/**
+ *  flusher_start() starts the flusher of @fs, with the default thresholds.
+ */
+int flusher_start(fs_t *fs) {
+	size_t map_size = fs->super_block->DATA_BLOCK_COUNT / 8 + 1;
+	struct flusher *wb = arena_alloc(fs->arena, sizeof(*wb));
+	if (wb == NULL) {
 		return -1;
 	}
-	// not currently open
-	if(fd_table[fd] == NULL){
+	wb->dirty = arena_alloc(fs->arena, map_size);
+	wb->batch = arena_alloc(fs->arena, map_size);
+	if (wb->dirty == NULL || wb->batch == NULL) {
 		return -1;
 	}
-	int first_block_pos = 0;
-	struct file_desc *cur_file_desc = fd_table[fd]; //file & offset
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(root_directory->all_files[i].FILENAME == cur_file_desc->cur_file->FILENAME){
-			first_block_pos = root_directory->all_files[i].FILE_FIRST_BLOCK;
+	wb->params.dirty_background = WB_DIRTY_BACKGROUND;
+	wb->params.dirty_limit = WB_DIRTY_LIMIT;
+	wb->params.expire_ms = WB_EXPIRE_MS;
+	wb->params.interval_ms = WB_INTERVAL_MS;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wb->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&wb->done, NULL);
+	fs->flusher = wb;
+	if (pthread_create(&wb->thread, NULL, flusher_thread, fs) != 0) {
+		fs->flusher = NULL;
+		pthread_cond_destroy(&wb->done);
+		pthread_cond_destroy(&wb->wake);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ *  flusher_stop() stops the flusher of @fs, and writes back what is left. Called with the instance lock
+ *	held, which is dropped while the flusher finishes.
+ */
+void flusher_stop(fs_t *fs) {
+	struct flusher *wb = fs->flusher;
+	if (wb == NULL) {
+		return;
+	}
+	wb->stop = 1;
+	pthread_cond_signal(&wb->wake);
+	pthread_cond_broadcast(&wb->done);
+	pthread_mutex_unlock(&fs->lock);
+	pthread_join(wb->thread, NULL);
+	pthread_mutex_lock(&fs->lock);
+	if (wb->dirty_since != 0) {
+		flusher_batch(fs);
+	}
+	fs->flusher = NULL;
+	pthread_cond_destroy(&wb->done);
+	pthread_cond_destroy(&wb->wake);
+}
+
+/**
+ *  block_source() returns the data block holding the contents of data block @data_index: itself, unless
+ *	it shares the contents of another one. Holes (and -1) are returned as is.
+ */
+int block_source(fs_t *fs, int data_index) {
+	if (fs->dedup_src == NULL || data_index == -1 || (data_index & FAT_HOLE) ||
+	    fs->dedup_src[data_index] == FAT_EOC) {
+		return data_index;
+	}
+	return fs->dedup_src[data_index];
+}
+
+/**
+ *  dedup_unindex() removes data block @index from the hash index. Returns 1 if it was indexed.
+ */
+int dedup_unindex(fs_t *fs, uint16_t index) {
+	if (fs->dedup_hash == NULL) {
+		return 0;
+	}
+	uint16_t *link = &fs->dedup_bucket[fs->dedup_hash[index] & fs->dedup_mask];
+	while (*link != FAT_EOC) {
+		if (*link == index) {
+			*link = fs->dedup_next[index];
+			return 1;
 		}
+		link = &fs->dedup_next[*link];
 	}
-	int remaining_to_read = 0;
-	int offset_subtractor = cur_file_desc->cur_file->FILE_SIZE - cur_file_desc->offset;
-	if (offset_subtractor < count) {
-		remaining_to_read = offset_subtractor;
+	return 0;
+}
+
+/**
+ *  dedup_index() adds data block @index, whose contents hash to @hash, to the hash index.
+ */
+void dedup_index(fs_t *fs, uint16_t index, uint64_t hash) {
+	fs->dedup_hash[index] = hash;
+	fs->dedup_next[index] = fs->dedup_bucket[hash & fs->dedup_mask];
+	fs->dedup_bucket[hash & fs->dedup_mask] = index;
+}
+
+/**
+ *  dedup_unshare() makes data block @index stop sharing the contents of another block. Its own
+ *	contents are then undefined until it is written.
+ */
+void dedup_unshare(fs_t *fs, uint16_t index) {
+	if (fs->dedup_src == NULL || fs->dedup_src[index] == FAT_EOC) {
+		return;
 	}
-	else {
-		remaining_to_read = count;
+	fs->dedup_refs[fs->dedup_src[index]]--;
+	fs->dedup_src[index] = FAT_EOC;
+	fs->dedup_dirty = 1;
+}
+
+/**
+ *  dedup_release() prepares data block @index to be overwritten or freed: it stops sharing the contents
+ *	of another block, and the blocks sharing its own contents get them back in the first of them.
+ */
+void dedup_release(fs_t *fs, uint16_t index) {
+	if (fs->dedup_src == NULL) {
+		return;
+	}
+	dedup_unshare(fs, index);
+	int indexed = dedup_unindex(fs, index);
+	if (fs->dedup_refs[index] == 0) {
+		return;
 	}
-	
-	// BEGINNING
-	char* bounce = malloc(BLOCK_SIZE);
-	int buffer_offset = 0; // We are adding data in pieces, so we need to keep track of beginning of buffer
-	while (remaining_to_read > 0) { // Loop until we have no more bytes to read 
-		int target_index = index_containing_offset(cur_file_desc, first_block_pos);
-		block_read(target_index, bounce);
-		int block_offset = cur_file_desc->offset % BLOCK_SIZE; // Shows how far in we are into the block
-
-		if (block_offset + remaining_to_read < BLOCK_SIZE) { // CASE 1: We extract part of the block (where offset is in the middle, count is the end)
-			memcpy(buf + buffer_offset, bounce + block_offset, remaining_to_read);
-			cur_file_desc->offset += remaining_to_read;
-			buffer_offset += remaining_to_read;
-			remaining_to_read = 0; // Ensures that the loop won't run again
-			
-		}
-		else if (block_offset + remaining_to_read > BLOCK_SIZE) { // CASE 2: Bigger than a block
-			int block_left = BLOCK_SIZE - block_offset;
-			memcpy(buf + buffer_offset, bounce + block_offset, block_left);
-			cur_file_desc->offset += block_left;
-			buffer_offset += block_left;
-			remaining_to_read = remaining_to_read - block_left;
 
+	uint16_t heir = FAT_EOC;
+	for (int i = 0; i < fs->super_block->DATA_BLOCK_COUNT; i++) {
+		if (fs->dedup_src[i] != index) {
+			continue;
 		}
-		else if ((block_offset + remaining_to_read) == BLOCK_SIZE) { // CASE 3: We're reading exactly a block (IDEAL CASE)
-			memcpy(buf + buffer_offset, bounce + block_offset, remaining_to_read);
-			cur_file_desc->offset += remaining_to_read;
-			buffer_offset += remaining_to_read;
-			remaining_to_read = remaining_to_read - BLOCK_SIZE;
+		if (heir == FAT_EOC) {
+			heir = i;
+			fs->dedup_src[i] = FAT_EOC;
+		} else {
+			fs->dedup_src[i] = heir;
+			fs->dedup_refs[heir]++;
 		}
 	}
-	
-	return buffer_offset;
+	fs->dedup_refs[index] = 0;
+	fs->dedup_dirty = 1;
+	char *bounce = arena_buf_get(fs->arena);
+	block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + index, bounce);
+	block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + heir, bounce);
+	data_dirty(fs, heir, 1);
+	arena_buf_put(fs->arena, bounce);
+	if (indexed) {
+		dedup_index(fs, heir, fs->dedup_hash[index]);
+	}
+}
+
+/**
+ *  dedup_lookup() tells whether a block with the same hash as @data is indexed.
+ */
+int dedup_lookup(fs_t *fs, const void *data) {
+	uint64_t hash = dedup_hash_block(fs, data);
+	for (uint16_t b = fs->dedup_bucket[hash & fs->dedup_mask]; b != FAT_EOC; b = fs->dedup_next[b]) {
+		if (fs->dedup_hash[b] == hash) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ *  dedup_share() makes data block @index share the contents of an indexed block identical to @data,
+ *	instead of writing @data into it. Returns -1 if there is no such block: @data must be written.
+ */
+int dedup_share(fs_t *fs, uint16_t index, const void *data) {
+	uint64_t hash = dedup_hash_block(fs, data);
+	char *bounce = arena_buf_get(fs->arena);
+	int ret = -1;
+	for (uint16_t b = fs->dedup_bucket[hash & fs->dedup_mask]; b != FAT_EOC; b = fs->dedup_next[b]) {
+		if (fs->dedup_hash[b] != hash) {
+			continue;
+		}
+		// Hashes may collide: compare the contents
+		block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + b, bounce);
+		if (memcmp(bounce, data, fs->block_size) != 0) {
+			continue;
+		}
+		if (b == index) { // Rewritten with the same contents
+			ret = 0;
+		} else if (dedup_table(fs) == 0) {
+			dedup_release(fs, index);
+			fs->dedup_src[index] = b;
+			fs->dedup_refs[b]++;
+			fs->dedup_dirty = 1;
+			block_discard_ctx(fs->disk, fs->super_block->DATA_BLOCK + index, 1);
+			ret = 0;
+		}
+		break;
+	}
+	arena_buf_put(fs->arena, bounce);
+	return ret;
+}
+
+/**
+ *  block_relocate() replaces data block @index, used by the latest snapshot or borrowed, with a new
+ *	data block in the same place of its chain (the caller links the previous block to it). @index
+ *	is kept for the snapshots and borrowers. Returns -1 if no data block is available.
+ */
+int block_relocate(fs_t *fs, uint16_t index) {
+	int new_index = get_new_block_index(fs);
+	if (new_index == -1) {
+		return -1;
+	}
+	dedup_release(fs, index);
+	fs->FAT[new_index] = fs->FAT[index];
+	block_keep(fs, index);
+	return new_index;
+}
+
+/**
+ *  file_block() returns the data block (relative to the first data block) holding block
+ *	@block_num of @file, with FAT_HOLE set if it stands for a hole. The FAT chain of the file
+ *	is only walked once, then cached in its block map. If @extend is set, missing blocks are
+ *	allocated and linked at the end of the chain (the ones before @block_num as holes), and
+ *	a hole at @block_num is turned into a regular block, ready to be written: a block used by
+ *	the latest snapshot or borrowed is replaced with a new one. Returns -1 if there is no such block.
+ */
+int file_block(fs_t *fs, struct open_file *file, size_t block_num, int extend) {
+	struct file *cur_file = file->cur_file;
+	if (!file->map_loaded) {
+		for (uint16_t i = cur_file->FILE_FIRST_BLOCK; i != FAT_EOC; i = fat_next(fs, i)) {
+			if (map_append(file, fat_is_hole(fs, i) ? (i | FAT_HOLE) : i) == -1) {
+				file->map_len = 0;
+				return -1;
+			}
+		}
+		file->map_loaded = 1;
+	}
+	while (block_num >= file->map_len) {
+		if (!extend) {
+			return -1;
+		}
+		int hole = file->map_len < block_num; // Skipped over by a write past the end of file
+		int new_block_index = get_block_after(fs, file->map_len > 0 ? file->block_map[file->map_len - 1] & ~FAT_HOLE : -1);
+		if (new_block_index == -1 || map_append(file, hole ? (new_block_index | FAT_HOLE) : new_block_index) == -1) {
+			return -1;
+		}
+		if (file->map_len == 1) {
+			cur_file->FILE_FIRST_BLOCK = new_block_index;
+		} else {
+			// Link the new block at the end of the chain
+			uint16_t last = file->block_map[file->map_len - 2] & ~FAT_HOLE;
+			fat_set(fs, last, new_block_index, fat_is_hole(fs, last));
+		}
+		fat_set(fs, new_block_index, FAT_EOC, hole);
+	}
+	if (extend && !(file->block_map[block_num] & FAT_HOLE) &&
+	    (block_frozen(fs, file->block_map[block_num]) || block_pinned(fs, file->block_map[block_num]))) {
+		int index = block_relocate(fs, file->block_map[block_num]);
+		if (index == -1) {
+			return -1;
+		}
+		if (block_num == 0) {
+			cur_file->FILE_FIRST_BLOCK = index;
+		} else {
+			uint16_t prev = file->block_map[block_num - 1] & ~FAT_HOLE;
+			fat_set(fs, prev, index, fat_is_hole(fs, prev));
+		}
+		file->block_map[block_num] = index;
+	}
+	if (extend && (file->block_map[block_num] & FAT_HOLE)) {
+		// First write into a hole
+		uint16_t index = file->block_map[block_num] & ~FAT_HOLE;
+		fat_set(fs, index, fat_next(fs, index), 0);
+		file->block_map[block_num] = index;
+	}
+	return file->block_map[block_num];
+}
+
+/**
+ *  slot_make_hole() turns block @block_num of @file into a hole, releasing the storage of its data block.
+ */
+void slot_make_hole(fs_t *fs, struct open_file *file, size_t block_num) {
+	if (file->block_map[block_num] & FAT_HOLE) {
+		return;
+	}
+	// Blocks used by the latest snapshot or borrowed are kept
+	int data_index = file_block(fs, file, block_num, 1);
+	if (data_index == -1) {
+		return;
+	}
+	uint16_t index = data_index;
+	dedup_release(fs, index);
+	fat_set(fs, index, fat_next(fs, index), 1);
+	file->block_map[block_num] = index | FAT_HOLE;
+	block_discard_ctx(fs->disk, fs->super_block->DATA_BLOCK + index, 1);
+}
+
+/**
+ *  extent_buffers() allocates the extent buffers of @file on first use.
+ */
+int extent_buffers(fs_t *fs, struct open_file *file) {
+	if (file->ext_data != NULL) {
+		return 0;
+	}
+	// Aligned, so that they can be transferred with direct I/O as is
+	void *data, *comp;
+	if (posix_memalign(&data, BLOCK_ALIGN, EXTENT_SIZE(fs))) {
+		return -1;
+	}
+	if (posix_memalign(&comp, BLOCK_ALIGN, EXTENT_SIZE(fs))) {
+		free(data);
+		return -1;
+	}
+	file->ext_data = data;
+	file->ext_comp = comp;
+	file->ext_cached = -1;
+	return 0;
+}
+
+/**
+ *  extent_slots() returns the number of blocks of extent @x, in a file of @size bytes.
+ */
+size_t extent_slots(fs_t *fs, size_t size, size_t x) {
+	if (size <= x * EXTENT_SIZE(fs)) {
+		return 0;
+	}
+	size_t bytes = size - x * EXTENT_SIZE(fs);
+	if (bytes > EXTENT_SIZE(fs)) {
+		bytes = EXTENT_SIZE(fs);
+	}
+	return BLOCK_OF(fs, bytes + fs->block_size - 1);
+}
+
+/**
+ *  extent_stored() returns the number of leading blocks of extent @x of @file that are not holes,
+ *	out of its @n blocks. All of them are stored for an extent stored as is, none for a hole.
+ */
+size_t extent_stored(fs_t *fs, struct open_file *file, size_t x, size_t n) {
+	size_t k = 0;
+	while (k < n) {
+		int data_index = file_block(fs, file, x * EXTENT_BLOCKS + k, 0);
+		if (data_index == -1 || (data_index & FAT_HOLE)) {
+			break;
+		}
+		k++;
+	}
+	return k;
+}
+
+/**
+ *  extent_io() reads or writes (if @write is set) @count stored blocks of @file from block @block_num,
+ *	with one request per run of consecutive data blocks. Shared blocks are read from their source, and
+ *	get contents of their own when written.
+ */
+int extent_io(fs_t *fs, struct open_file *file, size_t block_num, size_t count, char *buf, int write) {
+	size_t done = 0;
+	while (done < count) {
+		int data_index = file_block(fs, file, block_num + done, 0);
+		if (!write) {
+			data_index = block_source(fs, data_index);
+		}
+		size_t run = 1;
+		while (done + run < count) {
+			int next = file_block(fs, file, block_num + done + run, 0);
+			if ((write ? next : block_source(fs, next)) != data_index + (int)run) {
+				break;
+			}
+			run++;
+		}
+		int ret;
+		if (write) {
+			for (size_t i = 0; i < run; i++) {
+				dedup_release(fs, data_index + i);
+			}
+			ret = block_write_many_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, run, buf + done * fs->block_size);
+			data_dirty(fs, data_index, run);
+		} else {
+			ret = block_read_many_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, run, buf + done * fs->block_size);
+		}
+		if (ret) {
+			return -1;
+		}
+		done += run;
+	}
+	return 0;
+}
+
+/**
+ *  extent_load() fills the extent buffer of @file with the contents of extent @x, in a file of @size
+ *	bytes (zeros past the end). Returns -1 if the extent cannot be read.
+ */
+int extent_load(fs_t *fs, struct open_file *file, size_t x, size_t size) {
+	if (file->ext_cached == (long)x) {
+		return 0;
+	}
+	file->ext_cached = -1;
+	size_t n = extent_slots(fs, size, x);
+	size_t k = extent_stored(fs, file, x, n);
+	size_t len = 0;
+	if (k == n) { // Stored as is (or nothing at all)
+		if (extent_io(fs, file, x * EXTENT_BLOCKS, n, file->ext_data, 0)) {
+			return -1;
+		}
+		len = n * fs->block_size;
+	} else if (k > 0) {
+		if (extent_io(fs, file, x * EXTENT_BLOCKS, k, file->ext_comp, 0)) {
+			return -1;
+		}
+		uint32_t stream_len;
+		memcpy(&stream_len, file->ext_comp, sizeof(stream_len));
+		long ret = -1;
+		if (stream_len <= k * fs->block_size - sizeof(stream_len)) {
+			ret = lz_decompress(file->ext_comp + sizeof(stream_len), stream_len, file->ext_data, EXTENT_SIZE(fs));
+		}
+		if (ret < 0) {
+			return -1;
+		}
+		len = ret;
+	}
+	// Nothing past the end of file
+	if (size < x * EXTENT_SIZE(fs) + len) {
+		len = size > x * EXTENT_SIZE(fs) ? size - x * EXTENT_SIZE(fs) : 0;
+	}
+	memset(file->ext_data + len, 0, EXTENT_SIZE(fs) - len);
+	file->ext_cached = x;
+	return 0;
+}
+
+/**
+ *  extent_store() writes the first @size bytes of the extent buffer of @file as extent @x, compressed
+ *	if that saves at least a block. Returns -1 if the blocks cannot be allocated or written.
+ */
+int extent_store(fs_t *fs, struct open_file *file, size_t x, size_t size) {
+	size_t n = BLOCK_OF(fs, size + fs->block_size - 1), k = n;
+	char *blocks = file->ext_data;
+	uint32_t stream_len = 0;
+	if (n > 1) {
+		stream_len = lz_compress(file->ext_data, size, file->ext_comp + sizeof(stream_len),
+					 (n - 1) * fs->block_size - sizeof(stream_len));
+	}
+	if (stream_len > 0) {
+		memcpy(file->ext_comp, &stream_len, sizeof(stream_len));
+		k = BLOCK_OF(fs, sizeof(stream_len) + stream_len + fs->block_size - 1);
+		memset(file->ext_comp + sizeof(stream_len) + stream_len, 0, k * fs->block_size - sizeof(stream_len) - stream_len);
+		blocks = file->ext_comp;
+	}
+
+	// Make the chain reach the end of the extent, then lay out the stored blocks followed by holes
+	if (file_block(fs, file, x * EXTENT_BLOCKS + n - 1, 1) == -1) {
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (i < k) {
+			file_block(fs, file, x * EXTENT_BLOCKS + i, 1);
+		} else {
+			slot_make_hole(fs, file, x * EXTENT_BLOCKS + i);
+		}
+	}
+	return extent_io(fs, file, x * EXTENT_BLOCKS, k, blocks, 1);
+}
+
+/**
+ *  snap_view() fills @fat, and @root if set, with the FAT and root directory of snapshot @entry.
+ */
+void snap_view(fs_t *fs, int entry, uint16_t *fat, struct RootDirectory *root) {
+	for (int i = 0; i < fs->super_block->FAT_BLOCK_COUNT; i++) {
+		uint16_t copy = fs->snap_fat_maps[entry][i];
+		if (copy != 0) {
+			block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + copy, fat + i * (fs->block_size/2));
+		} else {
+			memcpy(fat + i * (fs->block_size/2), fs->FAT + i * (fs->block_size/2), fs->block_size);
+		}
+	}
+	if (root == NULL) {
+		return;
+	}
+	if (fs->snap_table[entry].ROOT_COPY != 0) {
+		block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + fs->snap_table[entry].ROOT_COPY, root);
+	} else {
+		memcpy(root, fs->root_directory, sizeof(struct RootDirectory));
+	}
+}
+
+/**
+ *  snap_freeze() finds the latest snapshot, and loads its FAT and root directory.
+ */
+void snap_freeze(fs_t *fs) {
+	fs->snap_latest = -1;
+	for (size_t e = 0; e < FS_SNAPSHOT_MAX; e++) {
+		if (fs->snap_table[e].NAME[0] != '\0' &&
+		    (fs->snap_latest == -1 || fs->snap_table[e].SEQUENCE > fs->snap_table[fs->snap_latest].SEQUENCE)) {
+			fs->snap_latest = e;
+		}
+	}
+	if (fs->snap_latest != -1) {
+		snap_view(fs, fs->snap_latest, fs->fat_frozen, fs->root_frozen);
+		fs->snap_sequence = fs->snap_table[fs->snap_latest].SEQUENCE + 1;
+	}
+	snap_reserve_update(fs);
+}
+
+/**
+ *  snap_buffers() allocates the in-memory table of snapshots on first use.
+ */
+int snap_buffers(fs_t *fs) {
+	if (fs->snap_table != NULL) {
+		return 0;
+	}
+	fs->snap_table = arena_alloc(fs->arena, fs->block_size);
+	fs->fat_frozen = arena_alloc(fs->arena, fs->super_block->FAT_BLOCK_COUNT * fs->block_size);
+	fs->root_frozen = arena_alloc(fs->arena, fs->root_blocks * fs->block_size);
+	return fs->snap_table == NULL || fs->fat_frozen == NULL || fs->root_frozen == NULL ? -1 : 0;
+}
+
+/**
+ *  snap_load() loads the table of snapshots and their FAT maps.
+ */
+int snap_load(fs_t *fs) {
+	if (snap_buffers(fs)) {
+		return -1;
+	}
+	block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + fs->super_block->SNAP_BLOCK, fs->snap_table);
+	for (size_t e = 0; e < FS_SNAPSHOT_MAX; e++) {
+		if (fs->snap_table[e].NAME[0] == '\0') {
+			continue;
+		}
+		fs->snap_fat_maps[e] = arena_alloc(fs->arena, fs->block_size);
+		if (fs->snap_fat_maps[e] == NULL) {
+			return -1;
+		}
+		block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + fs->snap_table[e].FAT_MAP, fs->snap_fat_maps[e]);
+	}
+	snap_freeze(fs);
+	return 0;
+}
+
+/**
+ *  read_only() tells whether changes to @fs are refused: it is a view of a snapshot, or mounted with FS_MOUNT_RDONLY.
+ */
+int read_only(fs_t *fs) {
+	return fs->snapshot_of != NULL || (fs->flags & FS_MOUNT_RDONLY);
+}
+
+/**
+ *  meta_in_place() returns the @count metadata blocks from block @block in the mapping of the image, or NULL
+ *	if they are not contiguous in memory (in a stripe set).
+ */
+void *meta_in_place(fs_t *fs, size_t block, size_t count) {
+	const char *meta = block_map_ctx(fs->disk, block);
+	for (size_t i = 1; meta != NULL && i < count; i++) {
+		if (block_map_ctx(fs->disk, block + i) != meta + i * fs->block_size) {
+			return NULL;
+		}
+	}
+	return (void *)meta;
+}
+
+/**
+ *  disk_block_size() reads the block size recorded in the superblock of @disk, and has the transfers of
+ *	the disk use it. Returns its log2, or -1 if @disk doesn't hold a file system of a supported block size.
+ */
+int disk_block_size(disk_t *disk) {
+	// The superblock fields come first: the smallest block size is enough to reach them
+	char probe[BLOCK_SIZE_MIN] __attribute__((aligned(BLOCK_ALIGN)));
+	if (block_disk_set_block_size_ctx(disk, BLOCK_SIZE_MIN) || block_read_ctx(disk, 0, probe) ||
+	    strncmp(probe + offsetof(struct SuperBlock, SIGNATURE), "ECS150FS", 8) != 0) {
+		return -1;
+	}
+	uint8_t block_shift = probe[offsetof(struct SuperBlock, BLOCK_SHIFT)];
+	// Images of the default block size, formatted before it was recorded, hold 0
+	int shift = block_shift != 0 ? block_shift : __builtin_ctz(BLOCK_SIZE);
+	if (shift > __builtin_ctz(BLOCK_SIZE_MAX) || block_disk_set_block_size_ctx(disk, (size_t)1 << shift)) {
+		return -1;
+	}
+	return shift;
+}
+
+int fs_mounted(void)
+{
+	return default_fs != NULL;
+}
+
+/**
+ *  mount_instance() mounts the file system of @diskname as a new instance: the live file system, or
+ *	if @snap is set, a read-only view of snapshot @snap, whose FAT map is @fat_map.
+ */
+static fs_t *mount_instance(const char *diskname, int flags, const struct snapshot *snap, const uint16_t *fat_map)
+{
+	fs_t *fs = calloc(1, sizeof(fs_t));
+	if (fs == NULL) {
+		return NULL;
+	}
+	fs->fd_free = -1;
+	fs->snap_latest = -1;
+	// Read-only instances only read through the mapping of the image: options about writes don't apply
+	if (flags & FS_MOUNT_RDONLY) {
+		flags &= ~(FS_MOUNT_DIRECT | FS_MOUNT_DEFER_DISCARD | FS_MOUNT_COMPRESS | FS_MOUNT_DEDUP | FS_MOUNT_WRITEBACK);
+	}
+	// Arena buffers are page-aligned, so block traffic meets direct I/O alignment as is
+	fs->disk = block_disk_open_flags(diskname, ((flags & FS_MOUNT_DIRECT) ? BLOCK_DISK_DIRECT : 0) |
+					 ((flags & FS_MOUNT_RDONLY) ? BLOCK_DISK_RDONLY : 0));
+	int shift = fs->disk != NULL ? disk_block_size(fs->disk) : -1;
+	if (shift != -1) {
+		fs->block_shift = shift;
+		fs->block_size = (size_t)1 << shift;
+		fs->root_blocks = (sizeof(struct RootDirectory) + fs->block_size - 1) / fs->block_size;
+		// I/O buffers of the arena hold a block
+		fs->arena = arena_create((flags & FS_MOUNT_HUGEPAGES) ? ARENA_HUGEPAGES : 0, fs->block_size);
+	}
+	if (fs->arena == NULL) {
+		if (fs->disk != NULL) {
+			block_disk_close_ctx(fs->disk);
+		}
+		free(fs);
+		return NULL;
+	}
+	pthread_mutex_init(&fs->lock, NULL);
+	// The metadata of a read-only live instance is used in place, from the mapping shared with the other readers
+	int in_place = (flags & FS_MOUNT_RDONLY) && snap == NULL;
+	if (in_place) {
+		fs->super_block = (struct SuperBlock *)block_map_ctx(fs->disk, 0);
+	} else {
+		// Blocks smaller than the superblock only hold its first part, the rest is padding
+		fs->super_block = arena_alloc(fs->arena, fs->block_size > sizeof(struct SuperBlock) ?
+					      fs->block_size : sizeof(struct SuperBlock));
+		if (fs->super_block != NULL) {
+			block_read_ctx(fs->disk, 0, fs->super_block);
+		}
+	}
+
+	// The disk may be larger than the file system (e.g. a stripe set, rounded to whole stripes)
+	if(fs->super_block == NULL || strncmp((char*)fs->super_block->SIGNATURE, "ECS150FS", 8) != 0 ||
+	   fs->super_block->TOTAL_BLOCKS_COUNTS > block_disk_count_ctx(fs->disk) ||
+	   fs->super_block->DATA_BLOCK_COUNT > FS_DATA_BLOCK_MAX ||
+	   fs->super_block->DATA_BLOCK < fs->super_block->ROOT_DIRECTORY_BLOCK + fs->root_blocks){
+		block_disk_close_ctx(fs->disk);
+		memFree(fs);
+		return NULL;
+	}
+	block_trace_set_meta(fs->super_block->ROOT_DIRECTORY_BLOCK + fs->root_blocks - 1);
+	
+	// Initialize Root_directory
+	fs->root_directory = in_place ? meta_in_place(fs, fs->super_block->ROOT_DIRECTORY_BLOCK, fs->root_blocks) : NULL;
+	if (fs->root_directory == NULL) {
+		fs->root_directory = arena_alloc(fs->arena, fs->root_blocks * fs->block_size);
+		if (snap != NULL && snap->ROOT_COPY != 0) {
+			block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + snap->ROOT_COPY, fs->root_directory);
+		} else {
+			block_read_many_ctx(fs->disk, fs->super_block->ROOT_DIRECTORY_BLOCK, fs->root_blocks, fs->root_directory);
+		}
+	}
+
+	fs->FAT = in_place ? meta_in_place(fs, 1, fs->super_block->FAT_BLOCK_COUNT) : NULL;
+	if (fs->FAT == NULL) {
+		fs->FAT = arena_alloc(fs->arena, fs->super_block->FAT_BLOCK_COUNT * fs->block_size); // assign memory space for block_size of table
+		for(int i = 0; i < fs->super_block->FAT_BLOCK_COUNT; i++){
+			// each FAT is uint16_t, which means its length is 2 bytes (8 bits = 1 byte)
+			// a block can take block_size bytes, but we only store 2 bytes for FAT in a block
+			// To get into next FAT information, we work like an array, but the difference is
+			// we have to go to next FAT in block to take the information of the FAT
+			if (snap != NULL && fat_map[i] != 0) {
+				block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + fat_map[i], fs->FAT + (i * fs->block_size/2));
+			} else {
+				block_read_ctx(fs->disk, i + 1, fs->FAT + (i * fs->block_size/2)); 
+			}
+		}
+	}
+	fs->flags = flags;
+	if (snap != NULL) {
+		fs->super_block->PACK_BLOCK = snap->PACK_BLOCK;
+		fs->super_block->DEDUP_BLOCK = snap->DEDUP_BLOCK;
+		fs->super_block->SNAP_BLOCK = 0;
+	}
+	if (fs->super_block->PACK_BLOCK != 0 && in_place) {
+		fs->pack = (char *)block_map_ctx(fs->disk, fs->super_block->DATA_BLOCK + fs->super_block->PACK_BLOCK);
+	} else if (fs->super_block->PACK_BLOCK != 0) {
+		fs->pack = arena_alloc(fs->arena, fs->block_size);
+		block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + fs->super_block->PACK_BLOCK, fs->pack);
+	}
+	fs->discard_map = arena_alloc(fs->arena, fs->super_block->DATA_BLOCK_COUNT / 8 + 1);
+	if (((fs->super_block->DEDUP_BLOCK != 0 || (flags & FS_MOUNT_DEDUP)) && dedup_init(fs)) ||
+	    (fs->super_block->SNAP_BLOCK != 0 && snap_load(fs))) {
+		block_disk_close_ctx(fs->disk);
+		memFree(fs);
+		return NULL;
+	}
+	fs->diskname = arena_alloc(fs->arena, strlen(diskname) + 1);
+	strcpy(fs->diskname, diskname);
+	if ((flags & FS_MOUNT_WRITEBACK) && flusher_start(fs)) {
+		block_disk_close_ctx(fs->disk);
+		memFree(fs);
+		return NULL;
+	}
+
+	return fs;
+}
+
+fs_t *fs_mount_flags(const char *diskname, int flags)
+{
+	block_trace_set_op("fs_mount");
+	return mount_instance(diskname, flags, NULL, NULL);
+}
+
+fs_t *fs_mount_ctx(const char *diskname)
+{
+	return fs_mount_flags(diskname, 0);
+}
+
+int fs_format(const char *diskname, size_t data_blocks, size_t block_size, int flags)
+{
+	if (diskname == NULL || data_blocks == 0 || data_blocks > FS_DATA_BLOCK_MAX ||
+	    block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX || (block_size & (block_size - 1)) != 0) {
+		return -1;
+	}
+	// Superblock, one FAT entry per data block, root directory, then the data blocks
+	size_t fat_blocks = (data_blocks * sizeof(uint16_t) + block_size - 1) / block_size;
+	size_t root_blocks = (sizeof(struct RootDirectory) + block_size - 1) / block_size;
+	size_t total = 1 + fat_blocks + root_blocks + data_blocks;
+	if (block_disk_create(diskname, total, block_size, (flags & FS_FORMAT_PREALLOC) ? BLOCK_DISK_PREALLOC : 0)) {
+		return -1;
+	}
+	disk_t *disk = block_disk_open_ctx(diskname);
+	// Blocks smaller than the superblock only hold its first part
+	char *buf = calloc(1, block_size > sizeof(struct SuperBlock) ? block_size : sizeof(struct SuperBlock));
+	if (disk == NULL || buf == NULL || block_disk_set_block_size_ctx(disk, block_size)) {
+		if (disk != NULL) {
+			block_disk_close_ctx(disk);
+		}
+		free(buf);
+		return -1;
+	}
+	block_trace_set_op("fs_format");
+
+	struct SuperBlock *sb = (struct SuperBlock *)buf;
+	memcpy(sb->SIGNATURE, "ECS150FS", 8);
+	sb->TOTAL_BLOCKS_COUNTS = total;
+	sb->ROOT_DIRECTORY_BLOCK = 1 + fat_blocks;
+	sb->DATA_BLOCK = 1 + fat_blocks + root_blocks;
+	sb->DATA_BLOCK_COUNT = data_blocks;
+	sb->FAT_BLOCK_COUNT = fat_blocks;
+	// The default block size is left as 0, as in the images formatted before it was recorded
+	sb->BLOCK_SHIFT = block_size != BLOCK_SIZE ? __builtin_ctzl(block_size) : 0;
+	int ret = block_write_ctx(disk, 0, buf);
+
+	// Data block 0 is never allocated: its FAT entry is an end of chain
+	memset(buf, 0, block_size);
+	((uint16_t *)buf)[0] = FAT_EOC;
+	for (size_t i = 0; i < fat_blocks && ret == 0; i++) {
+		ret = block_write_ctx(disk, 1 + i, buf);
+		((uint16_t *)buf)[0] = 0;
+	}
+	// Empty root directory
+	for (size_t i = 0; i < root_blocks && ret == 0; i++) {
+		ret = block_write_ctx(disk, 1 + fat_blocks + i, buf);
+	}
+
+	free(buf);
+	if (block_disk_close_ctx(disk) || ret) {
+		return -1;
+	}
+	return 0;
+}
+
+int fs_umount_ctx(fs_t *fs)
+{
+	if (fs == NULL) {
+		return -1;
+	}
+	// if there are still open file descriptors
+	pthread_mutex_lock(&fs->lock);
+	if (fs->current_open_amount > 0 || fs->views > 0 || fs->borrowed > 0) { // A file (or snapshot, or span) is open somewhere. Cannot unmount successfully.
+		pthread_mutex_unlock(&fs->lock);
+		return -1;
+	}
+	// What the flusher did not write back yet, and deferred releases
+	flusher_stop(fs);
+	discard_flush(fs, 0, fs->super_block->DATA_BLOCK_COUNT - 1);
+	pthread_mutex_unlock(&fs->lock);
+
+	int closeFlag = block_disk_close_ctx(fs->disk);
+	if(closeFlag == -1){
+		return -1;
+	}
+	if (fs->snapshot_of != NULL) {
+		pthread_mutex_lock(&fs->snapshot_of->lock);
+		fs->snapshot_of->views--;
+		pthread_mutex_unlock(&fs->snapshot_of->lock);
+	}
+	int freeFlag = memFree(fs);
+	if(freeFlag != 0){
+		return -1;
+	}
+	return 0;
+}
+
+static int fs_info_locked(fs_t *fs, FILE *f)
+{
+	fprintf(f, "FS Info:\n");
+	fprintf(f, "total_blk_count=%d\n", fs->super_block->TOTAL_BLOCKS_COUNTS);
+	fprintf(f, "fat_blk_count=%d\n",fs->super_block->FAT_BLOCK_COUNT);
+	fprintf(f, "rdir_blk=%d\n",fs->super_block->ROOT_DIRECTORY_BLOCK);
+	fprintf(f, "data_blk=%d\n",fs->super_block->DATA_BLOCK);
+	fprintf(f, "data_blk_count=%d\n",fs->super_block->DATA_BLOCK_COUNT);
+	if (fs->block_size != BLOCK_SIZE) {
+		fprintf(f, "block_size=%zu\n", fs->block_size);
+	}
+	int fatFreeCounter = 0;
+	for(int i = 0; i < fs->super_block->DATA_BLOCK_COUNT; i++){
+		if(fs->FAT[i] == 0){
+			fatFreeCounter++;
+		}
+	}
+	int root_directory_free_size = 0;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		if(fs->root_directory->all_files[i].FILENAME[0] == '\0'){
+			root_directory_free_size++;
+		}
+	}
+	fprintf(f, "fat_free_ratio=%d/%d\n",fatFreeCounter,fs->super_block->DATA_BLOCK_COUNT);
+	fprintf(f, "rdir_free_ratio=%d/%d\n",root_directory_free_size,FS_FILE_MAX_COUNT);
+	return 0;
+}
+
+static int fs_create_locked(fs_t *fs, const char *filename)
+{
+	if(filename == NULL){
+		return -1;
+	}
+	int file_length = strlen(filename);
+	
+	if(file_length >= FS_FILENAME_LEN){
+		return -1;
+	}
+	// If file already exists
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (strcmp(filename, (char*)fs->root_directory->all_files[i].FILENAME) == 0) { 
+			return -1;
+		}
+	}
+
+	// If the root directory already contains FS_FILE_MAX_COUNT files
+	int root_directory_length = 0;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		if(fs->root_directory->all_files[i].FILENAME[0] != '\0'){
+			root_directory_length += 1;;
+		}
+	}
+	
+	if (root_directory_length >= FS_FILE_MAX_COUNT) {
+		return -1;
+	}
+	
+	int new_file_index = -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (fs->root_directory->all_files[i].FILENAME[0] == '\0') { // first available in rootdirectory
+			new_file_index = i;
+			break;
+		}
+	}
+	
+	memcpy(fs->root_directory->all_files[new_file_index].FILENAME, filename, file_length+1);
+	fs->root_directory->all_files[new_file_index].FILE_SIZE = 0;
+	fs->root_directory->all_files[new_file_index].FILE_FIRST_BLOCK = FAT_EOC;
+	fs->root_directory->all_files[new_file_index].FILE_FLAGS = (fs->flags & FS_MOUNT_COMPRESS) ? FILE_COMPRESSED : 0;
+	root_sync(fs);
+	if (fs->fat_dirty) {
+		fat_sync(fs);
+	}
+	return 0;
+}
+
+static int fs_delete_locked(fs_t *fs, const char *filename)
+{
+	int errFlag = -1;
+	if (filename == NULL) {
+		return -1;
+	}
+
+	// If file not exist
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (strcmp(filename, (char*)fs->root_directory->all_files[i].FILENAME) == 0) {
+			errFlag = 0;
+		}
+	}
+	if(errFlag == -1){
+		return -1;
+	}
+
+	int file_index = -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (strcmp((char*)fs->root_directory->all_files[i].FILENAME, filename) == 0) {
+			file_index = i;
+			break;
+		}
+	}
+	// If file is currently open
+	if (fs->open_files[file_index] != NULL) {
+		return -1;
+	}
+	uint16_t fat_index = fs->root_directory->all_files[file_index].FILE_FIRST_BLOCK;
+	uint16_t temp_fat_index;
+	// Stop sharing contents first, so that none of them is handed over to another block of the file
+	for (uint16_t i = fat_index; i != FAT_EOC; i = fat_next(fs, i)) {
+		dedup_unshare(fs, i);
+	}
+	int first_freed = fs->super_block->DATA_BLOCK_COUNT, last_freed = -1;
+	while (fat_index != FAT_EOC) {
+		temp_fat_index = fat_next(fs, fat_index);
+		dedup_release(fs, fat_index);
+		if (block_frozen(fs, fat_index) || block_pinned(fs, fat_index)) { // Kept for the snapshots and borrowers
+			block_keep(fs, fat_index);
+			fat_index = temp_fat_index;
+			continue;
+		}
+		fs->FAT[fat_index] = 0;
+		discard_mark(fs, fat_index);
+		if (fat_index < first_freed) {
+			first_freed = fat_index;
+		}
+		if (fat_index > last_freed) {
+			last_freed = fat_index;
+		}
+		fat_index = temp_fat_index;
+	}
+	fs->root_directory->all_files[file_index].FILENAME[0] = '\0';
+	fs->root_directory->all_files[file_index].FILE_SIZE = 0;
+	fs->root_directory->all_files[file_index].FILE_FIRST_BLOCK = FAT_EOC;
+	root_sync(fs);
+	dedup_sync(fs);
+	fat_sync(fs);
+	// Release the freed blocks now that the metadata no longer references them (a failure only leaks host storage)
+	if (!(fs->flags & FS_MOUNT_DEFER_DISCARD)) {
+		discard_flush(fs, first_freed, last_freed);
+	} else if (fs->discard_pending >= FS_DISCARD_BATCH) {
+		discard_flush(fs, 0, fs->super_block->DATA_BLOCK_COUNT - 1);
+	}
+	return 0;
+}
+
+static int fs_trim_locked(fs_t *fs)
+{
+	int free_count = 0;
+	for (int i = 0; i < fs->super_block->DATA_BLOCK_COUNT; i++) {
+		if (fs->FAT[i] == 0) {
+			discard_mark(fs, i);
+			free_count++;
+		}
+	}
+	if (discard_flush(fs, 0, fs->super_block->DATA_BLOCK_COUNT - 1)) {
+		return -1;
+	}
+	return free_count;
+}
+
+static int fs_clone_locked(fs_t *fs, const char *src, const char *dst)
+{
+	int src_entry = -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (strcmp((char*)fs->root_directory->all_files[i].FILENAME, src) == 0) {
+			src_entry = i;
+			break;
+		}
+	}
+	if (src_entry == -1) {
+		return -1;
+	}
+	struct file *src_file = &fs->root_directory->all_files[src_entry];
+
+	// The clone takes a data block for each block of the source, all sharing its contents
+	size_t count = 0;
+	for (uint16_t i = src_file->FILE_FIRST_BLOCK; i != FAT_EOC; i = fat_next(fs, i)) {
+		count++;
+	}
+	if (count > 0) {
+		// Free blocks kept for the copy-on-write of snapshots are not available, and the table of shared
+		// blocks may need its own
+		size_t needed = count + fs->snap_reserve, free_count = 0;
+		if (fs->super_block->DEDUP_BLOCK == 0) {
+			needed += fs->super_block->FAT_BLOCK_COUNT;
+		}
+		for (int i = 0; i < fs->super_block->DATA_BLOCK_COUNT && free_count < needed; i++) {
+			if (fs->FAT[i] == 0) {
+				free_count++;
+			}
+		}
+		if (free_count < needed) {
+			return -1;
+		}
+		if (fs->dedup_src == NULL && dedup_init(fs)) {
+			return -1;
+		}
+		if (dedup_table(fs)) {
+			return -1;
+		}
+	}
+
+	if (fs_create_locked(fs, dst)) {
+		return -1;
+	}
+	struct file *dst_file = NULL;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (strcmp((char*)fs->root_directory->all_files[i].FILENAME, dst) == 0) {
+			dst_file = &fs->root_directory->all_files[i];
+			break;
+		}
+	}
+	dst_file->FILE_FLAGS = src_file->FILE_FLAGS;
+
+	if (file_is_inline(src_file)) {
+		// Inline contents are copied in the pack block
+		int pack_offset = pack_reserve(fs, dst_file, src_file->FILE_SIZE);
+		if (pack_offset == -1) {
+			fs_delete_locked(fs, dst);
+			return -1;
+		}
+		memcpy(fs->pack + pack_offset, fs->pack + src_file->FILE_INLINE_OFFSET, src_file->FILE_SIZE);
+		dst_file->FILE_INLINE_OFFSET = pack_offset;
+		dst_file->FILE_SIZE = src_file->FILE_SIZE;
+		pack_sync(fs);
+		root_sync(fs);
+		if (fs->fat_dirty) {
+			fat_sync(fs);
+		}
+		return 0;
+	}
+
+	uint16_t last = FAT_EOC;
+	int run_start = -1, run_len = 0;
+	for (uint16_t i = src_file->FILE_FIRST_BLOCK; i != FAT_EOC; i = fat_next(fs, i)) {
+		int index = get_new_block_index(fs);
+		if (index == -1) { // The copy-on-write of metadata took blocks meanwhile: undo the partial clone
+			fs_delete_locked(fs, dst);
+			return -1;
+		}
+		int hole = fat_is_hole(fs, i);
+		fat_set(fs, index, FAT_EOC, hole);
+		if (last == FAT_EOC) {
+			dst_file->FILE_FIRST_BLOCK = index;
+		} else {
+			fat_set(fs, last, index, fat_is_hole(fs, last));
+		}
+		last = index;
+		if (hole) {
+			continue;
+		}
+		uint16_t source = block_source(fs, i);
+		fs->dedup_src[index] = source;
+		fs->dedup_refs[source]++;
+		// The new blocks hold no contents of their own: release their storage, by runs
+		if (run_start != -1 && index == run_start + run_len) {
+			run_len++;
+		} else {
+			if (run_start != -1) {
+				block_discard_ctx(fs->disk, fs->super_block->DATA_BLOCK + run_start, run_len);
+			}
+			run_start = index;
+			run_len = 1;
+		}
+	}
+	if (run_start != -1) {
+		block_discard_ctx(fs->disk, fs->super_block->DATA_BLOCK + run_start, run_len);
+	}
+	fs->dedup_dirty = 1;
+	dst_file->FILE_SIZE = src_file->FILE_SIZE;
+
+	root_sync(fs);
+	dedup_sync(fs);
+	fat_sync(fs);
+	return 0;
+}
+
+/**
+ *  snap_find() returns the entry of snapshot @name, or -1 if there is none.
+ */
+int snap_find(fs_t *fs, const char *name) {
+	if (fs->super_block->SNAP_BLOCK == 0) {
+		return -1;
+	}
+	for (size_t e = 0; e < FS_SNAPSHOT_MAX; e++) {
+		if (fs->snap_table[e].NAME[0] != '\0' && strcmp((char*)fs->snap_table[e].NAME, name) == 0) {
+			return e;
+		}
+	}
+	return -1;
+}
+
+static int fs_snapshot_create_locked(fs_t *fs, const char *name)
+{
+	size_t len = strlen(name);
+	// The table of snapshots, and the copies of the root directory, take a single block
+	if (fs->block_size < BLOCK_SIZE) {
+		return -1;
+	}
+	if (len == 0 || len >= FS_FILENAME_LEN || snap_find(fs, name) != -1 || snap_buffers(fs)) {
+		return -1;
+	}
+	int entry = -1;
+	for (size_t e = 0; e < FS_SNAPSHOT_MAX; e++) {
+		if (fs->super_block->SNAP_BLOCK == 0 || fs->snap_table[e].NAME[0] == '\0') {
+			entry = e;
+			break;
+		}
+	}
+	if (entry == -1) {
+		return -1;
+	}
+	if (fs->snap_fat_maps[entry] == NULL) {
+		fs->snap_fat_maps[entry] = arena_alloc(fs->arena, fs->block_size);
+		if (fs->snap_fat_maps[entry] == NULL) {
+			return -1;
+		}
+	}
+
+	// Room for the table, the FAT map, and the copy-on-write of all the metadata blocks. Like the copy of the
+	// FAT below, this is O(FAT size): at most 64 KiB of memory (see FS_DATA_BLOCK_MAX), and no data block.
+	int needed = (fs->super_block->SNAP_BLOCK == 0) + 1 + 1 + fs->super_block->FAT_BLOCK_COUNT +
+		     (fs->super_block->PACK_BLOCK != 0) + (fs->super_block->DEDUP_BLOCK != 0) * fs->super_block->FAT_BLOCK_COUNT;
+	int free_count = 0;
+	for (int i = 0; i < fs->super_block->DATA_BLOCK_COUNT && free_count < needed; i++) {
+		if (fs->FAT[i] == 0) {
+			free_count++;
+		}
+	}
+	if (free_count < needed) {
+		return -1;
+	}
+
+	if (fs->super_block->SNAP_BLOCK == 0) {
+		memset(fs->snap_table, 0, fs->block_size);
+		fs->super_block->SNAP_BLOCK = snap_alloc(fs);
+		block_write_ctx(fs->disk, 0, fs->super_block);
+	}
+	memset(fs->snap_fat_maps[entry], 0, fs->block_size);
+	int fat_map = snap_alloc(fs);
+	// The metadata left to the flusher is written, and the FAT as it is frozen (copying what changed for the
+	// previous snapshots)
+	meta_flush(fs);
+	fat_sync(fs);
+
+	struct snapshot *snap = &fs->snap_table[entry];
+	memcpy(snap->NAME, name, len + 1);
+	snap->SEQUENCE = fs->snap_sequence++;
+	snap->ROOT_COPY = 0;
+	snap->PACK_BLOCK = fs->super_block->PACK_BLOCK;
+	snap->DEDUP_BLOCK = fs->super_block->DEDUP_BLOCK;
+	snap->FAT_MAP = fat_map;
+	fs->snap_latest = entry;
+	memcpy(fs->fat_frozen, fs->FAT, fs->super_block->FAT_BLOCK_COUNT * fs->block_size);
+	memcpy(fs->root_frozen, fs->root_directory, sizeof(struct RootDirectory));
+	snap_reserve_update(fs);
+	fs->snap_dirty = 1;
+	snap_sync(fs);
+	return 0;
+}
+
+static int fs_snapshot_delete_locked(fs_t *fs, const char *name)
+{
+	int entry = snap_find(fs, name);
+	if (entry == -1 || fs->views > 0) {
+		return -1;
+	}
+	uint8_t *used = calloc(fs->super_block->DATA_BLOCK_COUNT / 8 + 1, 1);
+	uint16_t *fat = malloc(fs->super_block->FAT_BLOCK_COUNT * fs->block_size);
+	if (used == NULL || fat == NULL) {
+		free(used);
+		free(fat);
+		return -1;
+	}
+	// The copies of what changed since the latest snapshot are written before another one can take its place
+	meta_flush(fs);
+	memset(&fs->snap_table[entry], 0, sizeof(struct snapshot));
+	snap_freeze(fs);
+
+	// The blocks kept for snapshots that the remaining ones don't use are freed
+	for (size_t e = 0; e < FS_SNAPSHOT_MAX; e++) {
+		if (fs->snap_table[e].NAME[0] == '\0') {
+			continue;
+		}
+		snap_view(fs, e, fat, NULL);
+		for (int i = 0; i < fs->super_block->DATA_BLOCK_COUNT; i++) {
+			if (fat[i] != 0 && fat[i] != FAT_SNAP) {
+				used[i / 8] |= 1 << (i % 8);
+			}
+		}
+		uint16_t meta[] = { fs->super_block->SNAP_BLOCK, fs->snap_table[e].ROOT_COPY, fs->snap_table[e].FAT_MAP };
+		for (size_t i = 0; i < sizeof(meta) / sizeof(meta[0]); i++) {
+			used[meta[i] / 8] |= 1 << (meta[i] % 8);
+		}
+		for (int i = 0; i < fs->super_block->FAT_BLOCK_COUNT; i++) {
+			uint16_t copy = fs->snap_fat_maps[e][i];
+			used[copy / 8] |= 1 << (copy % 8);
+		}
+	}
+	int first_freed = fs->super_block->DATA_BLOCK_COUNT, last_freed = -1;
+	for (int i = 1; i < fs->super_block->DATA_BLOCK_COUNT; i++) {
+		if (fs->FAT[i] == FAT_SNAP && !(used[i / 8] & (1 << (i % 8)))) {
+			if (block_pinned(fs, i)) { // Freed with its last span
+				fs->pin_freed[i / 8] |= 1 << (i % 8);
+				continue;
+			}
+			fs->FAT[i] = 0;
+			discard_mark(fs, i);
+			if (i < first_freed) {
+				first_freed = i;
+			}
+			last_freed = i;
+		}
+	}
+	free(used);
+	free(fat);
+
+	if (fs->snap_latest == -1) { // No snapshot left: the table was freed too
+		fs->super_block->SNAP_BLOCK = 0;
+		block_write_ctx(fs->disk, 0, fs->super_block);
+	}
+	fs->snap_dirty = 1;
+	fat_sync(fs);
+	if (!(fs->flags & FS_MOUNT_DEFER_DISCARD)) {
+		discard_flush(fs, first_freed, last_freed);
+	} else if (fs->discard_pending >= FS_DISCARD_BATCH) {
+		discard_flush(fs, 0, fs->super_block->DATA_BLOCK_COUNT - 1);
+	}
+	return 0;
+}
+
+static int fs_ls_locked(fs_t *fs, FILE *f)
+{
+	fprintf(f, "FS Ls:\n");
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (fs->root_directory->all_files[i].FILENAME[0] != '\0') { // If filename is not empty, then print contents
+			fprintf(f, "file: %s, size: %d, data_blk: %d\n", fs->root_directory->all_files[i].FILENAME, 
+			fs->root_directory->all_files[i].FILE_SIZE ,fs->root_directory->all_files[i].FILE_FIRST_BLOCK);
+		}
+	}
+	return 0;
+}
+
+
+static int fs_open_locked(fs_t *fs, const char *filename, int flags)
+{
+	// filename invalid
+	int file_length = strlen(filename);
+	if (file_length >= FS_FILENAME_LEN) {
+		return -1;
+	}
+	// no filename to open
+	int entry = -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(strcmp((char*)fs->root_directory->all_files[i].FILENAME, filename) == 0){
+			entry = i;
+			break;
+		}
+	}
+	if(entry == -1){
+		return -1;
+	}
+
+	// Take a free descriptor, and share the open file object with the other descriptors of the file
+	int fd_table_index = alloc_desc(fs);
+	if (fd_table_index == -1) {
+		return -1;
+	}
+	struct open_file *file = get_open_file(fs, entry);
+	if (file == NULL) {
+		free_desc(fs, fd_table_index);
+		return -1;
+	}
+	// Read-only instances read without locks: the block map must be complete before the first read
+	if (fs->flags & FS_MOUNT_RDONLY) {
+		file_block(fs, file, 0, 0);
+		if (!file->map_loaded) {
+			put_open_file(fs, file);
+			free_desc(fs, fd_table_index);
+			return -1;
+		}
+	}
+	struct file_desc *temp_file_desc = &fs->fd_slabs[fd_table_index / FD_SLAB_SIZE][fd_table_index % FD_SLAB_SIZE];
+	temp_file_desc->file = file;
+	temp_file_desc->offset = 0;
+	temp_file_desc->flags = flags;
+	temp_file_desc->advice = FS_ADVISE_NORMAL;
+	temp_file_desc->noreuse = 0;
+	temp_file_desc->ra_prev = 0;
+	temp_file_desc->ra_next = 0;
+	temp_file_desc->ra_window = 0;
+	fs->current_open_amount++;
+
+	return fd_table_index;
+}
+
+static int fs_close_locked(fs_t *fs, int fd)
+{
+	// fd invalid out of bounds, or not currently open
+	struct file_desc *desc = get_desc(fs, fd);
+	if(desc == NULL){
+		return -1;
+	}
+	// file close
+	put_open_file(fs, desc->file);
+	free_desc(fs, fd);
+	// open amount--
+	fs->current_open_amount--;
+	return 0;
+}
+
+static int fs_stat_locked(fs_t *fs, int fd)
+{
+	// fd invalid out of bounds, or not currently open
+	struct file_desc *desc = get_desc(fs, fd);
+	if(desc == NULL){
+		return -1;
+	}
+	uint32_t cur_file_size;
+	cur_file_size = desc->file->cur_file->FILE_SIZE;
+	return cur_file_size;
+}
+
+static int fs_lseek_locked(fs_t *fs, int fd, size_t offset)
+{
+	// fd invalid out of bounds, or not currently open
+	struct file_desc *desc = get_desc(fs, fd);
+	if(desc == NULL){
+		return -1;
+	}
+	// Past the end of file, the skipped blocks become holes on the next write. They still take
+	// a data block each in the chain, so the offset must stay within the data blocks (but block 0,
+	// which is never allocated).
+	if(offset > desc->file->cur_file->FILE_SIZE &&
+	   BLOCK_OF(fs, offset) >= fs->super_block->DATA_BLOCK_COUNT - 1){
+		return -1;
+	}
+	// set the file offset
+	desc->offset = offset;
+	return 0;
+}
+
+/*
+ * fs_write_extents() and fs_read_extents() transfer data of compressed files, extent by extent.
+ */
+static int fs_write_extents(fs_t *fs, struct file_desc *cur_file_desc, void *buf, size_t count) {
+	struct open_file *file = cur_file_desc->file;
+	struct file *cur_file = file->cur_file;
+	size_t old_size = cur_file->FILE_SIZE;
+	size_t offset = cur_file_desc->offset;
+	size_t new_size = offset + count > old_size ? offset + count : old_size;
+	if (extent_buffers(fs, file)) {
+		return 0;
+	}
+
+	size_t written = 0;
+	for (size_t x = offset / EXTENT_SIZE(fs); x <= (offset + count - 1) / EXTENT_SIZE(fs); x++) {
+		size_t start = x * EXTENT_SIZE(fs);
+		size_t lo = offset > start ? offset - start : 0;
+		size_t hi = offset + count < start + EXTENT_SIZE(fs) ? offset + count - start : EXTENT_SIZE(fs);
+		// Start from the current contents, unless they are all overwritten
+		if (start >= old_size) {
+			memset(file->ext_data, 0, EXTENT_SIZE(fs));
+		} else if ((lo > 0 || hi < EXTENT_SIZE(fs)) && extent_load(fs, file, x, old_size)) {
+			break;
+		}
+		file->ext_cached = -1;
+		memcpy(file->ext_data + lo, (char *)buf + written, hi - lo);
+		if (extent_store(fs, file, x, new_size - start < EXTENT_SIZE(fs) ? new_size - start : EXTENT_SIZE(fs))) {
+			break;
+		}
+		file->ext_cached = x;
+		written += hi - lo;
+	}
+
+	// A partial last extent that the file grew past keeps its number of blocks: store it again in full
+	size_t last = old_size / EXTENT_SIZE(fs);
+	if (written > 0 && old_size % EXTENT_SIZE(fs) != 0 && last < offset / EXTENT_SIZE(fs) &&
+	    extent_load(fs, file, last, old_size) == 0) {
+		extent_store(fs, file, last, EXTENT_SIZE(fs));
+		file->ext_cached = -1;
+	}
+
+	cur_file_desc->offset += written;
+	if (written > 0 && cur_file->FILE_SIZE < cur_file_desc->offset) {
+		cur_file->FILE_SIZE = cur_file_desc->offset;
+	}
+	meta_sync(fs);
+	return written;
+}
+
+static int fs_read_extents(fs_t *fs, struct file_desc *cur_file_desc, void *buf, size_t count) {
+	struct open_file *file = cur_file_desc->file;
+	size_t size = file->cur_file->FILE_SIZE;
+	if (extent_buffers(fs, file)) {
+		return 0;
+	}
+
+	size_t done = 0;
+	char *bounce = arena_buf_get(fs->arena);
+	while (done < count) {
+		size_t x = cur_file_desc->offset / EXTENT_SIZE(fs);
+		size_t lo = cur_file_desc->offset % EXTENT_SIZE(fs);
+		size_t len = EXTENT_SIZE(fs) - lo < count - done ? EXTENT_SIZE(fs) - lo : count - done;
+		size_t n = extent_slots(fs, size, x);
+		if (file->ext_cached != (long)x && extent_stored(fs, file, x, n) == n) {
+			// Stored as is: only read the blocks of the range
+			size_t pos = 0;
+			while (pos < len) {
+				size_t block_offset = BLOCK_OFF(fs, lo + pos);
+				size_t part = fs->block_size - block_offset < len - pos ? fs->block_size - block_offset : len - pos;
+				int data_index = block_source(fs, file_block(fs, file, BLOCK_OF(fs, cur_file_desc->offset + pos), 0));
+				if (part == fs->block_size) {
+					block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, (char *)buf + done + pos);
+				} else {
+					block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, bounce);
+					memcpy((char *)buf + done + pos, bounce + block_offset, part);
+				}
+				pos += part;
+			}
+		} else if (extent_load(fs, file, x, size) == 0) {
+			memcpy((char *)buf + done, file->ext_data + lo, len);
+		} else {
+			break;
+		}
+		cur_file_desc->offset += len;
+		done += len;
+	}
+	arena_buf_put(fs->arena, bounce);
+	return done;
+}
+
+/*
+ * fs_write_locked() and fs_read_locked() are called with the lock of the open file of
+ * @cur_file_desc held. Writes also hold the instance lock, since they allocate blocks.
+ */
+/*
+ * fs_append_locked() appends to a file opened with FS_O_APPEND that has data blocks. The partial last block
+ * stays in memory once loaded, so that it is written without being read back, and only the FAT blocks of
+ * the links that changed are written.
+ */
+static int fs_append_locked(fs_t *fs, struct file_desc *cur_file_desc, void *buf, size_t count) {
+	struct open_file *file = cur_file_desc->file;
+	struct file *cur_file = file->cur_file;
+	size_t size = cur_file->FILE_SIZE;
+
+	if (file->tail == NULL) {
+		file->tail = malloc(fs->block_size);
+		if (file->tail == NULL) {
+			return 0;
+		}
+	}
+	// FAT entries that may change: the one of the last block (relocated or turned from a hole), and the
+	// ones of the blocks linked after it
+	int last_index = file_block(fs, file, BLOCK_OF(fs, size - 1), 0);
+	if (last_index == -1) {
+		return 0;
+	}
+	uint16_t fat_first = last_index & ~FAT_HOLE, fat_last = fat_first;
+	size_t linked = BLOCK_OF(fs, size - 1);
+
+	size_t buffer_offset = 0;
+	while (buffer_offset < count) {
+		size_t block_num = BLOCK_OF(fs, size);
+		size_t block_offset = BLOCK_OFF(fs, size);
+		size_t block_left = fs->block_size - block_offset;
+		if (block_left > count - buffer_offset) {
+			block_left = count - buffer_offset;
+		}
+
+		if (block_left == fs->block_size) {
+			// Whole blocks are written from the user buffer, with one request per run of consecutive blocks
+			int data_index = file_block(fs, file, block_num, 1);
+			if (data_index == -1) {
+				break;
+			}
+			size_t run = 1;
+			while ((run + 1) * fs->block_size <= count - buffer_offset &&
+			       file_block(fs, file, block_num + run, 1) == data_index + (int)run) {
+				run++;
+			}
+			for (size_t i = 0; i < run; i++) {
+				dedup_release(fs, data_index + i);
+			}
+			block_write_many_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, run, buf + buffer_offset);
+			data_dirty(fs, data_index, run);
+			block_left = run * fs->block_size;
+		} else {
+			// The rest of the last block is zeros: only its data has to be loaded, and only once
+			if (file->tail_block != (long)block_num) {
+				int source = block_offset > 0 ? block_source(fs, file_block(fs, file, block_num, 0)) : -1;
+				if (source != -1 && !(source & FAT_HOLE)) {
+					block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + source, file->tail);
+				} else {
+					memset(file->tail, 0, block_offset);
+				}
+				memset(file->tail + block_offset, 0, fs->block_size - block_offset);
+				file->tail_block = block_num;
+			}
+			int data_index = file_block(fs, file, block_num, 1);
+			if (data_index == -1) {
+				break;
+			}
+			memcpy(file->tail + block_offset, buf + buffer_offset, block_left);
+			dedup_release(fs, data_index);
+			block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, file->tail);
+			data_dirty(fs, data_index, 1);
+		}
+		size += block_left;
+		buffer_offset += block_left;
+	}
+
+	cur_file_desc->offset = size;
+	if (buffer_offset == 0) {
+		return 0;
+	}
+	cur_file->FILE_SIZE = size;
+	if (fs->flusher != NULL) {
+		meta_sync(fs);
+		return buffer_offset;
+	}
+	for (size_t i = linked; i < file->map_len; i++) {
+		uint16_t index = file->block_map[i] & ~FAT_HOLE;
+		fat_first = index < fat_first ? index : fat_first;
+		fat_last = index > fat_last ? index : fat_last;
+	}
+	root_sync(fs);
+	dedup_sync(fs);
+	fat_sync_range(fs, fat_first, fat_last);
+
+	return buffer_offset;
+}
+
+static int fs_write_locked(fs_t *fs, struct file_desc *cur_file_desc, void *buf, size_t count) {
+	if (count == 0) {
+		return 0;
+	}
+
+	struct open_file *file = cur_file_desc->file;
+	struct file *cur_file = file->cur_file;
+	if (cur_file_desc->flags & FS_O_APPEND) {
+		cur_file_desc->offset = cur_file->FILE_SIZE;
+		if (cur_file->FILE_SIZE > 0 && cur_file->FILE_FIRST_BLOCK != FAT_EOC &&
+		    !(cur_file->FILE_FLAGS & FILE_COMPRESSED) && !(fs->flags & FS_MOUNT_DEDUP)) {
+			return fs_append_locked(fs, cur_file_desc, buf, count);
+		}
+	}
+	file->tail_block = -1; // Other writes may change the last block
+	size_t old_size = cur_file->FILE_SIZE;
+
+	// Small files live in the pack block, as long as they fit in it
+	size_t new_size = cur_file_desc->offset + count > old_size ? cur_file_desc->offset + count : old_size;
+	if (cur_file->FILE_FIRST_BLOCK == FAT_EOC && new_size <= INLINE_MAX) {
+		int pack_offset = pack_reserve(fs, cur_file, new_size);
+		if (pack_offset != -1) {
+			char *contents = fs->pack + pack_offset;
+			if (cur_file_desc->offset > old_size) {
+				memset(contents + old_size, 0, cur_file_desc->offset - old_size);
+			}
+			memcpy(contents + cur_file_desc->offset, buf, count);
+			cur_file->FILE_INLINE_OFFSET = pack_offset;
+			cur_file->FILE_SIZE = new_size;
+			cur_file_desc->offset += count;
+			if (fs->flusher != NULL) {
+				fs->flusher->pack_dirty = 1;
+				meta_sync(fs);
+				return count;
+			}
+			pack_sync(fs);
+			root_sync(fs);
+			if (fs->fat_dirty) {
+				fat_sync(fs);
+			}
+			return count;
+		}
+	}
+
+	char* bounce = arena_buf_get(fs->arena);
+
+	// Inline contents that outgrow the pack block move to a regular first block
+	if (file_is_inline(cur_file)) {
+		memcpy(bounce, fs->pack + cur_file->FILE_INLINE_OFFSET, old_size);
+		memset(bounce + old_size, 0, fs->block_size - old_size);
+		int first_index = file_block(fs, file, 0, 1);
+		if (first_index == -1) {
+			arena_buf_put(fs->arena, bounce);
+			return 0;
+		}
+		block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + first_index, bounce);
+		data_dirty(fs, first_index, 1);
+	}
+
+	if (cur_file->FILE_FLAGS & FILE_COMPRESSED) {
+		arena_buf_put(fs->arena, bounce);
+		return fs_write_extents(fs, cur_file_desc, buf, count);
+	}
+
+	// When writing past the last block, the rest of that block becomes part of the file and must read as zeros
+	if (BLOCK_OF(fs, cur_file_desc->offset) > BLOCK_OF(fs, old_size) && BLOCK_OFF(fs, old_size) != 0) {
+		int last_index = file_block(fs, file, BLOCK_OF(fs, old_size), 0);
+		if (last_index != -1 && !(last_index & FAT_HOLE)) {
+			block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + block_source(fs, last_index), bounce);
+			memset(bounce + BLOCK_OFF(fs, old_size), 0, fs->block_size - BLOCK_OFF(fs, old_size));
+			last_index = file_block(fs, file, BLOCK_OF(fs, old_size), 1);
+		}
+		if (last_index != -1 && !(last_index & FAT_HOLE)) {
+			dedup_release(fs, last_index);
+			block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + last_index, bounce);
+			data_dirty(fs, last_index, 1);
+		}
+	}
+
+	size_t buffer_offset = 0; // Keep track of how much of the buffer we already wrote into disk
+	while (buffer_offset < count) {
+		size_t block_num = BLOCK_OF(fs, cur_file_desc->offset);
+		int block_offset = BLOCK_OFF(fs, cur_file_desc->offset); // We know how far in we are into this block
+		size_t block_left = fs->block_size - block_offset;
+		if (block_left > count - buffer_offset) {
+			block_left = count - buffer_offset;
+		}
+
+		// Bytes of the block that hold file data so far (none past the end of file, or in a hole)
+		size_t valid = 0;
+		int data_index = file_block(fs, file, block_num, 0);
+		if (data_index != -1 && !(data_index & FAT_HOLE) && block_num * fs->block_size < old_size) {
+			valid = old_size - block_num * fs->block_size;
+			if (valid > fs->block_size) {
+				valid = fs->block_size;
+			}
+		}
+		// Allocate the block (and link it in the FAT) if the file doesn't reach it yet. The data to preserve
+		// is read from where it is now, since the block may be replaced.
+		int source = block_source(fs, data_index);
+		data_index = file_block(fs, file, block_num, 1);
+		if (data_index == -1) {
+			break; // No more blocks available: we wrote as much as possible
+		}
+
+		int dedup = fs->flags & FS_MOUNT_DEDUP;
+		if (block_left == fs->block_size && dedup && dedup_share(fs, data_index, buf + buffer_offset) == 0) {
+			// Same contents as a block already on disk: nothing to write
+		} else if (block_left == fs->block_size) {
+			// Whole blocks are written from the user buffer, with one request per run of consecutive blocks
+			// (up to the next one that may be a duplicate)
+			size_t run = 1;
+			while ((run + 1) * fs->block_size <= count - buffer_offset &&
+			       file_block(fs, file, BLOCK_OF(fs, cur_file_desc->offset) + run, 1) == data_index + (int)run &&
+			       !(dedup && dedup_lookup(fs, buf + buffer_offset + run * fs->block_size))) {
+				run++;
+			}
+			for (size_t i = 0; i < run; i++) {
+				dedup_release(fs, data_index + i);
+			}
+			block_write_many_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, run, buf + buffer_offset);
+			data_dirty(fs, data_index, run);
+			for (size_t i = 0; dedup && i < run; i++) {
+				dedup_index(fs, data_index + i, dedup_hash_block(fs, buf + buffer_offset + i * fs->block_size));
+			}
+			block_left = run * fs->block_size;
+		} else {
+			// Read-modify-write, unless there is no data to preserve
+			if (valid > 0) {
+				block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + source, bounce);
+			}
+			memset(bounce + valid, 0, fs->block_size - valid);
+			memcpy(bounce + block_offset, buf + buffer_offset, block_left);
+			dedup_release(fs, data_index);
+			block_write_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, bounce);
+			data_dirty(fs, data_index, 1);
+		}
+		cur_file_desc->offset += block_left;
+		buffer_offset += block_left;
+	}
+	arena_buf_put(fs->arena, bounce);
+
+	if (buffer_offset > 0 && cur_file->FILE_SIZE < cur_file_desc->offset) {
+		cur_file->FILE_SIZE = cur_file_desc->offset;
+	}
+	meta_sync(fs);
+
+	return buffer_offset;
+}
+
+static int fs_read_locked(fs_t *fs, struct file_desc *cur_file_desc, void *buf, size_t count)
+{
+	struct open_file *file = cur_file_desc->file;
+	struct file *cur_file = file->cur_file;
+	size_t remaining_to_read = 0;
+	if (cur_file_desc->offset >= cur_file->FILE_SIZE) { // Nothing to read (the offset may be past the end of file)
+		return 0;
+	}
+	size_t offset_subtractor = cur_file->FILE_SIZE - cur_file_desc->offset;
+	if (offset_subtractor < count) {
+		remaining_to_read = offset_subtractor;
+	}
+	else {
+		remaining_to_read = count;
+	}
+	if (remaining_to_read == 0) {
+		return 0;
+	}
+	if (cur_file->FILE_FLAGS & FILE_COMPRESSED) {
+		return fs_read_extents(fs, cur_file_desc, buf, remaining_to_read);
+	}
+
+	int data_index = block_source(fs, file_block(fs, file, BLOCK_OF(fs, cur_file_desc->offset), 0));
+	char* bounce = arena_buf_get(fs->arena);
+	size_t buffer_offset = 0; // We are adding data in pieces, so we need to keep track of beginning of buffer
+	while (remaining_to_read > 0 && data_index != -1) { // Loop until we have no more bytes to read
+		int block_offset = BLOCK_OFF(fs, cur_file_desc->offset); // Shows how far in we are into the block
+		size_t block_left = fs->block_size - block_offset;
+		if (block_left > remaining_to_read) { // We extract part of the block (where offset is in the middle, count is the end)
+			block_left = remaining_to_read;
+		}
+
+		if (data_index & FAT_HOLE) { // Holes read as zeros, without any disk access
+			memset(buf + buffer_offset, 0, block_left);
+		} else if (block_left == fs->block_size) { // We're reading whole blocks (IDEAL CASE): no need for the bounce buffer
+			// One request per run of consecutive blocks
+			size_t run = 1;
+			while ((run + 1) * fs->block_size <= remaining_to_read &&
+			       block_source(fs, file_block(fs, file, BLOCK_OF(fs, cur_file_desc->offset) + run, 0)) == data_index + (int)run) {
+				run++;
+			}
+			block_read_many_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, run, buf + buffer_offset);
+			block_left = run * fs->block_size;
+		} else {
+			block_read_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, bounce);
+			memcpy(buf + buffer_offset, bounce + block_offset, block_left);
+		}
+		cur_file_desc->offset += block_left;
+		buffer_offset += block_left;
+		remaining_to_read -= block_left;
+
+		if (remaining_to_read > 0) {
+			data_index = block_source(fs, file_block(fs, file, BLOCK_OF(fs, cur_file_desc->offset), 0));
+		}
+	}
+	arena_buf_put(fs->arena, bounce);
+
+	return buffer_offset;
+}
+
+/*
+ * fs_read_shared() reads from an instance mounted with FS_MOUNT_RDONLY, whose metadata, block maps and data never
+ * change: the data is copied from the mapping of the image, without taking any lock.
+ */
+static int fs_read_shared(fs_t *fs, struct file_desc *cur_file_desc, void *buf, size_t count)
+{
+	struct open_file *file = cur_file_desc->file;
+	struct file *cur_file = file->cur_file;
+	size_t offset = cur_file_desc->offset;
+	if (offset >= cur_file->FILE_SIZE) {
+		return 0;
+	}
+	if (count > cur_file->FILE_SIZE - offset) {
+		count = cur_file->FILE_SIZE - offset;
+	}
+	if (file_is_inline(cur_file)) {
+		memcpy(buf, fs->pack + cur_file->FILE_INLINE_OFFSET + offset, count);
+		cur_file_desc->offset += count;
+		return count;
+	}
+
+	size_t buffer_offset = 0;
+	while (buffer_offset < count) {
+		size_t block_num = BLOCK_OF(fs, offset + buffer_offset);
+		size_t block_offset = BLOCK_OFF(fs, offset + buffer_offset);
+		size_t block_left = fs->block_size - block_offset;
+		if (block_left > count - buffer_offset) {
+			block_left = count - buffer_offset;
+		}
+		int data_index = block_num < file->map_len ? block_source(fs, file->block_map[block_num]) : -1;
+		const char *data = NULL;
+		if (data_index == -1 || (data_index & FAT_HOLE)) {
+			memset(buf + buffer_offset, 0, block_left);
+		} else if ((data = block_map_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index)) != NULL) {
+			memcpy(buf + buffer_offset, data + block_offset, block_left);
+		} else {
+			break;
+		}
+		buffer_offset += block_left;
+	}
+	cur_file_desc->offset += buffer_offset;
+
+	return buffer_offset;
+}
+
+/**
+ *  pin_buffers() allocates the borrow counts of the data blocks on first use.
+ */
+int pin_buffers(fs_t *fs) {
+	if (fs->pins != NULL) {
+		return 0;
+	}
+	uint8_t *pin_freed = arena_alloc(fs->arena, fs->super_block->DATA_BLOCK_COUNT / 8 + 1);
+	uint16_t *pins = arena_alloc(fs->arena, fs->super_block->DATA_BLOCK_COUNT * sizeof(uint16_t));
+	if (pin_freed == NULL || pins == NULL) {
+		return -1;
+	}
+	fs->pin_freed = pin_freed;
+	fs->pins = pins;
+	return 0;
+}
+
+/**
+ *  lent_bucket() returns the bucket of the lent parts of spans at address @addr.
+ */
+struct lent_span **lent_bucket(fs_t *fs, const char *addr) {
+	return &fs->lent[((uintptr_t)addr >> 4) * 0x9e3779b97f4a7c15ULL >> 56];
+}
+
+/**
+ *  lent_record() records that @len bytes at @addr are lent: data block @data_index, or if it is -1, the
+ *	copy at @copy. Returns -1 if there is no memory for the record.
+ */
+int lent_record(fs_t *fs, const char *addr, size_t len, int data_index, char *copy) {
+	struct lent_span *lent = malloc(sizeof(*lent));
+	if (lent == NULL) {
+		return -1;
+	}
+	struct lent_span **bucket = lent_bucket(fs, addr);
+	lent->addr = addr;
+	lent->len = len;
+	lent->data_index = data_index;
+	lent->copy = copy;
+	lent->next = *bucket;
+	*bucket = lent;
+	return 0;
+}
+
+/**
+ *  lent_take() removes the record of the part lent at @addr that is at most @room bytes long, and returns
+ *	it (NULL if nothing is lent there). Parts of the same block lent by several spans share their address:
+ *	the longest one that fits is that of the span released, since only the last part of a span is short.
+ */
+struct lent_span *lent_take(fs_t *fs, const char *addr, size_t room) {
+	struct lent_span **best = NULL;
+	for (struct lent_span **l = lent_bucket(fs, addr); *l != NULL; l = &(*l)->next) {
+		if ((*l)->addr == addr && (*l)->len <= room && (best == NULL || (*l)->len > (*best)->len)) {
+			best = l;
+		}
+	}
+	if (best == NULL) {
+		return NULL;
+	}
+	struct lent_span *lent = *best;
+	*best = lent->next;
+	return lent;
+}
+
+/**
+ *  pin_put() releases a borrowed span of data block @index. Returns 1 if that frees the block (it was
+ *	freed while borrowed), 0 otherwise.
+ */
+int pin_put(fs_t *fs, uint16_t index) {
+	fs->borrowed--;
+	if (--fs->pins[index] != 0 || !(fs->pin_freed[index / 8] & (1 << (index % 8)))) {
+		return 0;
+	}
+	fs->pin_freed[index / 8] &= ~(1 << (index % 8));
+	fs->FAT[index] = 0;
+	discard_mark(fs, index);
+	return 1;
+}
+
+static int fs_read_map_locked(fs_t *fs, struct file_desc *cur_file_desc, struct iovec *iov, int iovcnt, size_t count)
+{
+	struct open_file *file = cur_file_desc->file;
+	struct file *cur_file = file->cur_file;
+	if (pin_buffers(fs)) {
+		return -1;
+	}
+	int spans = 0;
+	while (spans < iovcnt && count > 0 && cur_file_desc->offset < cur_file->FILE_SIZE) {
+		size_t block_offset = BLOCK_OFF(fs, cur_file_desc->offset);
+		size_t len = fs->block_size - block_offset;
+		if (len > count) {
+			len = count;
+		}
+		if (len > cur_file->FILE_SIZE - cur_file_desc->offset) {
+			len = cur_file->FILE_SIZE - cur_file_desc->offset;
+		}
+
+		char *span;
+		if (file_is_inline(cur_file) || (cur_file->FILE_FLAGS & FILE_COMPRESSED)) {
+			// Contents not stored as is on disk: lend a copy
+			char *copy = arena_buf_get(fs->arena);
+			if (copy == NULL) {
+				break;
+			}
+			span = copy + block_offset;
+			if (lent_record(fs, span, len, -1, copy)) {
+				arena_buf_put(fs->arena, copy);
+				break;
+			}
+			if (file_is_inline(cur_file)) {
+				memcpy(span, fs->pack + cur_file->FILE_INLINE_OFFSET + cur_file_desc->offset, len);
+				cur_file_desc->offset += len;
+			} else if (fs_read_locked(fs, cur_file_desc, span, len) != (int)len) {
+				free(lent_take(fs, span, len));
+				arena_buf_put(fs->arena, copy);
+				break;
+			}
+			fs->borrowed++;
+		} else {
+			int data_index = block_source(fs, file_block(fs, file, BLOCK_OF(fs, cur_file_desc->offset), 0));
+			if (data_index == -1) {
+				break;
+			}
+			if (data_index & FAT_HOLE) {
+				span = (char*)zero_block + block_offset;
+			} else {
+				const char *block = block_map_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index);
+				if (block == NULL || fs->pins[data_index] == UINT16_MAX) {
+					break;
+				}
+				span = (char*)block + block_offset;
+				if (lent_record(fs, span, len, data_index, NULL)) {
+					break;
+				}
+				fs->pins[data_index]++;
+				fs->borrowed++;
+			}
+			cur_file_desc->offset += len;
+		}
+		count -= len;
+
+		// Consecutive blocks of memory make a single span
+		if (spans > 0 && (char*)iov[spans - 1].iov_base + iov[spans - 1].iov_len == span) {
+			iov[spans - 1].iov_len += len;
+		} else {
+			iov[spans].iov_base = span;
+			iov[spans].iov_len = len;
+			spans++;
+		}
+	}
+	return spans;
+}
+
+static int fs_read_release_locked(fs_t *fs, const struct iovec *iov, int iovcnt)
+{
+	int first_freed = fs->super_block->DATA_BLOCK_COUNT, last_freed = -1;
+	int ret = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		const char *end = (char*)iov[i].iov_base + iov[i].iov_len;
+		// Spans are made of the parts recorded when they were lent, one after the other
+		for (const char *p = iov[i].iov_base; p < end; ) {
+			if (p >= zero_block && p < zero_block + sizeof(zero_block)) {
+				break; // Hole: nothing else lies next to it in memory
+			}
+			struct lent_span *lent = lent_take(fs, p, end - p);
+			if (lent == NULL) {
+				ret = -1; // Not borrowed
+				break;
+			}
+			int data_index = lent->data_index;
+			p += lent->len;
+			if (data_index == -1) { // Lent copy
+				arena_buf_put(fs->arena, lent->copy);
+				fs->borrowed--;
+				free(lent);
+				continue;
+			}
+			free(lent);
+			if (pin_put(fs, data_index)) {
+				if (data_index < first_freed) {
+					first_freed = data_index;
+				}
+				if (data_index > last_freed) {
+					last_freed = data_index;
+				}
+			}
+		}
+	}
+	if (last_freed != -1) {
+		fat_sync(fs);
+		if (!(fs->flags & FS_MOUNT_DEFER_DISCARD)) {
+			discard_flush(fs, first_freed, last_freed);
+		} else if (fs->discard_pending >= FS_DISCARD_BATCH) {
+			discard_flush(fs, 0, fs->super_block->DATA_BLOCK_COUNT - 1);
+		}
+	}
+	return ret;
+}
+
+/**
+ *  fd_write() writes the @len bytes of @buf into host file descriptor @fd. Returns -1 if it fails.
+ */
+int fd_write(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret <= 0) {
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ *  fd_read() reads up to @len bytes from host file descriptor @fd into @buf, stopping early only at
+ *	its end. Returns the number of bytes read, -1 if it fails.
+ */
+long fd_read(int fd, char *buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t ret = read(fd, buf + done, len - done);
+		if (ret < 0) {
+			return done > 0 ? (long)done : -1;
+		}
+		if (ret == 0) {
+			break;
+		}
+		done += ret;
+	}
+	return done;
+}
+
+static int fs_copy_to_fd_locked(fs_t *fs, struct open_file *file, size_t offset, size_t count, int host_fd)
+{
+	struct file *cur_file = file->cur_file;
+	if (offset >= cur_file->FILE_SIZE) {
+		return 0;
+	}
+	if (count > cur_file->FILE_SIZE - offset) {
+		count = cur_file->FILE_SIZE - offset;
+	}
+	if (file_is_inline(cur_file)) {
+		return fd_write(host_fd, fs->pack + cur_file->FILE_INLINE_OFFSET + offset, count) ? -1 : (int)count;
+	}
+
+	size_t done = 0;
+	if (cur_file->FILE_FLAGS & FILE_COMPRESSED) {
+		// Contents are decompressed on the way
+		struct file_desc desc = { .file = file, .offset = offset };
+		char *bounce = arena_buf_get(fs->arena);
+		while (done < count) {
+			int ret = fs_read_locked(fs, &desc, bounce, count - done < fs->block_size ? count - done : fs->block_size);
+			if (ret <= 0 || fd_write(host_fd, bounce, ret)) {
+				break;
+			}
+			done += ret;
+		}
+		arena_buf_put(fs->arena, bounce);
+		return done > 0 ? (int)done : -1;
+	}
+
+	while (done < count) {
+		size_t pos = offset + done;
+		size_t block_offset = BLOCK_OFF(fs, pos);
+		size_t len = fs->block_size - block_offset < count - done ? fs->block_size - block_offset : count - done;
+		int data_index = block_source(fs, file_block(fs, file, BLOCK_OF(fs, pos), 0));
+		if (data_index == -1) {
+			break;
+		}
+		if (data_index & FAT_HOLE) {
+			if (fd_write(host_fd, zero_block, len)) {
+				break;
+			}
+			done += len;
+			continue;
+		}
+		// One copy per run of consecutive blocks, that the host carries out by itself
+		while (done + len < count &&
+		       block_source(fs, file_block(fs, file, BLOCK_OF(fs, pos + len), 0)) ==
+		       data_index + (int)BLOCK_OF(fs, block_offset + len)) {
+			len += fs->block_size < count - done - len ? fs->block_size : count - done - len;
+		}
+		long ret = block_copy_to_fd_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, block_offset, len, host_fd);
+		if (ret <= 0) {
+			break;
+		}
+		done += ret;
+		if ((size_t)ret < len) {
+			break;
+		}
+	}
+	return done > 0 ? (int)done : -1;
+}
+
+static int fs_copy_from_fd_locked(fs_t *fs, struct open_file *file, size_t offset, size_t count, int host_fd,
+				  int host_file, char *buf)
+{
+	struct file *cur_file = file->cur_file;
+	struct file_desc desc = { .file = file, .offset = offset };
+	// Whole blocks of files stored as is go from host files to the disk within the host. The contents of
+	// the other ones go through @buf (an extent), to be compressed or matched with shared blocks.
+	int direct = host_file && !(cur_file->FILE_FLAGS & FILE_COMPRESSED) && !(fs->flags & FS_MOUNT_DEDUP);
+	int synced = 1;
+	size_t done = 0;
+	file->tail_block = -1;
+	while (done < count) {
+		size_t len = count - done;
+		if (direct && BLOCK_OFF(fs, desc.offset) == 0 && len >= fs->block_size && desc.offset <= cur_file->FILE_SIZE &&
+		    !file_is_inline(cur_file)) {
+			size_t block_num = BLOCK_OF(fs, desc.offset);
+			int data_index = file_block(fs, file, block_num, 1);
+			if (data_index == -1) {
+				break; // No more blocks available
+			}
+			size_t run = 1;
+			while ((run + 1) * fs->block_size <= len && file_block(fs, file, block_num + run, 1) == data_index + (int)run) {
+				run++;
+			}
+			for (size_t i = 0; i < run; i++) {
+				dedup_release(fs, data_index + i);
+			}
+			synced = 0;
+			long ret = block_copy_from_fd_ctx(fs->disk, fs->super_block->DATA_BLOCK + data_index, run, host_fd);
+			data_dirty(fs, data_index, run);
+			if (ret <= 0) {
+				break;
+			}
+			desc.offset += ret;
+			done += ret;
+			if (cur_file->FILE_SIZE < desc.offset) {
+				cur_file->FILE_SIZE = desc.offset;
+			}
+			if ((size_t)ret < run * fs->block_size) {
+				break; // End of the host file
+			}
+			continue;
+		}
+
+		// Up to the next block boundary (then whole blocks can be copied), or the next extent boundary
+		size_t part = direct ? fs->block_size - BLOCK_OFF(fs, desc.offset) : EXTENT_SIZE(fs) - desc.offset % EXTENT_SIZE(fs);
+		if (part > len) {
+			part = len;
+		}
+		long ret = fd_read(host_fd, buf, part);
+		if (ret <= 0) {
+			break;
+		}
+		int written = fs_write_locked(fs, &desc, buf, ret);
+		if (written > 0) {
+			done += written;
+		}
+		if (written < ret || (size_t)ret < part) {
+			break; // No more blocks available, or end of the host file
+		}
+	}
+	if (!synced) {
+		meta_sync(fs);
+	}
+	return done;
+}
+
+/**
+ *  file_advise() passes @advice (BLOCK_ADVISE_*) on to the disk for the data blocks holding blocks @first
+ *	to @last - 1 of @file, one hint per run of consecutive data blocks. Holes are skipped.
+ */
+void file_advise(fs_t *fs, struct open_file *file, size_t first, size_t last, int advice) {
+	struct file *cur_file = file->cur_file;
+	if (file_is_inline(cur_file)) {
+		return; // In the pack block, which stays in memory
+	}
+	size_t blocks = BLOCK_OF(fs, cur_file->FILE_SIZE + fs->block_size - 1);
+	if (last > blocks) {
+		last = blocks;
+	}
+	if (cur_file->FILE_FLAGS & FILE_COMPRESSED) {
+		first -= first % EXTENT_BLOCKS; // Compressed streams start with their extent
+	}
+	int run_start = -1;
+	size_t run = 0;
+	for (size_t b = first; b <= last; b++) {
+		int data_index = b < last ? block_source(fs, file_block(fs, file, b, 0)) : -1;
+		if (run > 0 && data_index == run_start + (int)run) {
+			run++;
+			continue;
+		}
+		if (run > 0) {
+			block_advise_ctx(fs->disk, fs->super_block->DATA_BLOCK + run_start, run, advice);
+		}
+		run = 0;
+		if (data_index != -1 && !(data_index & FAT_HOLE)) {
+			run_start = data_index;
+			run = 1;
+		}
+	}
+}
+
+/**
+ *  read_ahead() follows a read of bytes @start to @end - 1 through @desc. Sequential reads start reading
+ *	the next blocks of the file in the background, in windows that double up to the limit of the access
+ *	pattern; a new window is requested once half of the previous one is consumed. With
+ *	FS_ADVISE_NOREUSE, the blocks read past are dropped from the host page cache.
+ */
+void read_ahead(fs_t *fs, struct file_desc *desc, size_t start, size_t end) {
+	if (desc->noreuse) {
+		file_advise(fs, desc->file, BLOCK_OF(fs, start), BLOCK_OF(fs, end), BLOCK_ADVISE_DONTNEED);
+	}
+	size_t prev = desc->ra_prev;
+	desc->ra_prev = end;
+	if (desc->advice == FS_ADVISE_RANDOM || (desc->advice == FS_ADVISE_NORMAL && start != prev)) {
+		desc->ra_window = 0;
+		return;
+	}
+
+	size_t next = BLOCK_OF(fs, end + fs->block_size - 1);
+	if (desc->ra_window == 0 || desc->ra_next < next) {
+		desc->ra_next = next;
+	} else if (desc->ra_next - next > desc->ra_window / 2) {
+		return; // Still far enough ahead
+	}
+	size_t seq_max = BLOCK_OF(fs, READ_AHEAD_SEQ_MAX);
+	size_t max = desc->advice == FS_ADVISE_SEQUENTIAL ? seq_max : BLOCK_OF(fs, READ_AHEAD_MAX);
+	if (desc->ra_window == 0) {
+		desc->ra_window = BLOCK_OF(fs, desc->advice == FS_ADVISE_SEQUENTIAL ? READ_AHEAD_MAX : READ_AHEAD_MIN);
+	} else if (desc->ra_window < max) {
+		desc->ra_window = 2 * desc->ra_window < max ? 2 * desc->ra_window : max;
+	}
+	// At least as far ahead as the reads go at once
+	size_t len = next - BLOCK_OF(fs, start);
+	if (desc->ra_window < len) {
+		desc->ra_window = len < seq_max ? len : seq_max;
+	}
+	file_advise(fs, desc->file, desc->ra_next, next + desc->ra_window, BLOCK_ADVISE_WILLNEED);
+	desc->ra_next = next + desc->ra_window;
+}
+
+static int fs_advise_locked(fs_t *fs, struct file_desc *desc, size_t offset, size_t len, int advice)
+{
+	size_t end = len == 0 || len > SIZE_MAX - offset ? SIZE_MAX : offset + len;
+	switch (advice) {
+	case FS_ADVISE_NORMAL:
+		desc->noreuse = 0;
+		// fall through
+	case FS_ADVISE_SEQUENTIAL:
+	case FS_ADVISE_RANDOM:
+		desc->advice = advice;
+		desc->ra_window = 0;
+		return 0;
+	case FS_ADVISE_NOREUSE:
+		desc->noreuse = 1;
+		return 0;
+	case FS_ADVISE_WILLNEED:
+		file_advise(fs, desc->file, BLOCK_OF(fs, offset), BLOCK_OF(fs, end) + (BLOCK_OFF(fs, end) != 0),
+			    BLOCK_ADVISE_WILLNEED);
+		return 0;
+	case FS_ADVISE_DONTNEED:
+		// Only whole blocks, but the last block of the file goes with the end of the file
+		file_advise(fs, desc->file, BLOCK_OF(fs, offset) + (BLOCK_OFF(fs, offset) != 0),
+			    end >= desc->file->cur_file->FILE_SIZE ? SIZE_MAX : BLOCK_OF(fs, end), BLOCK_ADVISE_DONTNEED);
+		return 0;
+	}
+	return -1;
+}
+
+int fs_info_ctx(fs_t *fs)
+{
+	return fs_info_file_ctx(fs, stdout);
+}
+
+int fs_info_file_ctx(fs_t *fs, FILE *f)
+{
+	if (fs == NULL || f == NULL) { //no underlying virtual disk was opened
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_info_locked(fs, f);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_create_ctx(fs_t *fs, const char *filename)
+{
+	block_trace_set_op("fs_create");
+	record_call(TRACE_CREATE, -1, 0, filename);
+	if (fs == NULL || read_only(fs) || filename == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_create_locked(fs, filename);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_delete_ctx(fs_t *fs, const char *filename)
+{
+	block_trace_set_op("fs_delete");
+	record_call(TRACE_DELETE, -1, 0, filename);
+	if (fs == NULL || read_only(fs) || filename == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_delete_locked(fs, filename);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_ls_ctx(fs_t *fs)
+{
+	return fs_ls_file_ctx(fs, stdout);
+}
+
+int fs_ls_file_ctx(fs_t *fs, FILE *f)
+{
+	if (fs == NULL || f == NULL) { //no underlying virtual disk was opened
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_ls_locked(fs, f);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_open_ctx(fs_t *fs, const char *filename)
+{
+	return fs_open_flags_ctx(fs, filename, 0);
+}
+
+int fs_open_flags_ctx(fs_t *fs, const char *filename, int flags)
+{
+	block_trace_set_op("fs_open");
+	if (fs == NULL || filename == NULL || (flags & ~FS_O_APPEND)) {
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_open_locked(fs, filename, flags);
+	pthread_mutex_unlock(&fs->lock);
+	if (ret >= 0) {
+		record_call(TRACE_OPEN, ret, flags, filename);
+	}
+	return ret;
+}
+
+int fs_close_ctx(fs_t *fs, int fd)
+{
+	record_call(TRACE_CLOSE, fd, 0, NULL);
+	if (fs == NULL || fd < 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_close_locked(fs, fd);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_stat_ctx(fs_t *fs, int fd)
+{
+	record_call(TRACE_STAT, fd, 0, NULL);
+	if (fs == NULL || fd < 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_stat_locked(fs, fd);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_lseek_ctx(fs_t *fs, int fd, size_t offset)
+{
+	record_call(TRACE_LSEEK, fd, offset, NULL);
+	if (fs == NULL || fd < 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_lseek_locked(fs, fd, offset);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_write_ctx(fs_t *fs, int fd, void *buf, size_t count)
+{
+	block_trace_set_op("fs_write");
+	record_call(TRACE_WRITE, fd, count, NULL);
+	if (fs == NULL || read_only(fs)) {
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	wb_throttle(fs);
+	struct file_desc *desc = get_desc(fs, fd);
+	if (desc == NULL) { // fd out of bounds or file not currently open
+		pthread_mutex_unlock(&fs->lock);
+		return -1;
+	}
+	pthread_mutex_lock(&desc->file->lock);
+	int ret = fs_write_locked(fs, desc, buf, count);
+	pthread_mutex_unlock(&desc->file->lock);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_read_ctx(fs_t *fs, int fd, void *buf, size_t count)
+{
+	block_trace_set_op("fs_read");
+	record_call(TRACE_READ, fd, count, NULL);
+	if (fs == NULL || fd < 0) {
+		return -1;
+	}
+	// Nothing changes on read-only instances: no lock is needed, except for the extent cache of compressed files
+	if (fs->flags & FS_MOUNT_RDONLY) {
+		struct file_desc *desc = get_desc(fs, fd);
+		if (desc == NULL) {
+			return -1;
+		}
+		if (!(desc->file->cur_file->FILE_FLAGS & FILE_COMPRESSED)) {
+			size_t start = desc->offset;
+			int ret = fs_read_shared(fs, desc, buf, count);
+			if (ret > 0) {
+				read_ahead(fs, desc, start, desc->offset);
+			}
+			return ret;
+		}
+	}
+	pthread_mutex_lock(&fs->lock);
+	struct file_desc *desc = get_desc(fs, fd);
+	if (desc == NULL) { // fd out of bounds or file not currently open
+		pthread_mutex_unlock(&fs->lock);
+		return -1;
+	}
+	// Inline contents can be moved around by writes to other files: copy them under the instance lock
+	if (file_is_inline(desc->file->cur_file)) {
+		struct file *cur_file = desc->file->cur_file;
+		int ret = 0;
+		if (desc->offset < cur_file->FILE_SIZE) {
+			ret = cur_file->FILE_SIZE - desc->offset < count ? cur_file->FILE_SIZE - desc->offset : count;
+			memcpy(buf, fs->pack + cur_file->FILE_INLINE_OFFSET + desc->offset, ret);
+			desc->offset += ret;
+		}
+		pthread_mutex_unlock(&fs->lock);
+		return ret;
+	}
+	// Writes to other files may hand shared contents over to other blocks: read under the instance lock
+	struct open_file *file = desc->file;
+	size_t start = desc->offset;
+	if (fs->dedup_src != NULL) {
+		pthread_mutex_lock(&file->lock);
+		int ret = fs_read_locked(fs, desc, buf, count);
+		if (ret > 0) {
+			read_ahead(fs, desc, start, desc->offset);
+		}
+		pthread_mutex_unlock(&file->lock);
+		pthread_mutex_unlock(&fs->lock);
+		return ret;
+	}
+	// Reads only need the file: pin it and let other operations on the instance go on
+	file->refcount++;
+	pthread_mutex_unlock(&fs->lock);
+
+	pthread_mutex_lock(&file->lock);
+	int ret = fs_read_locked(fs, desc, buf, count);
+	if (ret > 0) {
+		read_ahead(fs, desc, start, desc->offset);
+	}
+	pthread_mutex_unlock(&file->lock);
+
+	pthread_mutex_lock(&fs->lock);
+	put_open_file(fs, file);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_read_map_ctx(fs_t *fs, int fd, struct iovec *iov, int iovcnt, size_t count)
+{
+	block_trace_set_op("fs_read_map");
+	if (fs == NULL || iov == NULL || iovcnt < 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	struct file_desc *desc = get_desc(fs, fd);
+	if (desc == NULL) { // fd out of bounds or file not currently open
+		pthread_mutex_unlock(&fs->lock);
+		return -1;
+	}
+	// Blocks are pinned under the instance lock, so that no write moves them in the meantime
+	pthread_mutex_lock(&desc->file->lock);
+	size_t start = desc->offset;
+	int ret = fs_read_map_locked(fs, desc, iov, iovcnt, count);
+	if (ret > 0) {
+		read_ahead(fs, desc, start, desc->offset);
+	}
+	pthread_mutex_unlock(&desc->file->lock);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_read_release_ctx(fs_t *fs, const struct iovec *iov, int iovcnt)
+{
+	if (fs == NULL || iovcnt < 0 || (iov == NULL && iovcnt > 0)) {
+		return -1;
+	}
+	block_trace_set_op("fs_read_release");
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_read_release_locked(fs, iov, iovcnt);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_copy_to_fd_ctx(fs_t *fs, int fd, int host_fd, size_t offset, size_t count)
+{
+	block_trace_set_op("fs_copy_to_fd");
+	if (fs == NULL || host_fd < 0) {
+		return -1;
+	}
+	size_t done = 0;
+	int ret = 0;
+	while (done < count) {
+		size_t len = count - done < COPY_CHUNK ? count - done : COPY_CHUNK;
+		pthread_mutex_lock(&fs->lock);
+		struct file_desc *desc = get_desc(fs, fd);
+		if (desc == NULL) { // fd out of bounds or file not currently open
+			pthread_mutex_unlock(&fs->lock);
+			return -1;
+		}
+		pthread_mutex_lock(&desc->file->lock);
+		ret = fs_copy_to_fd_locked(fs, desc->file, offset + done, len, host_fd);
+		if (ret > 0) {
+			read_ahead(fs, desc, offset + done, offset + done + ret);
+		}
+		pthread_mutex_unlock(&desc->file->lock);
+		pthread_mutex_unlock(&fs->lock);
+		if (ret <= 0) {
+			break;
+		}
+		done += ret;
+		if ((size_t)ret < len) {
+			break;
+		}
+	}
+	return done == 0 && ret < 0 ? -1 : (int)done;
+}
+
+int fs_copy_from_fd_ctx(fs_t *fs, int fd, int host_fd, size_t offset, size_t count)
+{
+	block_trace_set_op("fs_copy_from_fd");
+	if (fs == NULL || read_only(fs) || host_fd < 0) {
+		return -1;
+	}
+	// The length of a host file is known, so that its blocks can be allocated before they are copied
+	struct stat st;
+	off_t pos = lseek(host_fd, 0, SEEK_CUR);
+	int host_file = pos != -1 && fstat(host_fd, &st) == 0 && S_ISREG(st.st_mode);
+	if (host_file && count > (size_t)(st.st_size > pos ? st.st_size - pos : 0)) {
+		count = st.st_size > pos ? st.st_size - pos : 0;
+	}
+	char *buf = malloc(EXTENT_SIZE(fs));
+	if (buf == NULL) {
+		return -1;
+	}
+	size_t done = 0;
+	while (done < count) {
+		size_t len = count - done < COPY_CHUNK ? count - done : COPY_CHUNK;
+		pthread_mutex_lock(&fs->lock);
+		wb_throttle(fs);
+		struct file_desc *desc = get_desc(fs, fd);
+		if (desc == NULL) { // fd out of bounds or file not currently open
+			pthread_mutex_unlock(&fs->lock);
+			free(buf);
+			return -1;
+		}
+		pthread_mutex_lock(&desc->file->lock);
+		int ret = fs_copy_from_fd_locked(fs, desc->file, offset + done, len, host_fd, host_file, buf);
+		pthread_mutex_unlock(&desc->file->lock);
+		pthread_mutex_unlock(&fs->lock);
+		done += ret;
+		if ((size_t)ret < len) {
+			break;
+		}
+	}
+	free(buf);
+	return done;
+}
+
+int fs_writeback_config_ctx(fs_t *fs, const struct fs_writeback *wb)
+{
+	if (fs == NULL || wb == NULL || wb->dirty_limit < wb->dirty_background || wb->interval_ms == 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	if (fs->flusher == NULL) {
+		pthread_mutex_unlock(&fs->lock);
+		return -1;
+	}
+	fs->flusher->params = *wb;
+	// Writers waiting under the previous limit, and the flusher, check the new thresholds
+	pthread_cond_broadcast(&fs->flusher->done);
+	pthread_cond_signal(&fs->flusher->wake);
+	pthread_mutex_unlock(&fs->lock);
+	return 0;
+}
+
+int fs_advise_ctx(fs_t *fs, int fd, size_t offset, size_t len, int advice)
+{
+	if (fs == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&fs->lock);
+	struct file_desc *desc = get_desc(fs, fd);
+	if (desc == NULL) { // fd out of bounds or file not currently open
+		pthread_mutex_unlock(&fs->lock);
+		return -1;
+	}
+	pthread_mutex_lock(&desc->file->lock);
+	int ret = fs_advise_locked(fs, desc, offset, len, advice);
+	pthread_mutex_unlock(&desc->file->lock);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+/*
+ * Functions without a file system handle operate on the default instance
+ */
+
+int fs_mount(const char *diskname)
+{
+	if (default_fs != NULL) { // The default instance is already mounted
+		return -1;
+	}
+	default_fs = fs_mount_ctx(diskname);
+	return default_fs == NULL ? -1 : 0;
+}
+
+int fs_trim_ctx(fs_t *fs)
+{
+	if (fs == NULL || read_only(fs)) {
+		return -1;
+	}
+	block_trace_set_op("fs_trim");
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_trim_locked(fs);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_clone_ctx(fs_t *fs, const char *src, const char *dst)
+{
+	if (fs == NULL || read_only(fs) || src == NULL || dst == NULL) {
+		return -1;
+	}
+	block_trace_set_op("fs_clone");
+	pthread_mutex_lock(&fs->lock);
+	int ret = fs_clone_locked(fs, src, dst);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_snapshot_create_ctx(fs_t *fs, const char *name)
+{
+	if (fs == NULL || name == NULL) {
+		return -1;
+	}
+	block_trace_set_op("fs_snapshot_create");
+	pthread_mutex_lock(&fs->lock);
+	int ret = read_only(fs) ? -1 : fs_snapshot_create_locked(fs, name);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int fs_snapshot_delete_ctx(fs_t *fs, const char *name)
+{
+	if (fs == NULL || name == NULL) {
+		return -1;
+	}
+	block_trace_set_op("fs_snapshot_delete");
+	pthread_mutex_lock(&fs->lock);
+	int ret = read_only(fs) ? -1 : fs_snapshot_delete_locked(fs, name);
+	pthread_mutex_unlock(&fs->lock);
+	return ret;
+}
+
+fs_t *fs_snapshot_mount_ctx(fs_t *fs, const char *name)
+{
+	if (fs == NULL || name == NULL || fs->snapshot_of != NULL) {
+		return NULL;
+	}
+	block_trace_set_op("fs_snapshot_mount");
+	pthread_mutex_lock(&fs->lock);
+	fs_t *view = NULL;
+	int entry = snap_find(fs, name);
+	if (entry != -1) {
+		// The copies of the FAT and root directory are written (and never change afterwards), including for
+		// the metadata left to the flusher
+		if (!(fs->flags & FS_MOUNT_RDONLY)) {
+			meta_flush(fs);
+			fat_sync(fs);
+		}
+		view = mount_instance(fs->diskname, fs->flags & (FS_MOUNT_HUGEPAGES | FS_MOUNT_DIRECT | FS_MOUNT_RDONLY),
+				      &fs->snap_table[entry], fs->snap_fat_maps[entry]);
+	}
+	if (view != NULL) {
+		view->snapshot_of = fs;
+		fs->views++;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	return view;
+}
+
+int fs_umount(void)
+{
+	if (fs_umount_ctx(default_fs) == -1) {
+		return -1;
+	}
+	default_fs = NULL;
+	return 0;
+}
+
+int fs_info(void)
+{
+	return fs_info_ctx(default_fs);
+}
+
+int fs_create(const char *filename)
+{
+	return fs_create_ctx(default_fs, filename);
+}
+
+int fs_delete(const char *filename)
+{
+	return fs_delete_ctx(default_fs, filename);
+}
+
+int fs_ls(void)
+{
+	return fs_ls_ctx(default_fs);
+}
+
+int fs_info_file(FILE *f)
+{
+	return fs_info_file_ctx(default_fs, f);
+}
+
+int fs_ls_file(FILE *f)
+{
+	return fs_ls_file_ctx(default_fs, f);
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_ctx(default_fs, filename);
+}
+
+int fs_close(int fd)
+{
+	return fs_close_ctx(default_fs, fd);
+}
+
+int fs_stat(int fd)
+{
+	return fs_stat_ctx(default_fs, fd);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	return fs_lseek_ctx(default_fs, fd, offset);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	return fs_write_ctx(default_fs, fd, buf, count);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	return fs_read_ctx(default_fs, fd, buf, count);
+}
+
+int fs_trim(void)
+{
+	return fs_trim_ctx(default_fs);
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	return fs_clone_ctx(default_fs, src, dst);
+}
+
+int fs_snapshot_create(const char *name)
+{
+	return fs_snapshot_create_ctx(default_fs, name);
+}
+
+int fs_snapshot_delete(const char *name)
+{
+	return fs_snapshot_delete_ctx(default_fs, name);
+}
+
+fs_t *fs_snapshot_mount(const char *name)
+{
+	return fs_snapshot_mount_ctx(default_fs, name);
+}
+
+int fs_read_map(int fd, struct iovec *iov, int iovcnt, size_t count)
+{
+	return fs_read_map_ctx(default_fs, fd, iov, iovcnt, count);
+}
+
+int fs_read_release(const struct iovec *iov, int iovcnt)
+{
+	return fs_read_release_ctx(default_fs, iov, iovcnt);
+}
+
+int fs_copy_to_fd(int fd, int host_fd, size_t offset, size_t count)
+{
+	return fs_copy_to_fd_ctx(default_fs, fd, host_fd, offset, count);
+}
+
+int fs_copy_from_fd(int fd, int host_fd, size_t offset, size_t count)
+{
+	return fs_copy_from_fd_ctx(default_fs, fd, host_fd, offset, count);
+}
+
+int fs_advise(int fd, size_t offset, size_t len, int advice)
+{
+	return fs_advise_ctx(default_fs, fd, offset, len, advice);
+}
+
+int fs_writeback_config(const struct fs_writeback *wb)
+{
+	return fs_writeback_config_ctx(default_fs, wb);
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	return fs_open_flags_ctx(default_fs, filename, flags);
 }
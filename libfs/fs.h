@@ -2,6 +2,8 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdio.h> /* for FILE definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,9 +11,25 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/**
+ * Maximum number of data blocks of a file system: the FAT links to a block
+ * with its index OR'd with a hole bit (0x8000), which must stay clear of the
+ * 0xFFFD-0xFFFF markers
+ */
+#define FS_DATA_BLOCK_MAX 32764
+
+/**
+ * Number of file descriptors by which the open file table grows (the table is
+ * extended on demand, so there is no fixed limit on open files)
+ */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of snapshots of a file system */
+#define FS_SNAPSHOT_MAX 128
+
+/** Opaque mounted file system handle */
+typedef struct fs fs_t;
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -21,7 +39,8 @@
  * with fs_read() or written to it with fs_write().
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
- * file system can be located. 0 otherwise.
+ * file system can be located (including one of more than %FS_DATA_BLOCK_MAX
+ * data blocks). 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
@@ -90,12 +109,12 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors, which share the state of the file (size and block map). The
+ * lowest free file descriptor is not necessarily returned.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * or if the open file table cannot be extended. Otherwise, return the file
+ * descriptor.
  */
 int fs_open(const char *filename);
 
@@ -130,9 +149,13 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * The offset may be set past the end of the file. A subsequent write then
+ * leaves a hole between the former end of the file and the written data: the
+ * hole reads as zeros, and the blocks it spans are neither written nor read.
+ *
  * Return: -1 if file descriptor @fd is invalid (i.e., out of bounds, or not
- * currently open), or if @offset is larger than the current file size. 0
- * otherwise.
+ * currently open), or if @offset is past the end of the file and beyond the
+ * capacity of the disk. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -177,4 +200,480 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_mount_ctx - Mount a file system as a new instance
+ * @diskname: Name of the virtual disk file
+ *
+ * Like fs_mount(), but return a handle to an independent file system instance,
+ * with its own open file table, instead of mounting the default instance used
+ * by the functions without a handle. Several images can be mounted at the same
+ * time, and each instance can be used concurrently from several threads.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. The file system handle otherwise.
+ */
+fs_t *fs_mount_ctx(const char *diskname);
+
+/** Back the instance's metadata and I/O buffers with huge pages if possible */
+#define FS_MOUNT_HUGEPAGES 0x1
+
+/** Transfer blocks with direct I/O, bypassing the host page cache */
+#define FS_MOUNT_DIRECT 0x2
+
+/** Release the storage of deleted data in batches instead of at each delete */
+#define FS_MOUNT_DEFER_DISCARD 0x4
+
+/** Store the files created while mounted as compressed extents */
+#define FS_MOUNT_COMPRESS 0x8
+
+/** Share the data blocks written with the same contents as existing ones */
+#define FS_MOUNT_DEDUP 0x10
+
+/** Write metadata and dirty data back from a background thread */
+#define FS_MOUNT_WRITEBACK 0x20
+
+/** Mount read-only, sharing the image's memory with the other readers */
+#define FS_MOUNT_RDONLY 0x40
+
+/**
+ * fs_mount_flags - Mount a file system as a new instance, with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of %FS_MOUNT_* options
+ *
+ * Like fs_mount_ctx(). The metadata, file descriptors and I/O buffers of the
+ * instance come from a page-aligned arena which is released at once by
+ * fs_umount_ctx().
+ *
+ * The data blocks freed by fs_delete() are punched out of the virtual disk
+ * file, so that the host storage backing them is released. With
+ * %FS_MOUNT_DEFER_DISCARD, freed blocks are accumulated and released in
+ * larger batches, and at the latest when the file system is unmounted.
+ *
+ * Files created with %FS_MOUNT_COMPRESS are written in extents of 32 KiB that
+ * are compressed whenever it saves at least a block, and decompressed when
+ * read. They stay compressed, and readable, whatever the options of later
+ * mounts.
+ *
+ * With %FS_MOUNT_DEDUP, every data block written in full is hashed, and when
+ * a block with the same contents was written since the file system was
+ * mounted, the new block shares its contents instead of being written. Shared
+ * blocks are counted, and writing into, or deleting, one of them gives it back
+ * contents of its own first. Shared blocks stay readable whatever the options
+ * of later mounts.
+ *
+ * Writes update the root directory and the FAT on the disk before returning.
+ * With %FS_MOUNT_WRITEBACK, they leave it to a flusher thread owned by the
+ * instance instead. The flusher also pushes the data blocks written meanwhile
+ * from the host page cache to storage, in block order and before the metadata
+ * that refers to them, once the thresholds of fs_writeback_config_ctx() are
+ * crossed. Writers only wait for it past the hard limit, and unmounting only
+ * writes back what is left.
+ *
+ * With %FS_MOUNT_RDONLY, the image is opened read-only and mapped in memory
+ * (%MAP_SHARED): the superblock, FAT and root directory are used in place
+ * instead of being copied, so that every process mounting the image shares a
+ * single copy of them and of the data in the host page cache, and mounting
+ * reads nothing up front. Every call that would change the file system fails,
+ * and the options about writes, and %FS_MOUNT_DIRECT, are ignored. Since
+ * nothing changes, fs_read() copies the data from the mapping without taking
+ * any lock, except for compressed files; a descriptor must then not be closed
+ * while a read through it is in progress. The image must not be changed while
+ * it is mounted this way.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. The file system handle otherwise.
+ */
+fs_t *fs_mount_flags(const char *diskname, int flags);
+
+/** Allocate the host storage of the whole image when formatting it */
+#define FS_FORMAT_PREALLOC 0x1
+
+/**
+ * fs_format - Create a virtual disk file holding an empty file system
+ * @diskname: Name of the virtual disk file
+ * @data_blocks: Number of data blocks of the file system
+ * @block_size: Size of the blocks of the file system in bytes
+ * @flags: Bitwise OR of %FS_FORMAT_* options
+ *
+ * Create (or overwrite) virtual disk file @diskname and format it with an empty
+ * file system of @data_blocks data blocks of @block_size bytes. The block size
+ * is recorded in the superblock, and used by every later mount of the file
+ * system. Larger blocks make for fewer, larger transfers on large files, while
+ * smaller ones waste less room on small files. Snapshots need blocks of at
+ * least 4096 bytes. Only the superblock, the FAT and the
+ * root directory are written: the data blocks are left as holes of the sparse
+ * image (see block_disk_create()), so that formatting takes the same time
+ * whatever the size of the file system. With %FS_FORMAT_PREALLOC, the host
+ * storage of the data blocks is allocated as well, without being written.
+ *
+ * Return: -1 if @diskname is invalid, if @data_blocks is 0 or larger than
+ * %FS_DATA_BLOCK_MAX, if @block_size is not a power of two between 1024 and
+ * 65536, or if the virtual disk file cannot be
+ * created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks, size_t block_size,
+	      int flags);
+
+/**
+ * struct fs_writeback - Thresholds of the flusher of %FS_MOUNT_WRITEBACK
+ * @dirty_background: Data blocks written since the last write-back, in percent
+ * of the data blocks, from which the flusher writes them back
+ * @dirty_limit: Data blocks not written back yet, in percent of the data
+ * blocks, past which writers wait for the flusher
+ * @expire_ms: Age (in milliseconds) after which changes are written back
+ * whatever their amount
+ * @interval_ms: Period (in milliseconds) at which the flusher checks the
+ * thresholds
+ */
+struct fs_writeback {
+	unsigned int dirty_background;
+	unsigned int dirty_limit;
+	unsigned int expire_ms;
+	unsigned int interval_ms;
+};
+
+/**
+ * fs_writeback_config - Set the thresholds of the flusher
+ * @wb: New thresholds
+ *
+ * By default, the flusher wakes up every 20 ms, writes back once 10% of the
+ * data blocks are dirty or changes are 100 ms old, and writers wait past 20%.
+ *
+ * Return: -1 if the file system is not mounted with %FS_MOUNT_WRITEBACK, or if
+ * @wb is invalid (@dirty_limit below @dirty_background, or a period of 0).
+ * 0 otherwise.
+ */
+int fs_writeback_config(const struct fs_writeback *wb);
+int fs_writeback_config_ctx(fs_t *fs, const struct fs_writeback *wb);
+
+/**
+ * fs_umount_ctx - Unmount a file system instance
+ * @fs: File system handle
+ *
+ * Return: -1 if @fs is invalid, or if the virtual disk cannot be closed, or if
+ * there are still open file descriptors. 0 otherwise.
+ */
+int fs_umount_ctx(fs_t *fs);
+
+/*
+ * The following functions behave like their counterparts without a handle, but
+ * operate on file system instance @fs. File descriptors are local to an
+ * instance. They all return -1 if @fs is NULL.
+ */
+int fs_info_ctx(fs_t *fs);
+int fs_create_ctx(fs_t *fs, const char *filename);
+int fs_delete_ctx(fs_t *fs, const char *filename);
+int fs_ls_ctx(fs_t *fs);
+int fs_open_ctx(fs_t *fs, const char *filename);
+int fs_close_ctx(fs_t *fs, int fd);
+int fs_stat_ctx(fs_t *fs, int fd);
+int fs_lseek_ctx(fs_t *fs, int fd, size_t offset);
+int fs_write_ctx(fs_t *fs, int fd, void *buf, size_t count);
+int fs_read_ctx(fs_t *fs, int fd, void *buf, size_t count);
+
+/**
+ * fs_info_file - Display information about file system into a stream
+ * @f: Stream to print into
+ *
+ * Like fs_info(), but print into @f rather than the standard output, which
+ * other threads may be printing into meanwhile.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_info_file(FILE *f);
+int fs_info_file_ctx(fs_t *fs, FILE *f);
+
+/**
+ * fs_ls_file - List files on file system into a stream
+ * @f: Stream to print into
+ *
+ * Like fs_ls(), but print into @f rather than the standard output.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_ls_file(FILE *f);
+int fs_ls_file_ctx(fs_t *fs, FILE *f);
+
+/**
+ * fs_trim - Release the storage of every free data block
+ *
+ * Punch all the free data blocks out of the virtual disk file, e.g. to make an
+ * image created by a formatter that writes every block sparse.
+ *
+ * Return: -1 if no FS is currently mounted, or if the host file system cannot
+ * release blocks. Otherwise the number of free data blocks.
+ */
+int fs_trim(void);
+int fs_trim_ctx(fs_t *fs);
+
+/**
+ * fs_clone - Copy a file without copying its data
+ * @src: Name of the file to copy
+ * @dst: Name of the copy
+ *
+ * Create file @dst with the contents of file @src. The data blocks of @dst
+ * share the contents of the ones of @src instead of being written, so that
+ * only metadata is written. Writing into either file afterwards gives the
+ * written blocks contents of their own, leaving the other file untouched.
+ *
+ * Return: -1 if no FS is currently mounted, if @src doesn't exist, if @dst
+ * cannot be created, or if there aren't enough free data blocks for the
+ * blocks of @dst. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+int fs_clone_ctx(fs_t *fs, const char *src, const char *dst);
+
+/**
+ * fs_snapshot_create - Take a snapshot of the file system
+ * @name: Name of the snapshot
+ *
+ * Freeze the current state of the file system as snapshot @name. No data block
+ * is copied at creation: the data blocks of the snapshot are left untouched by
+ * subsequent writes, which go to new data blocks, and the FAT and root
+ * directory blocks are copied for the snapshot when they first change. Up to
+ * %FS_SNAPSHOT_MAX snapshots can exist at once.
+ *
+ * Creation takes time in O(FAT size), not in the size of the files: the FAT is
+ * scanned for free blocks, copied in memory as the frozen version, and written
+ * out. This is bounded by %FS_DATA_BLOCK_MAX (a FAT of at most 64 KiB), and the
+ * FAT is written whole on every metadata update anyway.
+ *
+ * Return: -1 if no FS is currently mounted, if @name is invalid or already
+ * used, if there are already %FS_SNAPSHOT_MAX snapshots, if there aren't
+ * enough free data blocks for copying the metadata, or if the blocks of the
+ * file system are smaller than 4096 bytes (see fs_format()). 0 otherwise.
+ */
+int fs_snapshot_create(const char *name);
+int fs_snapshot_create_ctx(fs_t *fs, const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Name of the snapshot
+ *
+ * Delete snapshot @name, freeing the data blocks that only it still uses.
+ *
+ * Return: -1 if no FS is currently mounted, if there is no snapshot @name, or
+ * if a snapshot is currently mounted. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+int fs_snapshot_delete_ctx(fs_t *fs, const char *name);
+
+/**
+ * fs_snapshot_mount - Mount a snapshot
+ * @name: Name of the snapshot
+ *
+ * Mount snapshot @name as a read-only instance, to be used with the _ctx
+ * functions alongside the live file system. fs_create(), fs_delete(),
+ * fs_write(), fs_trim(), fs_clone() and the snapshot functions fail on it.
+ * The instance must be unmounted with fs_umount_ctx() before the live file
+ * system is unmounted.
+ *
+ * Return: NULL if no FS is currently mounted, or if there is no snapshot
+ * @name. The mounted instance otherwise.
+ */
+fs_t *fs_snapshot_mount(const char *name);
+fs_t *fs_snapshot_mount_ctx(fs_t *fs, const char *name);
+
+/**
+ * fs_read_map - Borrow the contents of a file
+ * @fd: File descriptor
+ * @iov: Array of spans to fill
+ * @iovcnt: Number of entries in @iov
+ * @count: Number of bytes to borrow
+ *
+ * Like fs_read(), but instead of copying the next @count bytes of the file
+ * into a buffer, fill @iov with spans pointing straight at them in the memory
+ * of the disk. Each span lies within one block, unless consecutive blocks lie
+ * next to each other in memory, in which case they make a single span. Fewer
+ * than @count bytes are borrowed when @iov is full, or when the end of the file
+ * is reached. The offset of @fd moves past the borrowed bytes.
+ *
+ * The spans must not be written to. They stay valid, with the contents they had
+ * when borrowed, until released with fs_read_release(): writing into the file
+ * (or deleting it) meanwhile moves its blocks elsewhere. Holes are lent zeros,
+ * and files not stored as is (inline or compressed) are lent copies. The file
+ * system cannot be unmounted until all the spans are released.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of entries of @iov that were filled (0 at
+ * the end of the file).
+ */
+int fs_read_map(int fd, struct iovec *iov, int iovcnt, size_t count);
+int fs_read_map_ctx(fs_t *fs, int fd, struct iovec *iov, int iovcnt,
+		    size_t count);
+
+/**
+ * fs_read_release - Release borrowed contents
+ * @iov: Spans filled by fs_read_map()
+ * @iovcnt: Number of entries in @iov
+ *
+ * Give back the spans of @iov. Blocks freed while they were borrowed are only
+ * released now.
+ *
+ * Return: -1 if no FS is currently mounted, or if @iov holds spans that are
+ * not borrowed. 0 otherwise.
+ */
+int fs_read_release(const struct iovec *iov, int iovcnt);
+int fs_read_release_ctx(fs_t *fs, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_copy_to_fd - Copy a file to a host file descriptor
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor, written at its current position
+ * @offset: Offset of the first byte to copy in the file
+ * @count: Number of bytes to copy
+ *
+ * Copy @count bytes of the file, from @offset, to @host_fd. The data goes from
+ * the disk to @host_fd within the host kernel when possible (copy_file_range()
+ * or sendfile()), and the file is copied piece by piece, so that the memory
+ * needed does not depend on @count. The offset of @fd is left as is.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if nothing could be written to @host_fd. Otherwise return the
+ * number of bytes copied (fewer than @count at the end of the file).
+ */
+int fs_copy_to_fd(int fd, int host_fd, size_t offset, size_t count);
+int fs_copy_to_fd_ctx(fs_t *fs, int fd, int host_fd, size_t offset,
+		      size_t count);
+
+/**
+ * fs_copy_from_fd - Copy a host file descriptor into a file
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor, read from its current position
+ * @offset: Offset in the file at which to write
+ * @count: Number of bytes to copy
+ *
+ * Counterpart of fs_copy_to_fd(): write up to @count bytes read from @host_fd
+ * into the file, from @offset (which may be past the end of the file, like with
+ * fs_write()). Whole blocks read from a regular host file go to the disk within
+ * the host kernel, unless the file is compressed or the file system is mounted
+ * with %FS_MOUNT_DEDUP.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes copied (fewer than @count at the
+ * end of @host_fd, or if the disk runs out of space).
+ */
+int fs_copy_from_fd(int fd, int host_fd, size_t offset, size_t count);
+int fs_copy_from_fd_ctx(fs_t *fs, int fd, int host_fd, size_t offset,
+			size_t count);
+
+/** Access patterns and hints for fs_advise() */
+#define FS_ADVISE_NORMAL 0 /* No particular pattern (default) */
+#define FS_ADVISE_SEQUENTIAL 1 /* Read in order: read ahead aggressively */
+#define FS_ADVISE_RANDOM 2 /* Read in no order: never read ahead */
+#define FS_ADVISE_WILLNEED 3 /* The range is about to be read */
+#define FS_ADVISE_DONTNEED 4 /* The range is not to be read again soon */
+#define FS_ADVISE_NOREUSE 5 /* Data is read once: don't keep it cached */
+
+/**
+ * fs_advise - Give a hint about the use of a file
+ * @fd: File descriptor
+ * @offset: Offset of the first byte of the range
+ * @len: Length of the range (0 for up to the end of the file)
+ * @advice: One of the %FS_ADVISE_* hints
+ *
+ * %FS_ADVISE_NORMAL, %FS_ADVISE_SEQUENTIAL and %FS_ADVISE_RANDOM set the access
+ * pattern of @fd, which sizes the read-ahead done on its reads: it grows with
+ * sequential reads up to 1 MiB by default, up to 4 MiB for
+ * %FS_ADVISE_SEQUENTIAL, and is disabled for %FS_ADVISE_RANDOM.
+ * %FS_ADVISE_NOREUSE makes the data read through @fd leave the host page cache
+ * as soon as it has been read, so that a scan does not evict the data of other
+ * readers; %FS_ADVISE_NORMAL clears it. The range is ignored for these hints.
+ *
+ * %FS_ADVISE_WILLNEED starts reading the blocks of the range in the background,
+ * and %FS_ADVISE_DONTNEED drops them from the host page cache. Hints about the
+ * cache have no effect with %FS_MOUNT_DIRECT.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open) or if @advice is unknown. 0 otherwise.
+ */
+int fs_advise(int fd, size_t offset, size_t len, int advice);
+int fs_advise_ctx(fs_t *fs, int fd, size_t offset, size_t len, int advice);
+
+/** Options of fs_open_flags() */
+#define FS_O_APPEND 0x1 /* Every write goes to the end of the file */
+
+/**
+ * fs_open_flags - Open a file with options
+ * @filename: File name
+ * @flags: Bitwise OR of %FS_O_* options, or 0
+ *
+ * Open file named @filename like fs_open(). With %FS_O_APPEND, the file offset
+ * is moved to the end of the file before each write, and appends are
+ * optimized: the partial last block of the file stays in memory, so that it is
+ * never read back from the disk, and new blocks are linked to the end of the
+ * file without rewriting the rest of the FAT. Reads still start at the file
+ * offset, which fs_lseek() can move.
+ *
+ * Return: -1 if @filename is invalid, there is no file named @filename to open,
+ * if @flags is invalid, or if the open file table cannot be extended.
+ * Otherwise, return the file descriptor.
+ */
+int fs_open_flags(const char *filename, int flags);
+int fs_open_flags_ctx(fs_t *fs, const char *filename, int flags);
+
+/**
+ * fs_record_start - Start recording file system calls
+ * @tracename: Name of the trace file to create
+ *
+ * Record every subsequent call to fs_create(), fs_delete(), fs_open(),
+ * fs_close(), fs_stat(), fs_lseek(), fs_write() and fs_read() into the binary
+ * trace file @tracename, along with its arguments and the time at which it was
+ * issued. The content of the data buffers is not recorded.
+ *
+ * Return: -1 if @tracename is invalid or cannot be created, or if a recording
+ * is already in progress. 0 otherwise.
+ */
+int fs_record_start(const char *tracename);
+
+/**
+ * fs_record_stop - Stop recording file system calls
+ *
+ * Return: -1 if no recording is in progress, or if the trace file cannot be
+ * written. 0 otherwise.
+ */
+int fs_record_stop(void);
+
+/** Replay a trace at its original inter-arrival times */
+#define FS_REPLAY_TIMED 0x1
+
+/**
+ * struct fs_replay_stats - Results of a trace replay
+ * @ops: Number of replayed calls
+ * @errors: Number of replayed calls that failed
+ * @bytes: Number of bytes read and written
+ * @seconds: Duration of the replay
+ * @p50_us: Median call latency (in microseconds)
+ * @p99_us: 99th percentile call latency (in microseconds)
+ * @p999_us: 99.9th percentile call latency (in microseconds)
+ */
+struct fs_replay_stats {
+	size_t ops;
+	size_t errors;
+	size_t bytes;
+	double seconds;
+	double p50_us;
+	double p99_us;
+	double p999_us;
+};
+
+/**
+ * fs_replay - Replay a recorded trace
+ * @tracename: Name of the trace file to replay
+ * @flags: %FS_REPLAY_TIMED to respect the recorded timing, 0 to replay as fast
+ * as possible
+ * @nthreads: Number of replay threads
+ * @stats: Structure to be filled with the replay results
+ *
+ * Replay the calls recorded in @tracename against the currently mounted file
+ * system. Calls recorded by the same thread are replayed in order by the same
+ * replay thread; calls recorded by different threads are spread over
+ * @nthreads replay threads. Written data is a fixed pattern.
+ *
+ * Return: -1 if no file system is mounted, if @tracename cannot be read or is
+ * not a valid trace, or if @nthreads is not positive. 0 otherwise.
+ */
+int fs_replay(const char *tracename, int flags, int nthreads,
+	      struct fs_replay_stats *stats);
+
 #endif /* _FS_H */
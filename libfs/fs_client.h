@@ -0,0 +1,92 @@
+#ifndef _FS_CLIENT_H
+#define _FS_CLIENT_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Opaque connection to a file system server */
+typedef struct fs_client fs_client_t;
+
+/**
+ * fs_client_connect - Connect to a file system server
+ * @socketname: Path of the Unix domain socket of the server
+ *
+ * Connect to an fs_server instance, which serves the file system it mounted to
+ * local clients. The connection can be used concurrently from several threads:
+ * their calls are sent as soon as they are made, without waiting for the
+ * replies to the calls of the other threads, and each call returns once its own
+ * reply has arrived. File descriptors are local to a connection, and are closed
+ * by the server when the connection is closed.
+ *
+ * Return: NULL if the server cannot be reached. The connection handle
+ * otherwise.
+ */
+fs_client_t *fs_client_connect(const char *socketname);
+
+/**
+ * fs_client_disconnect - Close a connection to a file system server
+ * @client: Connection handle
+ *
+ * Return: -1 if @client is invalid. 0 otherwise.
+ */
+int fs_client_disconnect(fs_client_t *client);
+
+/*
+ * The following functions behave like their counterparts of fs.h, but are
+ * performed by the server of connection @client. fs_client_info() and
+ * fs_client_ls() print the output of the server on the standard output. They
+ * all return -1 if @client is NULL, or if the connection is lost.
+ */
+int fs_client_info(fs_client_t *client);
+int fs_client_ls(fs_client_t *client);
+int fs_client_create(fs_client_t *client, const char *filename);
+int fs_client_delete(fs_client_t *client, const char *filename);
+int fs_client_open(fs_client_t *client, const char *filename);
+int fs_client_open_flags(fs_client_t *client, const char *filename, int flags);
+int fs_client_close(fs_client_t *client, int fd);
+int fs_client_stat(fs_client_t *client, int fd);
+int fs_client_lseek(fs_client_t *client, int fd, size_t offset);
+int fs_client_write(fs_client_t *client, int fd, void *buf, size_t count);
+int fs_client_read(fs_client_t *client, int fd, void *buf, size_t count);
+int fs_client_advise(fs_client_t *client, int fd, size_t offset, size_t len,
+		     int advice);
+int fs_client_trim(fs_client_t *client);
+int fs_client_clone(fs_client_t *client, const char *src, const char *dst);
+int fs_client_snapshot_create(fs_client_t *client, const char *name);
+int fs_client_snapshot_delete(fs_client_t *client, const char *name);
+
+/**
+ * fs_client_copy_to_fd - Copy data of a file to a host file descriptor
+ * @client: Connection handle
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor to write to
+ * @offset: Offset of the data in the file
+ * @count: Number of bytes to copy
+ *
+ * Like fs_copy_to_fd(), for bulk reads: @host_fd is passed to the server, which
+ * copies the data from the image to it directly, without sending it over the
+ * connection.
+ *
+ * Return: -1 if @client or file descriptor @fd is invalid, or if @host_fd
+ * cannot be written. Otherwise return the number of bytes copied.
+ */
+int fs_client_copy_to_fd(fs_client_t *client, int fd, int host_fd,
+			 size_t offset, size_t count);
+
+/**
+ * fs_client_copy_from_fd - Copy data from a host file descriptor to a file
+ * @client: Connection handle
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor to read from
+ * @offset: Offset of the data in the file
+ * @count: Number of bytes to copy
+ *
+ * Like fs_copy_from_fd(), for bulk writes: @host_fd is passed to the server,
+ * which copies the data from it to the image directly.
+ *
+ * Return: -1 if @client or file descriptor @fd is invalid. Otherwise return the
+ * number of bytes copied.
+ */
+int fs_client_copy_from_fd(fs_client_t *client, int fd, int host_fd,
+			   size_t offset, size_t count);
+
+#endif /* _FS_CLIENT_H */
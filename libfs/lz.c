@@ -0,0 +1,189 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Shortest back-reference */
+#define LZ_MIN_MATCH 4
+
+/* Farthest back-reference (offsets are stored on 16 bits) */
+#define LZ_MAX_OFFSET 0xFFFF
+
+/* The last bytes are always literals, so that matching can read 4 bytes ahead */
+#define LZ_LAST_LITERALS 5
+
+/* Size of the table of recent positions, indexed by a hash of 4 bytes */
+#define LZ_HASH_BITS 12
+
+/* Number of failed lookups after which positions get skipped, faster and faster */
+#define LZ_SKIP_TRIGGER 32
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Append the extension bytes of a length that did not fit in its nibble */
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = len;
+	return op;
+}
+
+/* Append a sequence: @lit_len literals from @lit, then a match (if @match_len) */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			     size_t lit_len, size_t offset, size_t match_len)
+{
+	uint8_t *token = op++;
+	size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+	if (token >= oend)
+		return NULL;
+
+	*token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+	if (lit_len >= 15 && !(op = put_length(op, oend, lit_len - 15)))
+		return NULL;
+
+	if ((size_t)(oend - op) < lit_len)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (!match_len)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+	if (ml >= 15 && !(op = put_length(op, oend, ml - 15)))
+		return NULL;
+
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *base = src, *ip = base, *anchor = base;
+	const uint8_t *limit = base + (len > LZ_LAST_LITERALS ? len - LZ_LAST_LITERALS : 0);
+	uint8_t *op = dst, *oend = op + cap;
+	uint32_t table[1 << LZ_HASH_BITS];
+	size_t misses = 0;
+
+	memset(table, 0xFF, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= limit) {
+		uint32_t h = hash32(read32(ip));
+		uint32_t cand = table[h];
+		const uint8_t *match = base + cand;
+		size_t mlen;
+
+		table[h] = ip - base;
+		if (cand == UINT32_MAX || ip - match > LZ_MAX_OFFSET ||
+		    read32(match) != read32(ip)) {
+			/* Incompressible data is scanned quickly, and given up on
+			 * as soon as its literals cannot fit anymore */
+			ip += 1 + misses++ / LZ_SKIP_TRIGGER;
+			if ((size_t)(ip - anchor) > (size_t)(oend - op))
+				return 0;
+			continue;
+		}
+		misses = 0;
+
+		/* Extend the match, up to the trailing literals */
+		mlen = LZ_MIN_MATCH;
+		while (ip + mlen < limit && match[mlen] == ip[mlen])
+			mlen++;
+
+		op = put_sequence(op, oend, anchor, ip - anchor, ip - match, mlen);
+		if (!op)
+			return 0;
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = put_sequence(op, oend, anchor, base + len - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *)dst;
+}
+
+/* Read the extension bytes of a length whose nibble was 15 */
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+long lz_decompress(const void *src, size_t clen, void *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = ip + clen;
+	uint8_t *base = dst, *op = base, *oend = base + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit_len = token >> 4, mlen = token & 0xF, offset;
+		const uint8_t *match;
+
+		if (lit_len == 15 && get_length(&ip, iend, &lit_len))
+			return -1;
+		if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len)
+			return -1;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* The last sequence only has literals */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (mlen == 15 && get_length(&ip, iend, &mlen))
+			return -1;
+		mlen += LZ_MIN_MATCH;
+
+		if (!offset || offset > (size_t)(op - base) ||
+		    (size_t)(oend - op) < mlen)
+			return -1;
+
+		/* Overlapping matches repeat the last @offset bytes: copy them
+		 * by chunks of @offset bytes, which never overlap */
+		match = op - offset;
+		while (mlen > 0) {
+			size_t chunk = mlen < offset ? mlen : offset;
+
+			memcpy(op, match, chunk);
+			op += chunk;
+			mlen -= chunk;
+		}
+	}
+
+	return op - base;
+}
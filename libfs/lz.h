@@ -0,0 +1,36 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/*
+ * Byte-oriented LZ77 codec, in the spirit of LZ4: a compressed stream is a
+ * sequence of (literal run, back-reference) pairs, each introduced by a token
+ * byte holding both lengths, and ends with a literal run.
+ */
+
+/*
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Number of bytes of @src
+ * @dst: Buffer to be filled with the compressed stream
+ * @cap: Number of bytes available in @dst
+ *
+ * Return: the size of the compressed stream, or 0 if it does not fit in @cap
+ * bytes.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/*
+ * lz_decompress - Decompress a buffer
+ * @src: Compressed stream
+ * @clen: Size of the compressed stream
+ * @dst: Buffer to be filled with the decompressed data
+ * @cap: Number of bytes available in @dst
+ *
+ * Return: the number of decompressed bytes, or -1 if @src is not a valid
+ * stream or decompresses to more than @cap bytes.
+ */
+long lz_decompress(const void *src, size_t clen, void *dst, size_t cap);
+
+#endif /* _LZ_H */
@@ -0,0 +1,57 @@
+#ifndef _PROTO_H
+#define _PROTO_H
+
+#include <stdint.h>
+
+/*
+ * Protocol between fs_server and the client library (fs_client.h), over a Unix
+ * domain stream socket. Each message is a fixed header followed by @len bytes
+ * of payload, in host byte order. A client may send requests without waiting
+ * for the replies of the previous ones: the requests of a connection are
+ * performed in order, and their replies come back in the same order.
+ */
+
+/* Operations */
+enum {
+	PROTO_INFO = 1,
+	PROTO_LS,
+	PROTO_CREATE,		/* payload: name */
+	PROTO_DELETE,		/* payload: name */
+	PROTO_OPEN,		/* payload: name, arg0: FS_O_* flags */
+	PROTO_CLOSE,
+	PROTO_STAT,
+	PROTO_LSEEK,		/* arg0: offset */
+	PROTO_WRITE,		/* payload: data */
+	PROTO_READ,		/* arg0: count; reply payload: data */
+	PROTO_COPY_TO_FD,	/* host descriptor passed; arg0: offset, arg1: count */
+	PROTO_COPY_FROM_FD,	/* host descriptor passed; arg0: offset, arg1: count */
+	PROTO_ADVISE,		/* arg0: offset, arg1: len, arg2: advice */
+	PROTO_TRIM,
+	PROTO_CLONE,		/* payload: source name, NUL, destination name */
+	PROTO_SNAPSHOT_CREATE,	/* payload: name */
+	PROTO_SNAPSHOT_DELETE,	/* payload: name */
+};
+
+/* Largest payload of a message */
+#define PROTO_PAYLOAD_MAX (16 << 20)
+
+/* Request: @id is echoed by its reply */
+struct proto_req {
+	uint32_t id;
+	uint8_t op;
+	uint8_t padding[3];
+	int32_t fd;
+	uint32_t len;
+	uint64_t arg0;
+	uint64_t arg1;
+	uint64_t arg2;
+} __attribute__((packed));
+
+/* Reply: result of the call, and for PROTO_INFO and PROTO_LS, its output */
+struct proto_rep {
+	uint32_t id;
+	int32_t ret;
+	uint32_t len;
+} __attribute__((packed));
+
+#endif /* _PROTO_H */
@@ -0,0 +1,421 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "replay.h"
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Trace file signature */
+#define TRACE_MAGIC "FSTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+/* Maximum number of recorded streams (one per recording thread) */
+#define TRACE_MAX_STREAMS 256
+
+/* On-disk trace record, followed by @name_len bytes of file name */
+struct trace_rec {
+	uint8_t op;
+	uint8_t stream;
+	uint8_t name_len;
+	uint8_t padding;
+	uint32_t delta_us; // Time elapsed since the previous record
+	int32_t fd;
+	uint32_t arg;
+} __attribute__((packed));
+
+/* Recording in progress (none by default) */
+static struct {
+	FILE *f;
+	pthread_mutex_t lock;
+	uint64_t last_us;
+	int streams;
+} recorder = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Stream of the calling thread (assigned on its first recorded call) */
+static __thread int record_stream = -1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_us(void)
+{
+	return now_ns() / 1000;
+}
+
+int fs_record_start(const char *tracename)
+{
+	FILE *f;
+
+	if (!tracename)
+		return -1;
+
+	pthread_mutex_lock(&recorder.lock);
+	if (recorder.f) {
+		pthread_mutex_unlock(&recorder.lock);
+		replay_error("recording already in progress");
+		return -1;
+	}
+
+	f = fopen(tracename, "wb");
+	if (!f || fwrite(TRACE_MAGIC, TRACE_MAGIC_LEN, 1, f) != 1) {
+		pthread_mutex_unlock(&recorder.lock);
+		perror("fopen");
+		if (f)
+			fclose(f);
+		return -1;
+	}
+
+	recorder.last_us = now_us();
+	recorder.streams = 0;
+	__atomic_store_n(&recorder.f, f, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&recorder.lock);
+
+	return 0;
+}
+
+int fs_record_stop(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&recorder.lock);
+	if (!recorder.f) {
+		pthread_mutex_unlock(&recorder.lock);
+		replay_error("no recording in progress");
+		return -1;
+	}
+
+	if (fclose(recorder.f))
+		ret = -1;
+	__atomic_store_n(&recorder.f, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&recorder.lock);
+
+	return ret;
+}
+
+void record_call(int op, int fd, size_t arg, const char *name)
+{
+	struct trace_rec rec = { 0 };
+	uint64_t now;
+
+	if (!__atomic_load_n(&recorder.f, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&recorder.lock);
+	if (!recorder.f)
+		goto out;
+
+	if (record_stream == -1)
+		record_stream = recorder.streams++ % TRACE_MAX_STREAMS;
+
+	now = now_us();
+	rec.op = op;
+	rec.stream = record_stream;
+	rec.delta_us = now - recorder.last_us;
+	rec.fd = fd;
+	rec.arg = arg;
+	if (name)
+		rec.name_len = strnlen(name, FS_FILENAME_LEN - 1);
+	recorder.last_us = now;
+
+	fwrite(&rec, sizeof(rec), 1, recorder.f);
+	if (rec.name_len)
+		fwrite(name, rec.name_len, 1, recorder.f);
+out:
+	pthread_mutex_unlock(&recorder.lock);
+}
+
+/* In-memory replayed call */
+struct replay_op {
+	uint64_t ts_us; // Time since the beginning of the trace
+	int op;
+	int stream;
+	int fd;
+	size_t arg;
+	char name[FS_FILENAME_LEN];
+};
+
+/* Replay shared by all the replay threads */
+struct replay {
+	struct replay_op *ops;
+	size_t count;
+	int flags;
+	int nthreads;
+	uint64_t start_us;
+};
+
+/* Per replay thread state (latencies are in nanoseconds) */
+struct replay_thread {
+	struct replay *replay;
+	int index;
+	pthread_t thread;
+	/* Recorded to replayed descriptors, for each stream */
+	int *fdmap[TRACE_MAX_STREAMS];
+	int fdmap_len[TRACE_MAX_STREAMS];
+	int invalid_fd;
+	char *buf;
+	size_t buf_len;
+	/* Results */
+	uint64_t *lat;
+	size_t nlat;
+	size_t errors;
+	size_t bytes;
+};
+
+static int load_trace(const char *tracename, struct replay *replay)
+{
+	char magic[TRACE_MAGIC_LEN];
+	struct trace_rec rec;
+	size_t cap = 0;
+	uint64_t ts = 0;
+	FILE *f;
+
+	f = fopen(tracename, "rb");
+	if (!f) {
+		perror("fopen");
+		return -1;
+	}
+
+	if (fread(magic, TRACE_MAGIC_LEN, 1, f) != 1 ||
+	    memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN)) {
+		replay_error("invalid trace '%s'", tracename);
+		fclose(f);
+		return -1;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		struct replay_op *op;
+
+		if (replay->count == cap) {
+			cap = cap ? cap * 2 : 1024;
+			op = realloc(replay->ops, cap * sizeof(*op));
+			if (!op) {
+				perror("realloc");
+				fclose(f);
+				return -1;
+			}
+			replay->ops = op;
+		}
+
+		if (rec.name_len >= FS_FILENAME_LEN) {
+			replay_error("corrupted trace '%s'", tracename);
+			fclose(f);
+			return -1;
+		}
+
+		op = &replay->ops[replay->count++];
+		ts += rec.delta_us;
+		op->ts_us = ts;
+		op->op = rec.op;
+		op->stream = rec.stream;
+		op->fd = rec.fd;
+		op->arg = rec.arg;
+		memset(op->name, 0, FS_FILENAME_LEN);
+		if (rec.name_len && fread(op->name, rec.name_len, 1, f) != 1) {
+			replay_error("truncated trace '%s'", tracename);
+			fclose(f);
+			return -1;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/* Replayed descriptor corresponding to recorded descriptor @fd */
+static int *map_fd(struct replay_thread *t, int stream, int fd)
+{
+	t->invalid_fd = -1;
+	if (fd < 0)
+		return &t->invalid_fd;
+
+	if (fd >= t->fdmap_len[stream]) {
+		int len = fd + 32;
+		int *map = realloc(t->fdmap[stream], len * sizeof(*map));
+
+		if (!map)
+			return &t->invalid_fd;
+		for (int i = t->fdmap_len[stream]; i < len; i++)
+			map[i] = -1;
+		t->fdmap[stream] = map;
+		t->fdmap_len[stream] = len;
+	}
+
+	return &t->fdmap[stream][fd];
+}
+
+static int replay_one(struct replay_thread *t, struct replay_op *op)
+{
+	int *fd = map_fd(t, op->stream, op->fd);
+	int ret = -1;
+
+	if ((op->op == TRACE_WRITE || op->op == TRACE_READ) &&
+	    op->arg > t->buf_len) {
+		char *buf = realloc(t->buf, op->arg);
+
+		if (!buf)
+			return -1;
+		memset(buf + t->buf_len, 'r', op->arg - t->buf_len);
+		t->buf = buf;
+		t->buf_len = op->arg;
+	}
+
+	switch (op->op) {
+	case TRACE_CREATE:
+		ret = fs_create(op->name);
+		break;
+	case TRACE_DELETE:
+		ret = fs_delete(op->name);
+		break;
+	case TRACE_OPEN:
+		ret = *fd = fs_open_flags(op->name, op->arg);
+		break;
+	case TRACE_CLOSE:
+		ret = fs_close(*fd);
+		*fd = -1;
+		break;
+	case TRACE_STAT:
+		ret = fs_stat(*fd);
+		break;
+	case TRACE_LSEEK:
+		ret = fs_lseek(*fd, op->arg);
+		break;
+	case TRACE_WRITE:
+		ret = fs_write(*fd, t->buf, op->arg);
+		if (ret > 0)
+			t->bytes += ret;
+		break;
+	case TRACE_READ:
+		ret = fs_read(*fd, t->buf, op->arg);
+		if (ret > 0)
+			t->bytes += ret;
+		break;
+	}
+
+	return ret;
+}
+
+static void *replay_thread(void *arg)
+{
+	struct replay_thread *t = arg;
+	struct replay *replay = t->replay;
+
+	t->lat = malloc(replay->count * sizeof(*t->lat));
+	if (!t->lat)
+		return NULL;
+
+	for (size_t i = 0; i < replay->count; i++) {
+		struct replay_op *op = &replay->ops[i];
+		uint64_t start;
+		int ret;
+
+		if (op->stream % replay->nthreads != t->index)
+			continue;
+
+		/* Wait for the original arrival time of the call */
+		if (replay->flags & FS_REPLAY_TIMED) {
+			uint64_t at = replay->start_us + op->ts_us;
+			struct timespec ts = {
+				.tv_sec = at / 1000000,
+				.tv_nsec = (at % 1000000) * 1000,
+			};
+
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		start = now_ns();
+		ret = replay_one(t, op);
+		t->lat[t->nlat++] = now_ns() - start;
+
+		if (ret < 0)
+			t->errors++;
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(uint64_t *lat, size_t n, double p)
+{
+	return n ? lat[(size_t)(p * (n - 1) + 0.5)] / 1000.0 : 0;
+}
+
+int fs_replay(const char *tracename, int flags, int nthreads,
+	      struct fs_replay_stats *stats)
+{
+	struct replay replay = {
+		.flags = flags,
+		.nthreads = nthreads,
+	};
+	struct replay_thread *threads;
+	uint64_t *lat;
+	int i, ret = -1;
+
+	if (!tracename || !stats || nthreads <= 0 || !fs_mounted())
+		return -1;
+
+	if (load_trace(tracename, &replay))
+		goto out_ops;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	lat = malloc((replay.count + 1) * sizeof(*lat));
+	if (!threads || !lat) {
+		perror("malloc");
+		goto out_threads;
+	}
+
+	replay.start_us = now_us();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].replay = &replay;
+		threads[i].index = i;
+		pthread_create(&threads[i].thread, NULL, replay_thread,
+			       &threads[i]);
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < nthreads; i++) {
+		struct replay_thread *t = &threads[i];
+
+		pthread_join(t->thread, NULL);
+		if (t->lat)
+			memcpy(lat + stats->ops, t->lat, t->nlat * sizeof(*lat));
+		stats->ops += t->nlat;
+		stats->errors += t->errors;
+		stats->bytes += t->bytes;
+
+		free(t->lat);
+		free(t->buf);
+		for (int s = 0; s < TRACE_MAX_STREAMS; s++)
+			free(t->fdmap[s]);
+	}
+	stats->seconds = (now_us() - replay.start_us) / 1e6;
+
+	qsort(lat, stats->ops, sizeof(*lat), cmp_u64);
+	stats->p50_us = percentile(lat, stats->ops, 0.50);
+	stats->p99_us = percentile(lat, stats->ops, 0.99);
+	stats->p999_us = percentile(lat, stats->ops, 0.999);
+	ret = 0;
+
+out_threads:
+	free(lat);
+	free(threads);
+out_ops:
+	free(replay.ops);
+	return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef _REPLAY_H
+#define _REPLAY_H
+
+#include <stddef.h> /* for size_t definition */
+
+/* Recorded file system calls */
+enum {
+	TRACE_CREATE = 1,
+	TRACE_DELETE,
+	TRACE_OPEN,
+	TRACE_CLOSE,
+	TRACE_STAT,
+	TRACE_LSEEK,
+	TRACE_WRITE,
+	TRACE_READ,
+};
+
+/*
+ * record_call - Record a file system call if a recording is in progress
+ * @op: Recorded call (TRACE_*)
+ * @fd: File descriptor argument (or resulting descriptor for TRACE_OPEN)
+ * @arg: Size or offset argument (or open flags for TRACE_OPEN)
+ * @name: File name argument (or NULL)
+ */
+void record_call(int op, int fd, size_t arg, const char *name);
+
+/*
+ * fs_mounted - Tell whether a file system is currently mounted
+ */
+int fs_mounted(void);
+
+#endif /* _REPLAY_H */